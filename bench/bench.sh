@@ -0,0 +1,116 @@
+#!/bin/bash
+
+# Benchmark fcheck on generated images of increasing size.
+#
+# Usage: bench.sh [-r REPEAT] [-n INODES] [-f FANOUT] [-l LINK_PCT] [-x INDIRECT_PCT] [-S] [-c] [SIZE_MB...]
+#
+# For each size (default: 1 16 256 1024 4096 MB) a consistent image is
+# generated with mkimage (kept in $BENCH_DIR, default /tmp/fcheck-bench, and
+# reused while its parameters are unchanged) and fcheck is timed on it in
+# each mode below. Every run prints one JSON object per line on stdout, e.g.
+#   bash bench/bench.sh > bench_output.txt
+# Progress goes to stderr. Times are the best of REPEAT runs (default 3);
+# max_rss_kb is the peak over all runs.
+#
+# -S scatters each image's data blocks over the disk (mkimage -S), so the
+# inode table points all over it, and -c drops the image from the page cache
+# before every run. Together they show what prefetching saves on reads that
+# would otherwise stall one after another:
+#   bash bench/bench.sh -S -c 1024
+
+# Get the directory where this script is located
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" &> /dev/null && pwd)"
+BENCH_DIR="${BENCH_DIR:-/tmp/fcheck-bench}"
+BIN_DIR="$BENCH_DIR/bin"
+
+# Parse options
+repeat=3
+cold=0
+gen_args=()
+while getopts "r:n:f:l:x:Sc" opt; do
+    case $opt in
+        r) repeat="$OPTARG" ;;
+        n|f|l|x) gen_args+=("-$opt" "$OPTARG") ;;
+        S) gen_args+=("-S") ;;
+        c) cold=1 ;;
+        *) echo "Usage: bench.sh [-r REPEAT] [-n INODES] [-f FANOUT] [-l LINK_PCT] [-x INDIRECT_PCT] [-S] [-c] [SIZE_MB...]" >&2
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+sizes=("$@")
+if [ ${#sizes[@]} -eq 0 ]; then
+    sizes=(1 16 256 1024 4096)
+fi
+
+# fcheck option sets to time on every image
+modes=(
+    ""
+    "--prefetch=0"
+    "-j 4"
+    "--io=stream"
+    "--engine=sort"
+)
+
+# Build fcheck and the helpers
+mkdir -p "$BIN_DIR" || exit 1
+gcc "$SCRIPT_DIR/../submit/fcheck.c" "$SCRIPT_DIR/../submit/libfcheck.c" "$SCRIPT_DIR/../submit/libfcheck_1k.c" \
+    "$SCRIPT_DIR/../submit/libfcheck_4k.c" -o "$BIN_DIR/fcheck" -Wall -Werror -O -std=gnu11 -pthread &&
+gcc "$SCRIPT_DIR/mkimage.c" -o "$BIN_DIR/mkimage" -Wall -Werror -O -std=gnu11 &&
+gcc "$SCRIPT_DIR/runbench.c" -o "$BIN_DIR/runbench" -Wall -Werror -O -std=gnu11
+if [ $? -ne 0 ]; then
+    echo "Compilation failed." >&2
+    exit 1
+fi
+
+commit=$(git -C "$SCRIPT_DIR" rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git -C "$SCRIPT_DIR" diff --quiet HEAD -- ../submit 2>/dev/null; then
+    commit="$commit-dirty"
+fi
+
+# Pull the value of `key` out of a line of key=value pairs
+field() {
+    echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+for size in "${sizes[@]}"; do
+    # Generate the image unless one with the same parameters is already there
+    image="$BENCH_DIR/img-${size}M$(printf '%s' "${gen_args[@]}" | tr -d ' ')"
+    if [ ! -f "$image" ] || [ ! -f "$image.info" ]; then
+        echo "Generating $image..." >&2
+        if ! "$BIN_DIR/mkimage" -s "$size" "${gen_args[@]}" "$image" > "$image.info"; then
+            rm -f "$image" "$image.info"
+            exit 1
+        fi
+    fi
+    info=$(cat "$image.info")
+    ninodes=$(field ninodes "$info")
+
+    for mode in "${modes[@]}"; do
+        echo "Timing fcheck ${mode:+$mode }on ${size} MB..." >&2
+        cold_args=()
+        if [ "$cold" -eq 1 ]; then
+            cold_args=(-c "$image")
+        fi
+        result=$("$BIN_DIR/runbench" -r "$repeat" "${cold_args[@]}" "$BIN_DIR/fcheck" $mode "$image")
+        wall=$(field wall_s "$result")
+
+        # One JSON object per run
+        awk -v commit="$commit" -v size="$size" -v mode="$mode" -v ninodes="$ninodes" \
+            -v dirs="$(field dirs "$info")" -v files="$(field files "$info")" \
+            -v links="$(field links "$info")" -v large="$(field large_files "$info")" \
+            -v fanout="$(field fanout "$info")" -v used="$(field used_blocks "$info")" \
+            -v scatter="$(field scatter "$info")" -v cold="$cold" \
+            -v status="$(field status "$result")" -v wall="$wall" \
+            -v user="$(field user_s "$result")" -v sys="$(field sys_s "$result")" \
+            -v rss="$(field max_rss_kb "$result")" -v repeat="$repeat" 'BEGIN {
+            mbs = wall > 0 ? size / wall : 0
+            ips = wall > 0 ? ninodes / wall : 0
+            printf "{\"commit\":\"%s\",\"size_mb\":%d,\"ninodes\":%d,\"dirs\":%d,\"files\":%d,", commit, size, ninodes, dirs, files
+            printf "\"links\":%d,\"large_files\":%d,\"fanout\":%d,\"used_blocks\":%d,", links, large, fanout, used
+            printf "\"scatter\":%d,\"cold\":%d,", scatter, cold
+            printf "\"mode\":\"%s\",\"repeat\":%d,\"status\":%d,\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,", mode, repeat, status, wall, user, sys
+            printf "\"max_rss_kb\":%d,\"mb_per_s\":%.1f,\"inodes_per_s\":%.0f}\n", rss, mbs, ips
+        }'
+    done
+done
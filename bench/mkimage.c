@@ -0,0 +1,411 @@
+// mkimage: generate a consistent xv6 file system image for benchmarking fcheck.
+//
+// The image is a directory tree with a fixed fan-out: inode 1 is the root,
+// inodes 1..ndirs are directories and the rest are regular files. Inode i
+// (i >= 2) lives in directory 1 + (i - 2) / fanout, so every inode is
+// reachable and every directory but the root has exactly one parent. A
+// percentage of the files get a second link in another directory, and a
+// percentage are large enough to need an indirect block. Data blocks are
+// handed out in inode order from the start of the data area; whatever the
+// inodes do not need is left free. With -S the same blocks are scattered
+// over the whole data area instead, so consecutive inodes point all over
+// the disk.
+//
+// Only metadata, directory blocks and indirect blocks are written. File
+// contents are never read by fcheck, so they are left as holes and even
+// multi-gigabyte images take little disk space and generate quickly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "../submit/fcheck.h" // includes xv6 definitions
+
+#define BLOCK_SIZE (BSIZE)
+#define DPB (BLOCK_SIZE / sizeof(struct dirent)) // directory entries per block
+#define MAXINODES 65536                          // dirent inode numbers are 16 bits
+
+// What to generate
+struct params
+{
+    uint size_mb;      // -s: image size in MB
+    uint ninodes;      // -n: inodes (0: derived from the size)
+    uint fanout;       // -f: entries per directory
+    uint link_pct;     // -l: percentage of files with a second hard link
+    uint indirect_pct; // -x: percentage of files that use an indirect block
+    int scatter;       // -S: scatter data blocks over the data area
+};
+
+// Layout worked out from the parameters
+struct layout
+{
+    uint size, nblocks, usedblocks; // superblock values
+    uint ndirs, nfiles, nlinks, nlarge;
+    uint small_blocks;  // data blocks in each small file (at most NDIRECT)
+    uint large_blocks;  // data blocks in each large file (more than NDIRECT)
+    uint next;          // next free data block (before placement)
+    uint stride;        // -S: place() multiplier, coprime with nblocks (0: in order)
+};
+
+// Is the `k`th of `n` items picked when `pct` percent are picked, spread evenly?
+static int picked(uint k, uint pct)
+{
+    return (uint)(((unsigned long)(k + 1) * pct) / 100) != (uint)(((unsigned long)k * pct) / 100);
+}
+
+// Number of items picked among the first `n`
+static uint npicked(uint n, uint pct)
+{
+    return (uint)(((unsigned long)n * pct) / 100);
+}
+
+// Directory holding inode `inum` (inum >= 2)
+static uint parent_of(const struct params *p, uint inum)
+{
+    return 1 + (inum - 2) / p->fanout;
+}
+
+// Number of entries in directory `d`: ".", "..", its children and the extra
+// links placed in it (links are dealt out round-robin over the directories)
+static uint dir_entries(const struct params *p, const struct layout *l, uint d)
+{
+    uint first = 2 + (d - 1) * p->fanout;
+    uint last = first + p->fanout - 1;
+    uint n = 2;
+
+    if (last > p->ninodes - 1)
+        last = p->ninodes - 1;
+    if (first <= last)
+        n += last - first + 1;
+    if (l->nlinks >= d)
+        n += (l->nlinks - d) / l->ndirs + 1;
+    return n;
+}
+
+// Data blocks (plus one indirect block past NDIRECT) for `n` data blocks
+static uint with_indirect(uint n)
+{
+    return n + (n > NDIRECT);
+}
+
+static uint gcd(uint a, uint b)
+{
+    uint t;
+
+    while (b != 0)
+    {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Work out the superblock and how many blocks each file gets. Returns -1
+// (after saying why) if the parameters cannot be met.
+static int plan(struct params *p, struct layout *l)
+{
+    unsigned long dirblocks = 0, budget;
+    uint d, nsmall, per;
+
+    memset(l, 0, sizeof(*l));
+    l->size = p->size_mb * (1024 * 1024 / BLOCK_SIZE);
+
+    if (p->ninodes == 0)
+    {
+        p->ninodes = l->size / 32;
+        if (p->ninodes < 32)
+            p->ninodes = 32;
+        if (p->ninodes > MAXINODES)
+            p->ninodes = MAXINODES;
+    }
+    p->ninodes = (p->ninodes + IPB - 1) / IPB * IPB;
+    if (p->ninodes < 8 || p->ninodes > MAXINODES)
+    {
+        fprintf(stderr, "mkimage: inode count must be between 8 and %d.\n", MAXINODES);
+        return -1;
+    }
+    if (p->fanout == 0 || p->link_pct > 100 || p->indirect_pct > 100)
+    {
+        fprintf(stderr, "mkimage: fan-out must be positive and percentages at most 100.\n");
+        return -1;
+    }
+
+    // Same layout as xv6 mkfs: boot block, superblock, inodes, a spare block, bitmap
+    l->usedblocks = p->ninodes / IPB + 3 + (l->size / BPB + 1);
+    if (l->size <= l->usedblocks)
+    {
+        fprintf(stderr, "mkimage: image too small for %u inodes.\n", p->ninodes);
+        return -1;
+    }
+    l->nblocks = l->size - l->usedblocks;
+
+    // Inodes 1..ndirs are directories; every directory has at least one child
+    l->ndirs = 1 + (p->ninodes - 3) / p->fanout;
+    l->nfiles = p->ninodes - 1 - l->ndirs;
+    l->nlinks = npicked(l->nfiles, p->link_pct);
+    l->nlarge = npicked(l->nfiles, p->indirect_pct);
+
+    for (d = 1; d <= l->ndirs; d++)
+    {
+        per = (dir_entries(p, l, d) + DPB - 1) / DPB;
+        if (per > MAXFILE)
+        {
+            fprintf(stderr, "mkimage: directory %u needs %u blocks (at most %u); lower the fan-out.\n",
+                    d, per, (uint)MAXFILE);
+            return -1;
+        }
+        dirblocks += with_indirect(per);
+    }
+
+    // Spread the remaining blocks over the files: small files get up to
+    // NDIRECT blocks, large files at least NDIRECT + 1 and at most MAXFILE
+    if (dirblocks + l->nlarge * (unsigned long)(NDIRECT + 2) > l->nblocks)
+    {
+        fprintf(stderr, "mkimage: image too small for %u directories and %u large files.\n",
+                l->ndirs, l->nlarge);
+        return -1;
+    }
+    budget = l->nblocks - dirblocks;
+    nsmall = l->nfiles - l->nlarge;
+    if (l->nfiles > 0)
+    {
+        per = (budget - l->nlarge * (unsigned long)(NDIRECT + 2)) / l->nfiles;
+        l->small_blocks = per < NDIRECT ? per : NDIRECT;
+    }
+    budget -= (unsigned long)nsmall * l->small_blocks;
+    if (l->nlarge > 0)
+    {
+        per = budget / l->nlarge - 1; // each also needs its indirect block
+        l->large_blocks = per < MAXFILE ? per : MAXFILE;
+    }
+    l->next = l->usedblocks;
+
+    // A stride near nblocks / phi spreads neighbouring blocks far apart
+    if (p->scatter)
+    {
+        l->stride = (uint)(l->nblocks * 0.618) | 1;
+        while (gcd(l->stride, l->nblocks) != 1)
+            l->stride++;
+    }
+    return 0;
+}
+
+// Where the `b`th block (in hand-out order) goes: itself, or with -S its
+// image under a fixed permutation of the data area
+static uint place(const struct layout *l, uint b)
+{
+    if (l->stride == 0 || b < l->usedblocks)
+        return b;
+    return l->usedblocks + (uint)((unsigned long)(b - l->usedblocks) * l->stride % l->nblocks);
+}
+
+// Write `len` bytes at `off`, exiting on failure
+static void write_at(int fd, const void *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = pwrite(fd, (const char *)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("pwrite failed\n");
+            exit(1);
+        }
+        done += n;
+    }
+}
+
+// Give inode `dip` `n` data blocks starting at l->next (and an indirect block
+// after them if needed), writing the indirect block. Returns the first block
+// in hand-out order (see place()).
+static uint alloc_blocks(int fd, struct layout *l, struct dinode *dip, uint n)
+{
+    uint first = l->next;
+    uint indir[NINDIRECT];
+    uint j;
+
+    for (j = 0; j < n && j < NDIRECT; j++)
+        dip->addrs[j] = place(l, first + j);
+    if (n > NDIRECT)
+    {
+        memset(indir, 0, sizeof(indir));
+        for (j = NDIRECT; j < n; j++)
+            indir[j - NDIRECT] = place(l, first + j);
+        dip->addrs[NDIRECT] = place(l, first + n);
+        write_at(fd, indir, sizeof(indir), (off_t)place(l, first + n) * BLOCK_SIZE);
+    }
+    l->next += with_indirect(n);
+    return first;
+}
+
+// Append a directory entry
+static void add_entry(struct dirent *de, uint *n, uint inum, const char *name)
+{
+    de[*n].inum = inum;
+    strncpy(de[*n].name, name, DIRSIZ);
+    (*n)++;
+}
+
+// Fill in directory `d` (its entries go in `de`, room for MAXFILE blocks)
+// and write its blocks. `linked` lists the files that get a second link.
+static void make_dir(int fd, const struct params *p, struct layout *l, struct dinode *itable,
+                     const uint *linked, uint d, struct dirent *de)
+{
+    struct dinode *dip = &itable[d];
+    char name[DIRSIZ + 1];
+    uint n = 0, inum, k, j, nblocks, first;
+
+    add_entry(de, &n, d, ".");
+    add_entry(de, &n, d == ROOTINO ? ROOTINO : parent_of(p, d), "..");
+    for (inum = 2 + (d - 1) * p->fanout; inum < p->ninodes && parent_of(p, inum) == d; inum++)
+    {
+        snprintf(name, sizeof(name), "%c%u", inum <= l->ndirs ? 'd' : 'f', inum);
+        add_entry(de, &n, inum, name);
+    }
+    for (k = d - 1; k < l->nlinks; k += l->ndirs)
+    {
+        snprintf(name, sizeof(name), "l%u", linked[k]);
+        add_entry(de, &n, linked[k], name);
+    }
+
+    nblocks = (n + DPB - 1) / DPB;
+    memset(de + n, 0, (nblocks * DPB - n) * sizeof(struct dirent));
+    dip->type = T_DIR;
+    dip->nlink = 1;
+    dip->size = n * sizeof(struct dirent);
+    first = alloc_blocks(fd, l, dip, nblocks);
+    if (l->stride == 0)
+        write_at(fd, de, (size_t)nblocks * BLOCK_SIZE, (off_t)first * BLOCK_SIZE);
+    else
+        for (j = 0; j < nblocks; j++)
+            write_at(fd, de + j * DPB, BLOCK_SIZE, (off_t)place(l, first + j) * BLOCK_SIZE);
+}
+
+#define USAGE "Usage: mkimage [-s MB] [-n INODES] [-f FANOUT] [-l LINK_PCT] [-x INDIRECT_PCT] [-S] <image>\n"
+
+int main(int argc, char *argv[])
+{
+    struct params p = {1, 0, 16, 10, 25, 0};
+    struct layout l;
+    struct superblock *sb;
+    struct dinode *itable;
+    struct dirent *de;
+    uchar *meta, *bitmap;
+    uint *linked;
+    uint inum, j, k, nfile, nlarge;
+    int fd, opt;
+
+    // Parse options
+    while ((opt = getopt(argc, argv, "s:n:f:l:x:S")) != -1)
+    {
+        if (opt == 's')
+            p.size_mb = atoi(optarg);
+        else if (opt == 'n')
+            p.ninodes = atoi(optarg);
+        else if (opt == 'f')
+            p.fanout = atoi(optarg);
+        else if (opt == 'l')
+            p.link_pct = atoi(optarg);
+        else if (opt == 'x')
+            p.indirect_pct = atoi(optarg);
+        else if (opt == 'S')
+            p.scatter = 1;
+        else
+        {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || p.size_mb == 0)
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    if (plan(&p, &l) < 0)
+        exit(1);
+
+    // Metadata (boot block through bitmap) is built in memory and written last
+    meta = calloc(l.usedblocks, BLOCK_SIZE);
+    linked = calloc(l.nlinks + 1, sizeof(uint));
+    de = malloc(MAXFILE * BLOCK_SIZE);
+    if (meta == NULL || linked == NULL || de == NULL)
+    {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    sb = (struct superblock *)(meta + BLOCK_SIZE);
+    sb->size = l.size;
+    sb->nblocks = l.nblocks;
+    sb->ninodes = p.ninodes;
+    itable = (struct dinode *)(meta + IBLOCK((uint)0) * BLOCK_SIZE);
+    bitmap = meta + BBLOCK(0, p.ninodes) * BLOCK_SIZE;
+
+    fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("open failed\n");
+        exit(1);
+    }
+    if (ftruncate(fd, (off_t)l.size * BLOCK_SIZE) < 0)
+    {
+        perror("ftruncate failed\n");
+        exit(1);
+    }
+
+    // Files with a second link, in file order
+    for (inum = l.ndirs + 1, nfile = 0, k = 0; inum < p.ninodes; inum++, nfile++)
+        if (picked(nfile, p.link_pct))
+            linked[k++] = inum;
+
+    // Directories, then files, each taking the next data blocks
+    for (inum = 1; inum <= l.ndirs; inum++)
+        make_dir(fd, &p, &l, itable, linked, inum, de);
+    for (inum = l.ndirs + 1, nfile = 0, k = 0, nlarge = 0; inum < p.ninodes; inum++, nfile++)
+    {
+        struct dinode *dip = &itable[inum];
+        uint nblocks = l.small_blocks;
+
+        if (picked(nfile, p.indirect_pct))
+        {
+            nblocks = l.large_blocks;
+            nlarge++;
+        }
+        dip->type = T_FILE;
+        dip->nlink = 1;
+        if (k < l.nlinks && linked[k] == inum)
+        {
+            dip->nlink = 2;
+            k++;
+        }
+        dip->size = nblocks * BLOCK_SIZE;
+        alloc_blocks(fd, &l, dip, nblocks);
+    }
+
+    // Everything up to the last data block handed out is in use
+    for (j = 0; j < l.next; j++)
+        bitmap[place(&l, j) / 8] |= 1 << (place(&l, j) % 8);
+    write_at(fd, meta, (size_t)l.usedblocks * BLOCK_SIZE, 0);
+    if (close(fd) < 0)
+    {
+        perror("close failed\n");
+        exit(1);
+    }
+
+    // Describe the image on stdout (key=value, one line)
+    printf("size_mb=%u blocks=%u ninodes=%u dirs=%u files=%u links=%u large_files=%u fanout=%u used_blocks=%u scatter=%d\n",
+           p.size_mb, l.size, p.ninodes, l.ndirs, l.nfiles, l.nlinks, nlarge, p.fanout, l.next, p.scatter);
+
+    free(meta);
+    free(linked);
+    free(de);
+    return 0;
+}
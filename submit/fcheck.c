@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,510 +7,2398 @@
 #include <sys/stat.h>
 #include <sys/mman.h> // for mmap
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <getopt.h> // for --long options
+#include <pthread.h> // for -j worker threads
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/wait.h> // for the decompressor of a compressed image
+#include <signal.h>
+#include <linux/perf_event.h> // for --stats hardware counters
 
-#include "fcheck.h" // includes xv6 definitions
+#include "fcheck.h"    // includes xv6 definitions
+#include "libfcheck.h" // the checking engine
 
-#define BLOCK_SIZE (BSIZE)
+// How the image is read (--io=)
+enum
+{
+    IO_MMAP,   // map the whole image (default)
+    IO_STREAM, // read metadata up front, data blocks on demand through a cache
+    IO_PIPE,   // (not an --io choice) compressed image, read from its decompressor
+};
+
+// Stream back end: metadata is read in META_CHUNK reads, data blocks through
+// a direct-mapped cache of CACHE_LINES aligned lines of CACHE_LINE bytes.
+// Line size and alignment suit O_DIRECT on 512-byte and 4 KB sector devices.
+#define CACHE_LINE (4096)
+#define CACHE_LINES (256)
+#define META_CHUNK (1 << 20)
+
+// Compressed back end: a gzip or zstd child decompresses the image into a
+// pipe, read PIPE_CHUNK bytes at a time into one reused buffer. Of the
+// blocks that are not all zero, those a check can read (every one, for a
+// diff) are kept as they arrive: the first POOL_LIMIT bytes (or --mem-limit)
+// in a pool of POOL_CHUNK pieces, the rest in a spill file.
+#define PIPE_CHUNK (1 << 20)
+#define POOL_CHUNK (1 << 20)
+#define POOL_LIMIT (64 << 20)
+
+// Check result (beside the FCHECK_* ones) for a compressed image whose
+// stream broke off or whose decompressor failed
+#define CHECK_BADSTREAM (-16)
+// ... and for an image the stream back end could not read a block of
+#define CHECK_READERROR (-17)
+
+struct pipe_stream
+{
+    pid_t pid;               // the decompressor (0 once reaped)
+    int fd;                  // its output
+    char *buf;               // PIPE_CHUNK bytes, reused for every read
+    pthread_t reader;        // moves the stream into the pool
+    int running;             // reader started and not yet joined
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;  // broadcast as blocks arrive
+    uint have;               // blocks 0 .. have-1 have arrived
+    int done;                // end of stream
+    int failed;              // read error, or the stream broke off
+    int nomem;               // the pool could not grow (or the spill file failed)
+    uint *wanted;            // sorted, once settled: blocks a check can read
+    uint nwanted;
+    uint *dir_indirect;      // directories' indirect blocks past the metadata
+    uint ndir_indirect;
+    uint last_dir_indirect;  // every block up to the last of those is kept
+    int settled;             // those have arrived and what they list is in wanted
+    uint *blocks;            // blocks past the metadata that are kept, in order
+    uint nblocks, cap;
+    char *pool[POOL_LIMIT / POOL_CHUNK]; // contents of the first `inpool`, POOL_CHUNK bytes a piece
+    uint npool, inpool;
+    void *spill;             // contents of the rest, in order (NULL until needed)
+};
+
+struct block_cache
+{
+    uchar *data;             // CACHE_LINES lines of CACHE_LINE bytes
+    long tags[CACHE_LINES];  // line held by each slot (-1 = empty)
+    pthread_mutex_t lock;    // -j workers share the cache
+};
+
+// The open image
+struct fsimage
+{
+    int io;                  // IO_MMAP, IO_STREAM or IO_PIPE
+    int fd;
+    int direct;              // IO_STREAM: fd bypasses the page cache (O_DIRECT)
+    off_t len;               // image length in bytes
+    uint bsize;              // block size (found from the superblock, or --bsize)
+    size_t pagesize;
+    char *addr;              // IO_MMAP: start of the mapped image
+    uchar *advised;          // IO_MMAP, cold image: a byte per page, set once it is asked for
+    char *meta;              // blocks 0 .. nmeta-1: superblock, inode table, bitmap
+    uint nmeta;
+    struct block_cache cache; // IO_STREAM: data blocks
+    int read_failed;         // IO_STREAM: a data block could not be read
+    struct pipe_stream pipe; // IO_PIPE: data blocks
+    int sparse;              // the image has holes, found with SEEK_DATA/SEEK_HOLE
+    uint *extents;           // sparse: its data as [start, end) block ranges, in order
+    uint nextents;
+    char error[128];         // why open_image() failed
+};
+
+// Print where an inode holds a block, e.g. " (direct 3)"
+static void print_slot(uint slot)
+{
+    if (slot == FCHECK_NONE)
+        return;
+    if (slot < FCHECK_SLOT_INDIRECT)
+        fprintf(stderr, " (direct %u)", slot);
+    else if (slot == FCHECK_SLOT_INDIRECT)
+        fprintf(stderr, " (indirect block)");
+    else
+        fprintf(stderr, " (indirect %u)", slot - FCHECK_SLOT_ENTRY(0));
+}
+
+// Print the result of checking one image to stderr: the first violation, or
+// with --all every recorded violation. Returns the number of violations shown.
+static uint print_report(int all, const struct fcheck_report *rep)
+{
+    const struct fcheck_finding *f;
+    uint n;
+
+    if (!all)
+    {
+        if (rep->first == FCHECK_OK)
+            return 0;
+        fprintf(stderr, "%s\n", fcheck_message(rep->first));
+        return 1;
+    }
+
+    for (n = 0; n < rep->nfindings; n++)
+    {
+        f = &rep->findings[n];
+        fprintf(stderr, "%s [rule %d", fcheck_message(f->err), fcheck_rule(f->err));
+        if (f->inum != FCHECK_NONE)
+            fprintf(stderr, ", inode %u", f->inum);
+        if (f->blk != FCHECK_NONE)
+            fprintf(stderr, ", block %u", f->blk);
+        print_slot(f->slot);
+        if (f->owner != FCHECK_NONE)
+        {
+            fprintf(stderr, ", first used by inode %u", f->owner);
+            print_slot(f->owner_slot);
+        }
+        fprintf(stderr, "]\n");
+    }
+    if (rep->nfindings > 0)
+        fprintf(stderr, "%u error%s found.\n", rep->nfindings, rep->nfindings == 1 ? "" : "s");
+    return rep->nfindings;
+}
+
+// How results are printed (--format=)
+enum
+{
+    FORMAT_TEXT, // the classic messages on stderr (one line per image in batch mode)
+    FORMAT_JSON, // one JSON object per line on stdout: a "finding" per violation, a "summary" per image
+};
+
+// Length of the UTF-8 sequence starting at `s` if it is a valid one (not
+// overlong, a surrogate or past U+10FFFF), else 0
+static int utf8_length(const uchar *s)
+{
+    int n = s[0] >= 0xF0 ? 4 : s[0] >= 0xE0 ? 3 : 2, k;
+    uint c;
+
+    if (s[0] < 0xC2 || s[0] > 0xF4)
+        return 0;
+    c = s[0] & (0x3F >> (n - 1));
+    for (k = 1; k < n; k++)
+    {
+        if ((s[k] & 0xC0) != 0x80) // (also stops at the terminating NUL)
+            return 0;
+        c = c << 6 | (s[k] & 0x3F);
+    }
+    if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)))
+        return 0;
+    return n;
+}
+
+// Print `s` as a JSON string. A path need not be UTF-8: each byte that is
+// not part of a valid sequence is printed as U+FFFD, so the line stays JSON.
+static void print_json_string(const char *s)
+{
+    const uchar *p = (const uchar *)s;
+    int n;
+
+    putchar('"');
+    while (*p != '\0')
+    {
+        if (*p < 0x80)
+        {
+            printf(*p == '"' || *p == '\\' ? "\\%c" : *p < 0x20 ? "\\u%04x" : "%c", *p);
+            p++;
+        }
+        else if ((n = utf8_length(p)) > 0)
+        {
+            fwrite(p, 1, n, stdout);
+            p += n;
+        }
+        else
+        {
+            printf("\\ufffd");
+            p++;
+        }
+    }
+    putchar('"');
+}
+
+// Print a number as JSON, or null for FCHECK_NONE
+static void print_json_uint(uint n)
+{
+    if (n == FCHECK_NONE)
+        printf("null");
+    else
+        printf("%u", n);
+}
+
+// Print where an inode holds a block as JSON ("direct 3"), or null
+static void print_json_slot(uint slot)
+{
+    if (slot == FCHECK_NONE)
+        printf("null");
+    else if (slot < FCHECK_SLOT_INDIRECT)
+        printf("\"direct %u\"", slot);
+    else if (slot == FCHECK_SLOT_INDIRECT)
+        printf("\"indirect block\"");
+    else
+        printf("\"indirect %u\"", slot - FCHECK_SLOT_ENTRY(0));
+}
+
+// --format=json: print a violation of the image at path `ctx` as soon as it
+// is found (the finding hook handed to libfcheck). Batch workers share
+// stdout, so each record is written under its lock.
+static void print_finding(void *ctx, const struct fcheck_finding *f)
+{
+    flockfile(stdout);
+    printf("{\"type\":\"finding\",\"image\":");
+    print_json_string(ctx);
+    printf(",\"rule\":%d,\"message\":", fcheck_rule(f->err));
+    print_json_string(fcheck_message(f->err));
+    printf(",\"inode\":");
+    print_json_uint(f->inum);
+    printf(",\"block\":");
+    print_json_uint(f->blk);
+    printf(",\"slot\":");
+    print_json_slot(f->slot);
+    printf(",\"owner\":");
+    print_json_uint(f->owner);
+    printf(",\"owner_slot\":");
+    print_json_slot(f->owner_slot);
+    printf("}\n");
+    funlockfile(stdout);
+}
+
+// Read `len` bytes at `off` into `buf`, zero-filling anything past the end
+// of the image. Returns 0 on success, -1 on a read error.
+static int read_fully(int fd, void *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = pread(fd, (char *)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+        {
+            memset((char *)buf + done, 0, len - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Find the data extents of the image with SEEK_DATA/SEEK_HOLE, once, so
+// blocks in holes can be taken as zeroes without reading them. The image
+// is left dense if it has no holes or the file system cannot tell.
+static int map_extents(struct fsimage *fs)
+{
+    struct stat st;
+    off_t data, hole = 0;
+    uint *grown, cap = 0;
+
+    // A file with every byte allocated has no holes to look for
+    if (fstat(fs->fd, &st) == 0 && S_ISREG(st.st_mode) && (off_t)st.st_blocks * 512 >= fs->len)
+        return 0;
+    while ((data = lseek(fs->fd, hole, SEEK_DATA)) >= 0)
+    {
+        hole = lseek(fs->fd, data, SEEK_HOLE);
+        if (hole < 0)
+            break;
+        if (data == 0 && hole >= fs->len)
+            return 0; // no holes
+        if (fs->nextents == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            grown = realloc(fs->extents, cap * 2 * sizeof(uint));
+            if (grown == NULL)
+                return -1;
+            fs->extents = grown;
+        }
+        fs->extents[2 * fs->nextents] = data / fs->bsize > (uint)-1 ? (uint)-1 : data / fs->bsize;
+        fs->extents[2 * fs->nextents + 1] = (hole + fs->bsize - 1) / fs->bsize > (uint)-1 ? (uint)-1 : (hole + fs->bsize - 1) / fs->bsize;
+        fs->nextents++;
+    }
+    fs->sparse = errno == ENXIO; // (past the last data; otherwise unsupported)
+    if (!fs->sparse)
+    {
+        free(fs->extents);
+        fs->extents = NULL;
+        fs->nextents = 0;
+    }
+    return 0;
+}
+
+// Are blocks blk .. blk+n-1 all in holes?
+static int range_in_hole(const struct fsimage *fs, uint blk, uint n)
+{
+    uint lo = 0, hi = fs->nextents, mid;
+
+    if (!fs->sparse)
+        return 0;
+
+    // The first extent that ends past blk
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (fs->extents[2 * mid + 1] <= blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == fs->nextents || fs->extents[2 * lo] >= blk + n;
+}
+
+// Is block `blk` in a hole? (the hole callback handed to libfcheck)
+static int image_hole(void *ctx, unsigned blk)
+{
+    return range_in_hole(ctx, blk, 1);
+}
+
+// Stream back end: copy block `blk` into `buf` through the block cache
+// (the read_block callback handed to libfcheck). A line that cannot be read
+// is not cached; the block is NULL, so the check ends in FCHECK_IOERROR.
+static const void *cache_read(void *ctx, unsigned blk, void *buf)
+{
+    struct fsimage *fs = ctx;
+    struct block_cache *c = &fs->cache;
+    long line = (off_t)blk * fs->bsize / CACHE_LINE;
+    uint slot = line % CACHE_LINES;
+    uchar *data = c->data + (size_t)slot * CACHE_LINE;
+
+    if (range_in_hole(fs, blk, 1))
+    {
+        memset(buf, 0, fs->bsize);
+        return buf;
+    }
+    pthread_mutex_lock(&c->lock);
+    if (c->tags[slot] != line)
+    {
+        if (read_fully(fs->fd, data, CACHE_LINE, (off_t)line * CACHE_LINE) < 0)
+        {
+            c->tags[slot] = -1;
+            fs->read_failed = 1;
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        c->tags[slot] = line;
+    }
+    memcpy(buf, data + (off_t)blk * fs->bsize % CACHE_LINE, fs->bsize);
+    pthread_mutex_unlock(&c->lock);
+    return buf;
+}
+
+// Stream back end: have the kernel start reading the cache line holding
+// block `blk` into the page cache (the prefetch callback handed to
+// libfcheck; only used without O_DIRECT)
+static void cache_prefetch(void *ctx, unsigned blk)
+{
+    struct fsimage *fs = ctx;
+    off_t line = (off_t)blk * fs->bsize / CACHE_LINE;
+
+    posix_fadvise(fs->fd, line * CACHE_LINE, CACHE_LINE, POSIX_FADV_WILLNEED);
+}
+
+// mmap back end, cold image: have the kernel start reading in the page
+// holding block `blk` (the prefetch callback handed to libfcheck), so
+// touching it later does not stall on a page fault. Each page is asked for once.
+static void mmap_prefetch(void *ctx, unsigned blk)
+{
+    struct fsimage *fs = ctx;
+    size_t page = (size_t)blk * fs->bsize / fs->pagesize;
+
+    if (__atomic_exchange_n(&fs->advised[page], 1, __ATOMIC_RELAXED) == 0)
+        madvise(fs->addr + page * fs->pagesize, fs->pagesize, MADV_WILLNEED);
+}
+
+// Is most of the image's metadata out of memory? Then its data blocks
+// probably are too, and are worth asking for ahead of time; otherwise
+// asking would only cost a system call per block.
+static int image_is_cold(struct fsimage *fs)
+{
+    size_t npages = ((size_t)fs->nmeta * fs->bsize + fs->pagesize - 1) / fs->pagesize;
+    size_t i, in = 0;
+    uchar *vec = malloc(npages);
+
+    if (vec == NULL || mincore(fs->addr, npages * fs->pagesize, vec) < 0)
+    {
+        free(vec);
+        return 0;
+    }
+    // (Pages in holes count as in memory: they are never read)
+    for (i = 0; i < npages; i++)
+        in += (vec[i] & 1) || range_in_hole(fs, i * fs->pagesize / fs->bsize, fs->pagesize / fs->bsize);
+    free(vec);
+    return in < npages / 2;
+}
+
+// Stream back end: read blocks 0 .. nmeta-1 (boot block, superblock, inode
+// table and bitmap) sequentially in large aligned chunks, skipping holes
+static int read_metadata(struct fsimage *fs)
+{
+    size_t len = ((size_t)fs->nmeta * fs->bsize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    size_t off, n;
+
+    if (posix_memalign((void **)&fs->meta, CACHE_LINE, len) != 0)
+        return -1;
+
+    // Let the kernel read ahead of us (a no-op under O_DIRECT)
+    posix_fadvise(fs->fd, 0, len, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fs->fd, 0, len, POSIX_FADV_WILLNEED);
+    for (off = 0; off < len; off += n)
+    {
+        n = len - off < META_CHUNK ? len - off : META_CHUNK;
+        if (range_in_hole(fs, off / fs->bsize, n / fs->bsize))
+            memset(fs->meta + off, 0, n);
+        else if (read_fully(fs->fd, fs->meta + off, n, off) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Spill store, for --mem-limit and for the blocks a compressed image keeps
+// past its pool: each file is created in $TMPDIR (or /tmp) and unlinked at
+// once, so it goes away with the process however that ends. A file handle
+// is its descriptor plus one (never NULL).
+static void *spill_open(void *ctx)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    int fd;
+
+    (void)ctx;
+    snprintf(path, sizeof(path), "%s/fcheck-spill-XXXXXX", dir != NULL && dir[0] != '\0' ? dir : "/tmp");
+    fd = mkostemp(path, O_CLOEXEC); // (not held open by batch workers' decompressors)
+    if (fd < 0)
+        return NULL;
+    unlink(path);
+    return (void *)(intptr_t)(fd + 1);
+}
+
+static int spill_write(void *ctx, void *file, const void *buf, size_t len)
+{
+    int fd = (int)(intptr_t)file - 1;
+    size_t done = 0;
+    ssize_t n;
+
+    (void)ctx;
+    while (done < len)
+    {
+        n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int spill_read(void *ctx, void *file, unsigned long long off, void *buf, size_t len)
+{
+    int fd = (int)(intptr_t)file - 1;
+    size_t done = 0;
+    ssize_t n;
+
+    (void)ctx;
+    while (done < len)
+    {
+        n = pread(fd, (char *)buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static void spill_close(void *ctx, void *file)
+{
+    (void)ctx;
+    close((int)(intptr_t)file - 1);
+}
+
+// Which decompressor a compressed image needs, by its magic number
+// ("gzip" or "zstd"), or NULL for an image that is not compressed
+static const char *compressed_by(const char *path)
+{
+    uchar magic[4] = {0};
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (pread(fd, magic, sizeof(magic), 0) < 0)
+        memset(magic, 0, sizeof(magic));
+    close(fd);
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        return "gzip";
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return "zstd";
+    return NULL;
+}
+
+// Read up to `len` bytes from a pipe, stopping early only at its end.
+// Returns the number of bytes read, or -1 on a read error.
+static ssize_t read_pipe(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// Is the `bsize`-byte block at `b` all zero?
+static int block_is_zero(const char *b, uint bsize)
+{
+    return b[0] == 0 && memcmp(b, b + 1, bsize - 1) == 0;
+}
+
+// Where `blk` goes in the sorted blocks `v[0..n-1]`: the index of the first
+// one not below it (n if there is none)
+static uint find_block(const uint *v, uint n, uint blk)
+{
+    uint lo = 0, hi = n, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (v[mid] < blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Order block numbers
+static int block_order(const void *x, const void *y)
+{
+    uint a = *(const uint *)x, b = *(const uint *)y;
+
+    return (a > b) - (a < b);
+}
+
+// Compressed back end: add the blocks an indirect block lists to those a
+// check can read
+static void pipe_want_entries(struct fsimage *fs, const uint *entries)
+{
+    struct pipe_stream *p = &fs->pipe;
+    uint j;
+
+    for (j = 0; j < fs->bsize / sizeof(uint); j++)
+        if (entries[j] != 0)
+            p->wanted[p->nwanted++] = entries[j];
+}
+
+// Compressed back end: is block `blk` one a check can read? (only once settled)
+static int pipe_wanted(const struct pipe_stream *p, uint blk)
+{
+    uint i = find_block(p->wanted, p->nwanted, blk);
+
+    return i < p->nwanted && p->wanted[i] == blk;
+}
+
+// Compressed back end: the contents of the `i`th block kept, in the pool or
+// read from the spill file into `buf`. Returns NULL on a read error.
+static const void *pipe_fetch(struct fsimage *fs, uint i, void *buf)
+{
+    struct pipe_stream *p = &fs->pipe;
+    uint per = POOL_CHUNK / fs->bsize;
+
+    if (i < p->inpool)
+        return p->pool[i / per] + (size_t)(i % per) * fs->bsize;
+    if (spill_read(NULL, p->spill, (unsigned long long)(i - p->inpool) * fs->bsize, buf, fs->bsize) < 0)
+        return NULL;
+    return buf;
+}
+
+// Compressed back end: keep block p->have, which just arrived, in the pool
+// while it has room and in the spill file after that (caller holds the
+// lock). Returns -1 if it cannot be kept.
+static int pipe_store(struct fsimage *fs, const char *block)
+{
+    struct pipe_stream *p = &fs->pipe;
+    uint per = POOL_CHUNK / fs->bsize;
+    uint *grown, n;
+
+    if (p->nblocks == p->cap)
+    {
+        grown = realloc(p->blocks, (p->cap ? 2 * (size_t)p->cap : per) * sizeof(uint));
+        if (grown == NULL)
+            return -1;
+        p->blocks = grown;
+        p->cap = p->cap ? 2 * p->cap : per;
+    }
+    if (p->nblocks < p->inpool)
+    {
+        // The last piece takes only what is left of the pool
+        if (p->nblocks / per == p->npool)
+        {
+            n = p->inpool - p->npool * per < per ? p->inpool - p->npool * per : per;
+            p->pool[p->npool] = malloc((size_t)n * fs->bsize);
+            if (p->pool[p->npool] == NULL)
+                return -1;
+            p->npool++;
+        }
+        memcpy(p->pool[p->nblocks / per] + (size_t)(p->nblocks % per) * fs->bsize, block, fs->bsize);
+    }
+    else if ((p->spill == NULL && (p->spill = spill_open(NULL)) == NULL) ||
+             spill_write(NULL, p->spill, block, fs->bsize) < 0)
+        return -1;
+    p->blocks[p->nblocks++] = p->have;
+    return 0;
+}
+
+// Compressed back end: list the blocks past the metadata that a check can
+// read, from the inode table: the indirect block of every inode in use and
+// every block of a directory. Those a directory's indirect block lists are
+// only known once it has arrived, so every block is kept until the last of
+// them has, and only the listed ones after that. A diff compares file
+// contents too, and keeps every block. Returns -1 if out of memory.
+static int pipe_plan(struct fsimage *fs, int keep_data)
+{
+    struct pipe_stream *p = &fs->pipe;
+    const struct superblock *sb = (const struct superblock *)(fs->meta + fs->bsize);
+    const struct dinode *itable = (const struct dinode *)(fs->meta + 2 * (size_t)fs->bsize);
+    size_t cap = 0, ndirs = 0;
+    uint ninodes, i, j, blk;
+
+    p->last_dir_indirect = (uint)-1;
+    if (keep_data)
+        return 0;
+
+    // The inode table starts at block 2; only inodes the metadata holds count
+    ninodes = (fs->len - 2 * (size_t)fs->bsize) / sizeof(struct dinode);
+    if (sb->ninodes < ninodes)
+        ninodes = sb->ninodes;
+    for (i = 0; i < ninodes; i++)
+    {
+        if (itable[i].type == T_DIR)
+        {
+            cap += NDIRECT + 1 + (itable[i].addrs[NDIRECT] != 0 ? fs->bsize / sizeof(uint) : 0);
+            ndirs++;
+        }
+        else if (itable[i].type != 0)
+            cap++;
+    }
+    p->wanted = malloc((cap + 1) * sizeof(uint));
+    p->dir_indirect = malloc((ndirs + 1) * sizeof(uint));
+    if (p->wanted == NULL || p->dir_indirect == NULL)
+        return -1;
+
+    p->last_dir_indirect = 0;
+    for (i = 0; i < ninodes; i++)
+    {
+        if (itable[i].type == 0)
+            continue;
+        blk = itable[i].addrs[NDIRECT];
+        if (blk != 0)
+            p->wanted[p->nwanted++] = blk;
+        if (itable[i].type != T_DIR)
+            continue;
+        for (j = 0; j < NDIRECT; j++)
+            if (itable[i].addrs[j] != 0)
+                p->wanted[p->nwanted++] = itable[i].addrs[j];
+        if (blk == 0)
+            continue;
+        if (blk < p->have)
+            pipe_want_entries(fs, (const uint *)(fs->meta + (size_t)blk * fs->bsize)); // in hand already
+        else
+        {
+            p->dir_indirect[p->ndir_indirect++] = blk;
+            if (blk > p->last_dir_indirect)
+                p->last_dir_indirect = blk;
+        }
+    }
+    if (p->ndir_indirect == 0)
+    {
+        qsort(p->wanted, p->nwanted, sizeof(uint), block_order);
+        p->settled = 1;
+    }
+    return 0;
+}
+
+// Compressed back end: every directory's indirect block has arrived; add
+// the blocks they list to those a check can read (caller holds the lock).
+// Returns -1 if one cannot be read back.
+static int pipe_settle(struct fsimage *fs)
+{
+    struct pipe_stream *p = &fs->pipe;
+    const void *entries;
+    char *buf = malloc(fs->bsize);
+    uint k, i;
+
+    if (buf == NULL)
+        return -1;
+    for (k = 0; k < p->ndir_indirect; k++)
+    {
+        // One not kept is all zero and lists nothing
+        i = find_block(p->blocks, p->nblocks, p->dir_indirect[k]);
+        if (i == p->nblocks || p->blocks[i] != p->dir_indirect[k])
+            continue;
+        entries = pipe_fetch(fs, i, buf);
+        if (entries == NULL)
+        {
+            free(buf);
+            return -1;
+        }
+        pipe_want_entries(fs, entries);
+    }
+    free(buf);
+    qsort(p->wanted, p->nwanted, sizeof(uint), block_order);
+    p->settled = 1;
+    return 0;
+}
+
+// Compressed back end: the reader thread. It moves the decompressed stream
+// into the pool (or spill file) block by block, keeping the blocks a check
+// can read, and wakes whoever waits for a block that has arrived, so the
+// check runs while the rest is still being decompressed.
+static void *pipe_reader(void *arg)
+{
+    struct fsimage *fs = arg;
+    struct pipe_stream *p = &fs->pipe;
+    size_t fill = 0, len, off;
+    ssize_t n;
+    int eof = 0, failed = 0;
+
+    while (!eof)
+    {
+        n = read(p->fd, p->buf + fill, PIPE_CHUNK - fill);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n > 0)
+            fill += n;
+        else
+        {
+            // End of stream: a last partial block reads as if zero-filled
+            eof = 1;
+            failed = n < 0;
+            if (fill % fs->bsize != 0)
+            {
+                memset(p->buf + fill, 0, fs->bsize - fill % fs->bsize);
+                fill += fs->bsize - fill % fs->bsize;
+            }
+        }
+        len = fill / fs->bsize * fs->bsize;
+        if (len == 0 && !eof)
+            continue;
+
+        pthread_mutex_lock(&p->lock);
+        for (off = 0; off < len; off += fs->bsize, p->have++)
+        {
+            if (p->nomem || block_is_zero(p->buf + off, fs->bsize))
+                continue;
+            if (!p->settled && p->have > p->last_dir_indirect && pipe_settle(fs) < 0)
+                p->nomem = 1;
+            else if ((!p->settled || pipe_wanted(p, p->have)) && pipe_store(fs, p->buf + off) < 0)
+                p->nomem = 1;
+        }
+        if (eof)
+        {
+            p->done = 1;
+            p->failed |= failed;
+        }
+        pthread_cond_broadcast(&p->arrived);
+        pthread_mutex_unlock(&p->lock);
+
+        memmove(p->buf, p->buf + len, fill - len);
+        fill -= len;
+    }
+    return NULL;
+}
+
+// Compressed back end: wait until block `blk` has arrived (or the stream
+// has ended) and find it among those kept. Returns its index there, or
+// p->nblocks if it is all zero (or no check reads it). Caller holds the lock.
+static uint pipe_wait(struct pipe_stream *p, uint blk)
+{
+    uint i;
+
+    while (blk >= p->have && !p->done)
+        pthread_cond_wait(&p->arrived, &p->lock);
+    i = find_block(p->blocks, p->nblocks, blk);
+    return i < p->nblocks && p->blocks[i] == blk ? i : p->nblocks;
+}
+
+// Compressed back end: copy block `blk` into `buf` once it has arrived
+// (the read_block callback handed to libfcheck)
+static const void *pipe_read(void *ctx, unsigned blk, void *buf)
+{
+    struct fsimage *fs = ctx;
+    struct pipe_stream *p = &fs->pipe;
+    const void *data = NULL;
+    uint i;
+
+    pthread_mutex_lock(&p->lock);
+    i = pipe_wait(p, blk);
+    if (i < p->nblocks && (data = pipe_fetch(fs, i, buf)) == NULL)
+        p->failed = 1; // the spill file could not be read back
+    if (data != NULL && data != buf)
+        memcpy(buf, data, fs->bsize);
+    else if (data == NULL)
+        memset(buf, 0, fs->bsize);
+    pthread_mutex_unlock(&p->lock);
+    return buf;
+}
+
+// Compressed back end: is block `blk` all zero? (the hole callback handed
+// to libfcheck: a zero block is never stored, so it need not be copied)
+static int pipe_hole(void *ctx, unsigned blk)
+{
+    struct fsimage *fs = ctx;
+    struct pipe_stream *p = &fs->pipe;
+    int zero;
+
+    if (blk < fs->nmeta)
+        return 0;
+    pthread_mutex_lock(&p->lock);
+    zero = pipe_wait(p, blk) == p->nblocks;
+    pthread_mutex_unlock(&p->lock);
+    return zero;
+}
+
+// Compressed back end: reap the decompressor. Returns -1 if it failed.
+static int pipe_reap(struct pipe_stream *p)
+{
+    int status;
+
+    if (p->pid <= 0)
+        return 0;
+    while (waitpid(p->pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return -1;
+    p->pid = 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Compressed back end: after the check, wait for the rest of the stream, so
+// an archive that is corrupt or cut short past the blocks the check needed
+// still fails. Returns 0, FCHECK_NOMEM or CHECK_BADSTREAM.
+static int pipe_finish(struct fsimage *fs)
+{
+    struct pipe_stream *p = &fs->pipe;
+
+    if (p->running)
+    {
+        pthread_join(p->reader, NULL);
+        p->running = 0;
+    }
+    if (pipe_reap(p) < 0)
+        p->failed = 1;
+    if (p->nomem)
+        return FCHECK_NOMEM;
+    return p->failed ? CHECK_BADSTREAM : 0;
+}
+
+// Compressed back end: stop the decompressor if it is still going and free
+// the pool
+static void pipe_close(struct fsimage *fs)
+{
+    struct pipe_stream *p = &fs->pipe;
+    uint i;
+
+    if (p->running)
+    {
+        pthread_mutex_lock(&p->lock);
+        if (!p->done)
+            kill(p->pid, SIGKILL); // (not reaped before the reader is joined)
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->reader, NULL);
+        p->running = 0;
+    }
+    if (p->fd >= 0)
+        close(p->fd);
+    if (p->pid > 0)
+    {
+        kill(p->pid, SIGKILL);
+        pipe_reap(p);
+    }
+    if (p->buf != NULL)
+    {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->arrived);
+    }
+    for (i = 0; i < p->npool; i++)
+        free(p->pool[i]);
+    if (p->spill != NULL)
+        spill_close(NULL, p->spill);
+    free(p->wanted);
+    free(p->dir_indirect);
+    free(p->blocks);
+    free(p->buf);
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+}
+
+// Start `tool` decompressing the image open as fs->fd into a pipe
+static int pipe_spawn(struct fsimage *fs, const char *tool)
+{
+    struct pipe_stream *p = &fs->pipe;
+    int fds[2], null;
+
+    // Close-on-exec, so decompressors started by other batch workers do not
+    // hold this pipe open
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    p->pid = fork();
+    if (p->pid < 0)
+    {
+        p->pid = 0;
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (p->pid == 0)
+    {
+        // Its complaints would only repeat "cannot decompress image."
+        null = open("/dev/null", O_WRONLY);
+        dup2(fs->fd, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        if (null >= 0)
+            dup2(null, STDERR_FILENO);
+        execlp(tool, tool, "-dc", (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    p->fd = fds[0];
+    return 0;
+}
+
+// Release everything open_image() set up (also used on its failure path)
+static void close_image(struct fsimage *fs)
+{
+    if (fs->io == IO_MMAP)
+    {
+        if (fs->addr != NULL)
+            munmap(fs->addr, fs->len);
+        free(fs->advised);
+    }
+    else if (fs->io == IO_PIPE)
+    {
+        pipe_close(fs);
+        free(fs->meta);
+    }
+    else
+    {
+        free(fs->meta);
+        if (fs->cache.data != NULL)
+        {
+            free(fs->cache.data);
+            pthread_mutex_destroy(&fs->cache.lock);
+        }
+    }
+    if (fs->fd >= 0)
+        close(fs->fd);
+    free(fs->extents);
+    fs->fd = -1;
+    fs->addr = NULL;
+    fs->advised = NULL;
+    fs->meta = NULL;
+    fs->cache.data = NULL;
+    fs->extents = NULL;
+}
+
+// Record why an image could not be opened (and the system error, if any)
+static int open_failed(struct fsimage *fs, const char *why, int sys)
+{
+    if (sys)
+        snprintf(fs->error, sizeof(fs->error), "%s: %s", why, strerror(errno));
+    else
+        snprintf(fs->error, sizeof(fs->error), "%s", why);
+    return -1;
+}
+
+// Settle the block size of an image, `bsize` or if 0 the one its superblock
+// fits, and how many blocks of metadata it has, given its first `len` bytes
+// at `head` (FCHECK_HEAD_BYTES, or all of a shorter image). fs->len is its
+// length, or 0 if not known yet.
+static int image_geometry(struct fsimage *fs, const char *head, size_t len, uint bsize)
+{
+    fs->bsize = bsize != 0 ? bsize : fcheck_block_size(head, len, fs->len);
+    if (fs->bsize == 0)
+        fs->bsize = BSIZE; // none fits: the classic size, and the check says what is wrong
+    if (len < 2 * (size_t)fs->bsize)
+        return open_failed(fs, "image is too small.", 0);
+    fs->nmeta = fcheck_metadata_blocks_bsize(head, fs->bsize);
+    return 0;
+}
+
+// Open a compressed image: start its decompressor, read the metadata as it
+// comes out, then leave the data blocks to the reader thread, so the check
+// of the inode table and bitmap starts while they are still arriving. Up to
+// `pool` bytes of the blocks kept are held in memory.
+static int open_compressed(struct fsimage *fs, const char *path, const char *tool, uint bsize, size_t pool,
+                           int keep_data)
+{
+    struct pipe_stream *p = &fs->pipe;
+    size_t want = FCHECK_HEAD_BYTES, got = 0, size;
+    ssize_t n;
+    char *grown;
+    int ended;
+
+    fs->io = IO_PIPE;
+    p->fd = -1;
+    fs->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fs->fd < 0)
+        return open_failed(fs, "image not found.", 0);
+    p->buf = malloc(PIPE_CHUNK);
+    if (p->buf == NULL)
+    {
+        open_failed(fs, "out of memory.", 0);
+        goto fail;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->arrived, NULL);
+    if (pipe_spawn(fs, tool) < 0)
+    {
+        open_failed(fs, "cannot start decompressor", 1);
+        goto fail;
+    }
+
+    // The start of the image first, for its block size and superblock, then
+    // the rest of the metadata they call for. The buffer grows only as far
+    // as the stream goes, so a bad superblock cannot make it huge.
+    while (got < want)
+    {
+        size = got < META_CHUNK / 2 ? META_CHUNK : 2 * got;
+        if (size > want)
+            size = want;
+        grown = realloc(fs->meta, size);
+        if (grown == NULL)
+        {
+            open_failed(fs, "out of memory.", 0);
+            goto fail;
+        }
+        fs->meta = grown;
+        n = read_pipe(p->fd, fs->meta + got, size - got);
+        ended = n < (ssize_t)(size - got);
+        if (n < 0 || (ended && pipe_reap(p) < 0))
+        {
+            open_failed(fs, "cannot decompress image.", 0);
+            goto fail;
+        }
+        got += n;
+        if (fs->bsize == 0)
+        {
+            // The start is in (all of it, for an image shorter than that)
+            if (image_geometry(fs, fs->meta, got, bsize) < 0)
+                goto fail;
+            want = (size_t)fs->nmeta * fs->bsize > got ? (size_t)fs->nmeta * fs->bsize : got;
+        }
+        else if (ended)
+        {
+            open_failed(fs, "image is truncated or has a bad superblock.", 0);
+            goto fail;
+        }
+    }
+    fs->len = got;
+    p->have = got / fs->bsize;
+    p->inpool = pool / fs->bsize;
+    if (pipe_plan(fs, keep_data) < 0)
+    {
+        open_failed(fs, "out of memory.", 0);
+        goto fail;
+    }
+
+    if (pthread_create(&p->reader, NULL, pipe_reader, fs) != 0)
+    {
+        open_failed(fs, "pthread_create failed", 1);
+        goto fail;
+    }
+    p->running = 1;
+    return 0;
+
+fail:
+    close_image(fs);
+    return -1;
+}
+
+// Open an image with the chosen back end and locate its metadata, for
+// blocks of `bsize` bytes (0: the size its superblock fits). A compressed
+// image holds up to `pool` bytes of its blocks in memory, and with
+// `keep_data` keeps file contents as well. On failure nothing is left open
+// and fs->error says why.
+static int open_image(struct fsimage *fs, const char *path, int io, uint bsize, size_t pool, int keep_data)
+{
+    const char *tool;
+    uint i;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->io = io;
+    fs->pagesize = sysconf(_SC_PAGESIZE);
+    fs->fd = -1;
+
+    // A compressed image is read from its decompressor, whatever --io says
+    tool = compressed_by(path);
+    if (tool != NULL)
+        return open_compressed(fs, path, tool, bsize, pool, keep_data);
+
+    // Open the file system image (bypassing the page cache when streaming)
+#ifdef O_DIRECT
+    if (io == IO_STREAM)
+        fs->fd = open(path, O_RDONLY | O_DIRECT);
+    fs->direct = fs->fd >= 0;
+#endif
+    if (fs->fd < 0)
+        fs->fd = open(path, O_RDONLY);
+    if (fs->fd < 0)
+        return open_failed(fs, "image not found.", 0);
+
+    // Get file system size (seeking also works for raw block devices)
+    fs->len = lseek(fs->fd, 0, SEEK_END);
+    if (fs->len < 0)
+    {
+        open_failed(fs, "lseek failed", 1);
+        goto fail;
+    }
+    if (fs->len < 2 * BSIZE)
+    {
+        open_failed(fs, "image is too small.", 0);
+        goto fail;
+    }
+
+    if (io == IO_MMAP)
+    {
+        // Map the image into memory
+        fs->addr = mmap(NULL, fs->len, PROT_READ, MAP_PRIVATE, fs->fd, 0);
+        if (fs->addr == MAP_FAILED)
+        {
+            fs->addr = NULL;
+            open_failed(fs, "mmap failed", 1);
+            goto fail;
+        }
+        fs->meta = fs->addr;
+    }
+    else
+    {
+        if (posix_memalign((void **)&fs->cache.data, CACHE_LINE, (size_t)CACHE_LINES * CACHE_LINE) != 0)
+        {
+            fs->cache.data = NULL;
+            open_failed(fs, "out of memory.", 0);
+            goto fail;
+        }
+        for (i = 0; i < CACHE_LINES; i++)
+            fs->cache.tags[i] = -1;
+        pthread_mutex_init(&fs->cache.lock, NULL);
+
+        // Peek at the superblock to find out how much metadata there is;
+        // fall back to buffered reads if the file system refuses O_DIRECT
+        if (read_fully(fs->fd, fs->cache.data, FCHECK_HEAD_BYTES, 0) < 0)
+        {
+            close(fs->fd);
+            fs->direct = 0;
+            fs->fd = open(path, O_RDONLY);
+            if (fs->fd < 0 || read_fully(fs->fd, fs->cache.data, FCHECK_HEAD_BYTES, 0) < 0)
+            {
+                open_failed(fs, "read failed", 1);
+                goto fail;
+            }
+            posix_fadvise(fs->fd, 0, 0, POSIX_FADV_NOREUSE);
+        }
+    }
+
+    // Block size and metadata, then the holes (in blocks of that size)
+    if (image_geometry(fs, fs->io == IO_MMAP ? fs->addr : (char *)fs->cache.data,
+                       fs->len < FCHECK_HEAD_BYTES ? fs->len : FCHECK_HEAD_BYTES, bsize) < 0)
+        goto fail;
+    if (map_extents(fs) < 0)
+    {
+        open_failed(fs, "out of memory.", 0);
+        goto fail;
+    }
+
+    // Prefetch pages from disk only if the image is not in memory already
+    if (io == IO_MMAP && fs->nmeta <= fs->len / fs->bsize && image_is_cold(fs))
+        fs->advised = calloc((fs->len + fs->pagesize - 1) / fs->pagesize, 1);
+
+    // The inode table and bitmap must be inside the image
+    if ((off_t)fs->nmeta * fs->bsize > fs->len)
+    {
+        open_failed(fs, "image is truncated or has a bad superblock.", 0);
+        goto fail;
+    }
+    if (io == IO_STREAM && read_metadata(fs) < 0)
+    {
+        open_failed(fs, "read failed", 1);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    close_image(fs);
+    return -1;
+}
+
+// Scratch memory for libfcheck, handed out in pieces and reused from one
+// image to the next, so a batch worker allocates once rather than once per
+// image. Requests that do not fit go to malloc and are remembered; the next
+// arena_reset() frees them and grows the arena to fit them all next time.
+struct arena
+{
+    char *base;
+    size_t cap;      // bytes allocated
+    size_t top;      // bytes handed out since the last arena_reset()
+    size_t spilled;  // bytes that did not fit since the last arena_reset()
+    void **overflow; // chain of the malloc'd requests that did not fit
+};
+
+#define ARENA_ALIGN(n) (((n) + 63) & ~(size_t)63)
+
+// libfcheck allocator: carve `size` bytes out of the arena
+static void *arena_alloc(void *ctx, size_t size)
+{
+    struct arena *a = ctx;
+    void **node;
+
+    size = ARENA_ALIGN(size);
+    if (a->cap - a->top >= size)
+    {
+        a->top += size;
+        return a->base + a->top - size;
+    }
+
+    // Does not fit: malloc it (with room for the chain link in front)
+    node = malloc(ARENA_ALIGN(sizeof(void *)) + size);
+    if (node == NULL)
+        return NULL;
+    *node = a->overflow;
+    a->overflow = node;
+    a->spilled += size;
+    return (char *)node + ARENA_ALIGN(sizeof(void *));
+}
+
+// libfcheck allocator: nothing is freed until the arena is reset
+static void arena_release(void *ctx, void *ptr)
+{
+    (void)ctx;
+    (void)ptr;
+}
+
+// Free everything handed out and start again from the beginning, first
+// growing the arena by whatever did not fit last time
+static void arena_reset(struct arena *a)
+{
+    void **node;
+    size_t want = a->cap + a->spilled;
+
+    while ((node = a->overflow) != NULL)
+    {
+        a->overflow = *node;
+        free(node);
+    }
+    if (want > a->cap)
+    {
+        free(a->base);
+        a->cap = 0;
+        if (posix_memalign((void **)&a->base, 64, want) != 0)
+            a->base = NULL;
+        else
+            a->cap = want;
+    }
+    a->top = 0;
+    a->spilled = 0;
+}
+
+// Release the arena itself
+static void arena_free(struct arena *a)
+{
+    arena_reset(a);
+    free(a->base);
+    a->base = NULL;
+    a->cap = 0;
+}
+
+// --stats: wall and CPU time per phase of the check, the library's work
+// counters, and hardware counters where the host allows perf_event_open()
+enum
+{
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+#define PHASE_OPEN FCHECK_NPHASES   // opening the image and reading its metadata
+#define NPHASES (FCHECK_NPHASES + 1)
+#define NHW 2                       // hardware counters: cycles, LLC misses
+
+static const char *const phase_names[NPHASES] = {
+    [FCHECK_PHASE_SCAN] = "scan",
+    [FCHECK_PHASE_BITMAP] = "bitmap",
+    [FCHECK_PHASE_DIRS] = "dirs",
+    [FCHECK_PHASE_ROOT] = "root",
+    [FCHECK_PHASE_RULES] = "rules",
+    [FCHECK_PHASE_REACH] = "reach",
+    [FCHECK_PHASE_QUICK] = "quick",
+    [PHASE_OPEN] = "open",
+};
+
+// Phases in the order they run
+static const int phase_order[NPHASES] = {
+    PHASE_OPEN, FCHECK_PHASE_QUICK, FCHECK_PHASE_SCAN, FCHECK_PHASE_BITMAP, FCHECK_PHASE_DIRS, FCHECK_PHASE_ROOT,
+    FCHECK_PHASE_RULES, FCHECK_PHASE_REACH,
+};
+
+struct phase_time
+{
+    double wall, cpu; // seconds
+    uint64_t hw[NHW];
+};
 
-// Helper function to get the bit value for a given block from the bitmap
-int get_bitmap_bit(char *addr, struct superblock *sb, uint blk)
+struct stats
 {
-    // Find which bitmap block contains the bit
-    uint bblk = BBLOCK(blk, sb->ninodes);
-    uchar *bptr = (uchar *)addr + bblk * BLOCK_SIZE;
-    // Extract the specific bit
-    uint bit_index = blk % (BLOCK_SIZE * 8);
-    uint byte_index = bit_index / 8;
-    uint bit_position = bit_index % 8;
-    return (bptr[byte_index] >> bit_position) & 0x1;
+    int fd[NHW];                    // perf event counters (-1 if unavailable)
+    int current;                    // phase being timed (-1 for none)
+    struct phase_time start;        // readings when it started
+    struct phase_time phase[NPHASES];
+    struct fcheck_stats work;
+};
+
+// Open a hardware counter for this process and the threads it starts
+static int perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
 }
 
-int main(int argc, char *argv[])
+static double seconds_of(clockid_t clock)
 {
-    // --- SETUP AND READ METADATA ---
-    int fsfd;
-    char *addr;
-    struct stat st;
-    struct superblock *sb;
-    struct dinode *itable;
-    struct dinode *dip;
-    struct dirent *de;
-    uint i, j, min_db, max_db, blk, k, ref_inum;
-    int *used;
-    uint *indir;
-
-    // Usage check
-    if (argc != 2)
-    {
-        fprintf(stderr, "Usage: fcheck <file_system_image>\n");
-        exit(1);
-    }
+    struct timespec ts;
 
-    // Open the file system image
-    fsfd = open(argv[1], O_RDONLY);
-    if (fsfd < 0)
-    {
-        fprintf(stderr, "image not found.\n");
-        exit(1);
-    }
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    // Get file system size
-    if (fstat(fsfd, &st) < 0)
-    {
-        perror("fstat failed\n");
-        exit(1);
-    }
+// Take the current wall time, CPU time and hardware counter readings
+static void stats_read(const struct stats *st, struct phase_time *t)
+{
+    int k;
+
+    t->wall = seconds_of(CLOCK_MONOTONIC);
+    t->cpu = seconds_of(CLOCK_PROCESS_CPUTIME_ID);
+    for (k = 0; k < NHW; k++)
+        if (st->fd[k] < 0 || read(st->fd[k], &t->hw[k], sizeof(t->hw[k])) != sizeof(t->hw[k]))
+            t->hw[k] = 0;
+}
+
+// Charge the time since the last switch to the current phase and start timing `phase` (-1: stop)
+static void stats_switch(struct stats *st, int phase)
+{
+    struct phase_time now;
+    int k;
 
-    // Map the image into memory
-    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fsfd, 0);
-    if (addr == MAP_FAILED)
+    stats_read(st, &now);
+    if (st->current >= 0)
     {
-        perror("mmap failed\n");
-        exit(1);
+        st->phase[st->current].wall += now.wall - st->start.wall;
+        st->phase[st->current].cpu += now.cpu - st->start.cpu;
+        for (k = 0; k < NHW; k++)
+            st->phase[st->current].hw[k] += now.hw[k] - st->start.hw[k];
     }
+    st->current = phase;
+    st->start = now;
+}
+
+// libfcheck phase hook
+static void stats_phase(void *ctx, int phase)
+{
+    stats_switch(ctx, phase < FCHECK_NPHASES ? phase : -1);
+}
 
-    // Read the superblock (block 1)
-    sb = (struct superblock *)(addr + 1 * BLOCK_SIZE);
+static void stats_init(struct stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->current = -1;
+    st->fd[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+    st->fd[1] = perf_open(PERF_COUNT_HW_CACHE_MISSES); // usually last-level cache misses
+}
 
-    // Get start of inode table (block 2)
-    itable = (struct dinode *)(addr + IBLOCK((uint)0) * BLOCK_SIZE);
+static void stats_close(struct stats *st)
+{
+    int k;
 
-    // Compute valid data block range
-    // nblocks (data blocks) + usedblocks (metadata blocks) = size (total blocks)
-    min_db = sb->size - sb->nblocks;
-    max_db = sb->size - 1;
+    for (k = 0; k < NHW; k++)
+        if (st->fd[k] >= 0)
+            close(st->fd[k]);
+}
 
-    // --- VERIFY CONSISTENCY RULES ---
+// Print the phase times and counters of checking `path` to stdout
+static void print_stats(const struct stats *st, const char *path, int format)
+{
+    const struct fcheck_stats *w = &st->work;
+    const struct phase_time *t;
+    const char *sep = "";
+    struct phase_time total = {0};
+    int p, hw = st->fd[0] >= 0 && st->fd[1] >= 0;
 
-    // Track blocks used by inodes in an array (0 = free, 1 = used)
-    used = (int *)calloc(sb->size, sizeof(int));
-    if (used == NULL)
+    for (p = 0; p < NPHASES; p++)
     {
-        perror("calloc failed\n");
-        exit(1);
+        total.wall += st->phase[p].wall;
+        total.cpu += st->phase[p].cpu;
+        total.hw[0] += st->phase[p].hw[0];
+        total.hw[1] += st->phase[p].hw[1];
     }
 
-    // Read inodes
-    for (i = 0; i < sb->ninodes; i++)
+    if (format == STATS_JSON)
     {
-        dip = &itable[i]; // current inode
-
-        // RULE 1: Each inode is either unallocated or valid type
-        if (dip->type != 0 && dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEV)
+        printf("{\"image\":");
+        print_json_string(path);
+        printf(",\"wall_s\":%.6f,\"cpu_s\":%.6f,\"phases\":{", total.wall, total.cpu);
+        for (p = 0; p < NPHASES; p++, sep = ",")
         {
-            fprintf(stderr, "ERROR: bad inode.\n");
-            exit(1);
+            t = &st->phase[phase_order[p]];
+            printf("%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f", sep, phase_names[phase_order[p]], t->wall, t->cpu);
+            if (hw)
+                printf(",\"cycles\":%llu,\"llc_misses\":%llu", (unsigned long long)t->hw[0], (unsigned long long)t->hw[1]);
+            printf("}");
         }
+        printf("},\"hw_counters\":%s", hw ? "true" : "false");
+        printf(",\"inodes\":{\"free\":%llu,\"dir\":%llu,\"file\":%llu,\"dev\":%llu,\"bad\":%llu}",
+               w->inodes_free, w->inodes_dir, w->inodes_file, w->inodes_dev, w->inodes_bad);
+        printf(",\"direct_addrs\":%llu,\"indirect_blocks\":%llu,\"indirect_addrs\":%llu", w->direct_addrs,
+               w->indirect_blocks, w->indirect_addrs);
+        printf(",\"dir_blocks\":%llu,\"dirents\":%llu,\"blocks_read\":%llu,\"bytes_touched\":%llu", w->dir_blocks,
+               w->dirents, w->blocks_read, w->bytes_touched);
+        printf(",\"spill_runs\":%llu,\"spill_bytes\":%llu}\n", w->spill_runs, w->spill_bytes);
+        return;
+    }
 
-        // skip unallocated inodes
-        if (dip->type == 0)
-            continue;
+    printf("%-8s %10s %10s", "phase", "wall_ms", "cpu_ms");
+    if (hw)
+        printf(" %14s %12s", "cycles", "llc_misses");
+    printf("\n");
+    for (p = 0; p <= NPHASES; p++)
+    {
+        t = p < NPHASES ? &st->phase[phase_order[p]] : &total;
+        printf("%-8s %10.3f %10.3f", p < NPHASES ? phase_names[phase_order[p]] : "total", t->wall * 1e3, t->cpu * 1e3);
+        if (hw)
+            printf(" %14llu %12llu", (unsigned long long)t->hw[0], (unsigned long long)t->hw[1]);
+        printf("\n");
+    }
+    if (!hw)
+        printf("(hardware counters unavailable)\n");
+    printf("inodes: %llu free, %llu dir, %llu file, %llu dev, %llu bad\n", w->inodes_free, w->inodes_dir,
+           w->inodes_file, w->inodes_dev, w->inodes_bad);
+    printf("blocks: %llu direct, %llu indirect (%llu addresses), %llu directory (%llu entries)\n", w->direct_addrs,
+           w->indirect_blocks, w->indirect_addrs, w->dir_blocks, w->dirents);
+    printf("read: %llu blocks, %llu bytes touched\n", w->blocks_read, w->bytes_touched);
+    if (w->spill_runs > 0)
+        printf("spill: %llu runs, %llu bytes\n", w->spill_runs, w->spill_bytes);
+}
 
-        // read direct addresses
-        for (j = 0; j < NDIRECT; j++)
-        {
-            blk = dip->addrs[j];
-            if (blk != 0)
-            {
-                // RULE 2a: If in use, direct block address is within valid range
-                if (blk < min_db || blk > max_db)
-                {
-                    fprintf(stderr, "ERROR: bad direct address in inode.\n");
-                    exit(1);
-                }
-
-                // RULE 5a: Direct address is marked in use in bitmap
-                if (get_bitmap_bit(addr, sb, blk) == 0)
-                {
-                    fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                    exit(1);
-                }
-
-                // RULE 7: Direct address doesn't point to a block already in use
-                if (used[blk])
-                {
-                    fprintf(stderr, "ERROR: direct address used more than once.\n");
-                    exit(1);
-                }
-                used[blk] = 1; // else mark block as used for future checks
-            }
-        }
+// How to check an image
+struct check_opts
+{
+    int nthreads;      // -j: inode scan threads
+    int all;           // --all: report every violation
+    int io;            // --io: IO_MMAP or IO_STREAM
+    const char *index; // --index: fingerprint index file ("" for <image>.fcidx, NULL for none)
+    unsigned rules;    // --rules, --reach: FCHECK_RULE() bits (0 for Rules 1-12)
+    int stats;         // --stats: STATS_NONE, STATS_TEXT or STATS_JSON
+    int quick;         // --quick: accept an image whose totals agree
+    int prefetch;      // --prefetch: lookahead distance (-1 for the default, 0 for none)
+    int engine;        // --engine: FCHECK_ENGINE_*
+    size_t mem_limit;  // --mem-limit: bytes of scratch memory per check (0 for no limit)
+    int format;        // --format: FORMAT_TEXT or FORMAT_JSON
+    uint bsize;        // --bsize: block size of the images (0 for the one each superblock fits)
+};
 
-        // read indirect addresses
-        blk = dip->addrs[NDIRECT];
-        if (blk != 0)
-        { // skip if not used
-            // RULE 2b: If in use, indirect block address is within valid range
-            if (blk < min_db || blk > max_db)
-            {
-                fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-                exit(1);
-            }
+// Bytes of a compressed image's blocks held in memory under `mem_limit`
+// (--mem-limit, 0 for none); the rest go to a spill file
+static size_t pool_limit(size_t mem_limit)
+{
+    return mem_limit != 0 && mem_limit < POOL_LIMIT ? mem_limit : POOL_LIMIT;
+}
 
-            // RULE 5b: Indirect address is marked in use in bitmap
-            if (get_bitmap_bit(addr, sb, blk) == 0)
-            {
-                fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                exit(1);
-            }
+// Suffix of the default index file next to an image
+#define INDEX_SUFFIX ".fcidx"
 
-            // RULE 8a: Indirect block doesn't point to a block already in use
-            if (used[blk])
-            {
-                fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                exit(1);
-            }
-            used[blk] = 1; // mark indirect block as used
+// Map the index file at `path`. Returns NULL (with *len 0) if there is none.
+static void *load_index(const char *path, size_t *len)
+{
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
 
-            // read indirect block (array of direct addresses)
-            indir = (uint *)(addr + blk * BLOCK_SIZE);
-            for (j = 0; j < NINDIRECT; j++)
-            {
-                blk = indir[j];
-
-                if (blk != 0)
-                {
-                    // RULE 2c: If in use, direct address in indirect block is within valid range
-                    if (blk < min_db || blk > max_db)
-                    {
-                        fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-                        exit(1);
-                    }
-
-                    // RULE 5c: Direct address in indirect block is marked in use in bitmap
-                    if (get_bitmap_bit(addr, sb, blk) == 0)
-                    {
-                        fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                        exit(1);
-                    }
-
-                    // RULE 8b: Direct address in indirect block doesn't point to a block already in use
-                    if (used[blk])
-                    {
-                        fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                        exit(1);
-                    }
-                    used[blk] = 1;
-                }
-            }
-        }
+    *len = 0;
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
     }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    *len = st.st_size;
+    return data;
+}
+
+// Replace the index file at `path` (written next to it, then renamed into
+// place). Returns -1 on failure.
+static int save_index(const char *path, const struct fcheck_index *index)
+{
+    char tmp[4096 + sizeof(".tmp")];
+    size_t done = 0;
+    ssize_t n;
+    int fd;
 
-    // Compare used blocks against bitmap
-    for (blk = min_db; blk <= max_db; blk++)
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    while (done < index->len)
+    {
+        n = write(fd, (const char *)index->data + done, index->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (close(fd) < 0 || done < index->len || rename(tmp, path) < 0)
     {
-        int bit = get_bitmap_bit(addr, sb, blk);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
 
-        // RULE 6: Block marked in use in bitmap is actually used
-        if (bit == 1 && used[blk] == 0)
-        {
-            fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n");
-            exit(1);
-        }
+static const struct fcheck_spill spill_store = {spill_open, spill_write, spill_read, spill_close, NULL};
+
+// Describe the open image to libfcheck as a source
+static void image_source(struct fsimage *fs, struct fcheck_source *src)
+{
+    memset(src, 0, sizeof(*src));
+    src->bsize = fs->bsize;
+    if (fs->io == IO_MMAP)
+    {
+        // mmap: the whole image is in memory (once the pages are read in)
+        src->meta = fs->addr;
+        src->nmeta = fs->len / fs->bsize > (uint)-1 ? (uint)-1 : fs->len / fs->bsize;
+        src->prefetch = fs->advised != NULL ? mmap_prefetch : NULL;
+        src->hole = fs->sparse ? image_hole : NULL;
+        src->ctx = fs;
+    }
+    else if (fs->io == IO_PIPE)
+    {
+        // compressed: metadata is in memory, and a data block is waited for
+        // until the decompressor gets to it (zero blocks are holes)
+        src->meta = fs->meta;
+        src->nmeta = fs->nmeta;
+        src->read_block = pipe_read;
+        src->hole = pipe_hole;
+        src->ctx = fs;
+    }
+    else
+    {
+        // stream: metadata is in memory, data blocks come through the cache
+        src->meta = fs->meta;
+        src->nmeta = fs->nmeta;
+        src->read_block = cache_read;
+        src->prefetch = fs->direct ? NULL : cache_prefetch;
+        src->hole = fs->sparse ? image_hole : NULL;
+        src->ctx = fs;
     }
+}
+
+// Free the findings of a check_image() report (the arena's go with the arena)
+static void free_report(const struct check_opts *opts, struct fcheck_report *rep)
+{
+    if (opts->mem_limit != 0)
+        fcheck_report_free(NULL, rep);
+}
+
+// A compressed image is only as good as its whole stream: once the check is
+// done, a stream that broke off or failed replaces its result. A read error
+// of the stream back end is told apart from one of the spill store.
+static int finish_stream(struct fsimage *fs, const struct check_opts *opts, struct fcheck_report *rep, int result)
+{
+    int err;
+
+    if (result == FCHECK_IOERROR && fs->read_failed)
+        return CHECK_READERROR;
+    if (fs->io != IO_PIPE || (err = pipe_finish(fs)) == 0)
+        return result;
+    if (result >= 0)
+        free_report(opts, rep);
+    return err;
+}
+
+// Check an open image with libfcheck, taking scratch memory from `arena`
+// (reset first, so an earlier report from the same arena is gone). Under
+// --mem-limit, memory comes from malloc instead, which gives back what the
+// check frees (see free_report()), and sorted runs spill to temporary files.
+// With --index the check starts from the image's fingerprint index, which is
+// then brought up to date. With `stats`, the check's phases are timed into
+// it. Returns the fcheck_check() result, CHECK_BADSTREAM or CHECK_READERROR.
+static int check_image(struct fsimage *fs, const char *path, const struct check_opts *opts, struct arena *arena,
+                       struct stats *stats, struct fcheck_report *rep)
+{
+    struct fcheck_opts lib = {0};
+    struct fcheck_source src = {0};
+    struct fcheck_index index;
+    char index_path[4096];
+    void *old;
+    size_t old_len;
+    int result;
 
-    // RULE 3: Root directory exists, its inode number is 1, and the parent of the root directory is itself
-    // Check root inode is allocated and is a directory
-    if (sb->ninodes < 2 || itable[ROOTINO].type != T_DIR)
+    arena_reset(arena);
+    lib.all = opts->all;
+    lib.nthreads = opts->nthreads;
+    lib.rules = opts->rules;
+    lib.quick = opts->quick;
+    lib.prefetch = opts->prefetch < 0 ? 0 : opts->prefetch == 0 ? -1 : opts->prefetch;
+    lib.engine = opts->engine;
+    if (opts->format == FORMAT_JSON)
     {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        exit(1);
+        lib.finding = print_finding;
+        lib.finding_ctx = (void *)path;
     }
-    // Root directory must have at least one data block
-    if (itable[ROOTINO].addrs[0] == 0)
+    if (stats != NULL)
     {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        exit(1);
+        lib.stats = &stats->work;
+        lib.phase = stats_phase;
+        lib.phase_ctx = stats;
     }
-    // Scan root directory entries to make sure ".." exists and points to itself
-    de = (struct dirent *)(addr + itable[ROOTINO].addrs[0] * BLOCK_SIZE);
-    int found_dotdot = 0;
-    for (i = 0; i < itable[ROOTINO].size / sizeof(struct dirent); i++)
+    if (opts->mem_limit != 0)
     {
-        if (de[i].inum == 0)
-            break;
-        if (strcmp(de[i].name, "..") == 0)
-        {
-            found_dotdot = 1;
-            if (de[i].inum != ROOTINO)
-            {
-                fprintf(stderr, "ERROR: root directory does not exist.\n");
-                exit(1);
-            }
-            break;
-        }
+        lib.mem_limit = opts->mem_limit;
+        lib.spill = &spill_store;
     }
-    if (!found_dotdot)
+    else
     {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        exit(1);
+        lib.alloc = arena_alloc;
+        lib.release = arena_release;
+        lib.ctx = arena;
     }
 
-    // Track inode references for rules 9, 10, 11, 12
-    // inode_referenced: inode appears in some directory entry
-    int *inode_referenced = calloc(sb->ninodes, sizeof(int));
-    // inode_refcount: number of directory entries pointing to inode (excluding ".")
-    int *inode_refcount = calloc(sb->ninodes, sizeof(int));
-    // dir_refcount: number of parent directory links to a directory inode (excluding "." and "..")
-    int *dir_refcount = calloc(sb->ninodes, sizeof(int));
-    // parent: record parent directory inode number for each directory inode
-    int *parent = calloc(sb->ninodes, sizeof(int));
-    // dotdot_of: record ".." inode number for each directory inode
-    int *dotdot_of = calloc(sb->ninodes, sizeof(int));
-    if (inode_referenced == NULL || inode_refcount == NULL || dir_refcount == NULL || parent == NULL || dotdot_of == NULL)
+    image_source(fs, &src);
+    if (opts->index == NULL)
+        return finish_stream(fs, opts, rep, fcheck_check_source(&src, &lib, rep));
+
+    if (opts->index[0] != '\0')
+        snprintf(index_path, sizeof(index_path), "%s", opts->index);
+    else
+        snprintf(index_path, sizeof(index_path), "%s" INDEX_SUFFIX, path);
+    old = load_index(index_path, &old_len);
+    result = finish_stream(fs, opts, rep, fcheck_check_indexed(&src, &lib, old, old_len, rep, &index));
+    if (old != NULL)
+        munmap(old, old_len);
+    if (result >= 0 && index.data != NULL && save_index(index_path, &index) < 0)
+        fprintf(stderr, "cannot write index %s.\n", index_path);
+    return result;
+}
+
+// Why an image could not be checked, for a failed check_image() result
+static const char *check_failed(int result)
+{
+    if (result == FCHECK_BADIMAGE)
+        return "image is truncated or has a bad superblock.";
+    if (result == FCHECK_IOERROR)
+        return "cannot write temporary files.";
+    if (result == CHECK_BADSTREAM)
+        return "cannot decompress image.";
+    if (result == CHECK_READERROR)
+        return "cannot read image.";
+    return "out of memory.";
+}
+
+// Result of one image in a batch, printed in input order
+struct batch_result
+{
+    int done;
+    int failed;       // image could not be checked
+    char error[128];  // why (if failed)
+    int first;        // first violation (FCHECK_OK if clean)
+    uint nerrors;     // violations found (--all)
+};
+
+// A batch run: images are handed out to pool workers one at a time
+struct batch
+{
+    char **paths;
+    uint npaths;
+    uint nworkers;
+    const struct check_opts *opts;
+    struct batch_result *results;
+    uint next;        // next image to hand out
+    uint printed;     // results printed so far (in input order)
+    int status;       // overall exit status
+    pthread_mutex_t lock;
+};
+
+// --format=json: print the summary record of the image at `path`
+static void print_summary(const char *path, const struct batch_result *r, int all)
+{
+    flockfile(stdout);
+    printf("{\"type\":\"summary\",\"image\":");
+    print_json_string(path);
+    if (r->failed)
     {
-        perror("calloc failed\n");
-        exit(1);
+        printf(",\"status\":\"failed\",\"error\":");
+        print_json_string(r->error);
     }
-    // Initialize parent and dotdot_of arrays to "unknown"
-    for (i = 0; i < sb->ninodes; i++)
+    else if (r->first == FCHECK_OK)
+        printf(",\"status\":\"ok\"");
+    else
     {
-        parent[i] = -1;
-        dotdot_of[i] = -1;
+        printf(",\"status\":\"violations\",\"rule\":%d,\"message\":", fcheck_rule(r->first));
+        print_json_string(fcheck_message(r->first));
+        if (all)
+            printf(",\"errors\":%u", r->nerrors);
     }
+    printf("}\n");
+    funlockfile(stdout);
+}
+
+// Print every finished result at the front of the queue (caller holds the lock)
+static void batch_flush(struct batch *b)
+{
+    struct batch_result *r;
 
-    // RULE 4: Each directory contains . and .. entries, and the . entry points to itself
-    // First pass: for each directory inode, verify "." and ".." exist and record ".." target
-    for (i = 0; i < sb->ninodes; i++)
+    for (; b->printed < b->npaths && b->results[b->printed].done; b->printed++)
     {
-        dip = &itable[i];
-        if (dip->type != T_DIR)
-            continue;
+        r = &b->results[b->printed];
+        if (b->opts->format == FORMAT_JSON)
+            print_summary(b->paths[b->printed], r, b->opts->all);
+        else if (r->failed)
+            printf("%s: %s\n", b->paths[b->printed], r->error);
+        else if (r->first == FCHECK_OK)
+            printf("%s: OK\n", b->paths[b->printed]);
+        else if (b->opts->all)
+            printf("%s: %s (%u error%s)\n", b->paths[b->printed], fcheck_message(r->first),
+                   r->nerrors, r->nerrors == 1 ? "" : "s");
+        else
+            printf("%s: %s\n", b->paths[b->printed], fcheck_message(r->first));
+        if (r->failed || r->first != FCHECK_OK)
+            b->status = 1;
+    }
+    fflush(stdout);
+}
 
-        // Directory must have at least one data block
-        if (dip->addrs[0] == 0)
-        {
-            fprintf(stderr, "ERROR: directory not properly formatted.\n");
-            exit(1);
-        }
+// Pool worker: check images until none are left, reusing one arena
+static void *batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    struct check_opts opts = *b->opts;
+    struct arena arena = {0};
+    struct fcheck_report rep;
+    struct fsimage fs;
+    struct batch_result r;
+    uint n;
+    int result;
 
-        // Track whether "." and ".." were found in the first directory block
-        int dot = 0;
-        int dotdot = 0;
-        int dotdot_inum = -1;
+    opts.nthreads = 1; // the pool provides the parallelism
+    if (opts.mem_limit != 0)
+        opts.mem_limit = opts.mem_limit / b->nworkers > 0 ? opts.mem_limit / b->nworkers : 1; // shared by the workers
+    for (;;)
+    {
+        pthread_mutex_lock(&b->lock);
+        n = b->next < b->npaths ? b->next++ : b->npaths;
+        pthread_mutex_unlock(&b->lock);
+        if (n == b->npaths)
+            break;
 
-        // Read directory entries from the first data block
-        de = (struct dirent *)(addr + dip->addrs[0] * BLOCK_SIZE);
-        for (j = 0; j < BLOCK_SIZE / sizeof(struct dirent); j++)
+        memset(&r, 0, sizeof(r));
+        if (open_image(&fs, b->paths[n], opts.io, opts.bsize, pool_limit(opts.mem_limit), 0) < 0)
         {
-            if (de[j].inum == 0)
-                continue;
-
-            // "." must point to itself
-            if (strcmp(de[j].name, ".") == 0)
+            r.failed = 1;
+            snprintf(r.error, sizeof(r.error), "%s", fs.error);
+        }
+        else
+        {
+            result = check_image(&fs, b->paths[n], &opts, &arena, NULL, &rep);
+            close_image(&fs);
+            if (result < 0)
             {
-                if (de[j].inum != i)
-                {
-                    fprintf(stderr, "ERROR: directory not properly formatted.\n");
-                    exit(1);
-                }
-                dot = 1;
+                r.failed = 1;
+                snprintf(r.error, sizeof(r.error), "%s", check_failed(result));
             }
-            // Record ".." target so we can validate it after building parent relationships
-            else if (strcmp(de[j].name, "..") == 0)
+            else
             {
-                dotdot = 1;
-                dotdot_inum = de[j].inum;
+                r.first = rep.first;
+                r.nerrors = rep.nfindings;
+                free_report(&opts, &rep);
             }
         }
+        r.done = 1;
+
+        pthread_mutex_lock(&b->lock);
+        b->results[n] = r;
+        batch_flush(b);
+        pthread_mutex_unlock(&b->lock);
+    }
+    arena_free(&arena);
+    return NULL;
+}
+
+// Read image paths, one per line, from `listfile` ("-" for stdin) and
+// append them to the path list
+static int read_list(const char *listfile, char ***paths, uint *npaths)
+{
+    FILE *f = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
 
-        // Missing "." or ".." is a formatting error
-        if (!dot || !dotdot)
+    if (f == NULL)
+        return -1;
+    while ((len = getline(&line, &cap, f)) >= 0)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        *paths = realloc(*paths, (*npaths + 1) * sizeof(char *));
+        if (*paths == NULL)
         {
-            fprintf(stderr, "ERROR: directory not properly formatted.\n");
+            perror("realloc failed\n");
             exit(1);
         }
+        (*paths)[(*npaths)++] = strdup(line);
+    }
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return 0;
+}
+
+// Check many images on a pool of `opts->nthreads` workers, printing one line
+// per image to stdout. Returns 0 if every image is clean, 1 otherwise.
+static int check_batch(char **paths, uint npaths, const struct check_opts *opts)
+{
+    struct batch b = {0};
+    uint nworkers = opts->nthreads < 1 ? 1 : opts->nthreads;
+    pthread_t *tids;
+    uint t;
 
-        // Save ".." target for this directory inode
-        dotdot_of[i] = dotdot_inum;
+    if (nworkers > npaths)
+        nworkers = npaths > 0 ? npaths : 1;
+    b.paths = paths;
+    b.npaths = npaths;
+    b.nworkers = nworkers;
+    b.opts = opts;
+    b.results = calloc(npaths + 1, sizeof(struct batch_result));
+    tids = calloc(nworkers, sizeof(pthread_t));
+    if (b.results == NULL || tids == NULL)
+    {
+        perror("calloc failed\n");
+        exit(1);
     }
+    pthread_mutex_init(&b.lock, NULL);
 
-    // RULE 9, 10, 11, 12: Track inode references by traversing all directories
-    // Second pass: walk every directory entry and update inode reference bookkeeping
-    for (i = 0; i < sb->ninodes; i++)
+    for (t = 0; t < nworkers; t++)
     {
-        dip = &itable[i];
-        if (dip->type != T_DIR)
-            continue;
+        if (pthread_create(&tids[t], NULL, batch_worker, &b) != 0)
+        {
+            perror("pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (t = 0; t < nworkers; t++)
+        pthread_join(tids[t], NULL);
 
-        // Traverse direct directory blocks
-        for (j = 0; j < NDIRECT; j++)
+    pthread_mutex_destroy(&b.lock);
+    free(b.results);
+    free(tids);
+    return b.status;
+}
+
+// Parse a --rules list such as "1,2,3" or "5-6,9" into FCHECK_RULE() bits.
+// Returns -1 if it is malformed or names a rule outside 1-13.
+static int parse_rules(const char *list, unsigned *rules)
+{
+    char *end;
+    long lo, hi;
+
+    *rules = 0;
+    do
+    {
+        lo = hi = strtol(list, &end, 10);
+        if (end == list)
+            return -1;
+        if (*end == '-')
         {
-            blk = dip->addrs[j];
-            if (blk == 0)
-                continue;
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list)
+                return -1;
+        }
+        if (lo < 1 || hi > 13 || lo > hi)
+            return -1;
+        for (; lo <= hi; lo++)
+            *rules |= FCHECK_RULE(lo);
+        list = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
+}
 
-            de = (struct dirent *)(addr + blk * BLOCK_SIZE);
-            for (k = 0; k < BLOCK_SIZE / sizeof(struct dirent); k++, de++)
-            {
-                if (de->inum == 0)
-                    continue;
-
-                ref_inum = de->inum;
-                if (ref_inum >= sb->ninodes)
-                    continue;
-
-                // Build parent map for directories based on directory entries (excluding "." and "..")
-                if (strcmp(de->name, ".") != 0 && strcmp(de->name, "..") != 0 && itable[ref_inum].type == T_DIR)
-                {
-                    if (parent[ref_inum] == -1)
-                        parent[ref_inum] = i;
-                    else if (parent[ref_inum] != (int)i)
-                    {
-                        fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-                        exit(1);
-                    }
-                }
-
-                // Mark that this inode is referenced by some directory
-                inode_referenced[ref_inum] = 1;
-
-                // Count references for link count checks (exclude "." entry)
-                if (strcmp(de->name, ".") != 0)
-                    inode_refcount[ref_inum]++;
-
-                // Count directory parents (exclude "." and "..")
-                if (strcmp(de->name, ".") != 0 && strcmp(de->name, "..") != 0)
-                    dir_refcount[ref_inum]++;
-            }
+// Parse a --mem-limit size: bytes, or with a K, M or G suffix (powers of
+// 1024). Returns -1 if it is malformed or zero.
+static int parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    unsigned long long n;
+    int shift = 0;
+
+    if (*arg < '0' || *arg > '9')
+        return -1;
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+    else if (*end == 'G' || *end == 'g')
+        shift = 30;
+    if (shift != 0)
+        end++;
+    if (errno != 0 || *end != '\0' || n == 0 || n > (SIZE_MAX >> shift))
+        return -1;
+    *size = (size_t)n << shift;
+    return 0;
+}
+
+// Parse a --bsize block size: "auto" (0) or one libfcheck has an engine
+// for, 512, 1024 or 4096 bytes (also as 1K or 4K). Returns -1 otherwise.
+static int parse_bsize(const char *arg, uint *bsize)
+{
+    size_t n;
+
+    if (strcmp(arg, "auto") == 0)
+        n = 0;
+    else if (parse_size(arg, &n) < 0 || (n != 512 && n != 1024 && n != 4096))
+        return -1;
+    *bsize = n;
+    return 0;
+}
+
+// fcheck diff: how far the line of a file's changed data blocks has got
+struct diff_print
+{
+    uint inum;   // file whose data line is open (FCHECK_NONE if none)
+    uint lo, hi; // run of slots not yet printed on it
+};
+
+// Print a type of inode
+static void print_type(short type)
+{
+    if (type == T_DIR)
+        printf("dir");
+    else if (type == T_FILE)
+        printf("file");
+    else if (type == T_DEV)
+        printf("dev");
+    else
+        printf("type %d", type);
+}
+
+// Print the fields that differ between two versions of an inode
+static void print_inode_changes(const struct dinode *a, const struct dinode *b)
+{
+    const char *sep = "";
+    uint k;
+
+    if (a->type != b->type)
+    {
+        printf("type ");
+        print_type(a->type);
+        printf(" -> ");
+        print_type(b->type);
+        sep = ", ";
+    }
+#define FIELD(name, fmt)                                                              \
+    do                                                                                \
+    {                                                                                 \
+        if (a->name != b->name)                                                       \
+        {                                                                             \
+            printf("%s" #name " " fmt " -> " fmt, sep, a->name, b->name);             \
+            sep = ", ";                                                               \
+        }                                                                             \
+    } while (0)
+    FIELD(major, "%d");
+    FIELD(minor, "%d");
+    FIELD(nlink, "%d");
+    FIELD(size, "%u");
+#undef FIELD
+    for (k = 0; k < NDIRECT; k++)
+    {
+        if (a->addrs[k] != b->addrs[k])
+        {
+            printf("%sdirect %u: %u -> %u", sep, k, a->addrs[k], b->addrs[k]);
+            sep = ", ";
         }
+    }
+    if (a->addrs[NDIRECT] != b->addrs[NDIRECT])
+        printf("%sindirect block: %u -> %u", sep, a->addrs[NDIRECT], b->addrs[NDIRECT]);
+}
 
-        // Traverse indirect directory blocks (if present)
-        blk = dip->addrs[NDIRECT];
-        if (blk != 0)
+// Print the run of slots gathered on the open data line ("direct 0-3")
+static void print_slot_run(const struct diff_print *p)
+{
+    if (p->lo < FCHECK_SLOT_INDIRECT)
+        printf("direct %u", p->lo);
+    else
+        printf("indirect %u", p->lo - FCHECK_SLOT_ENTRY(0));
+    if (p->hi > p->lo)
+        printf("-%u", p->hi < FCHECK_SLOT_INDIRECT ? p->hi : p->hi - FCHECK_SLOT_ENTRY(0));
+}
+
+// Finish the open data line, if any
+static void diff_print_end(struct diff_print *p)
+{
+    if (p->inum == FCHECK_NONE)
+        return;
+    print_slot_run(p);
+    printf("\n");
+    p->inum = FCHECK_NONE;
+}
+
+// Print one change found by fcheck_diff() (the change callback). A file's
+// changed data blocks are gathered into one line, as runs of slots.
+static void print_change(void *ctx, const struct fcheck_change *c)
+{
+    struct diff_print *p = ctx;
+    const struct superblock *sa = c->before, *sb = c->after;
+    const struct dinode *ip = c->after != NULL ? c->after : c->before;
+    const char *sep = "", *name;
+
+    if (c->kind == FCHECK_DIFF_DATA && p->inum == c->inum)
+    {
+        // Extend the run, or print it and start the next
+        if (c->slot == p->hi + 1)
         {
-            indir = (uint *)(addr + blk * BLOCK_SIZE);
-            for (j = 0; j < NINDIRECT; j++)
-            {
-                blk = indir[j];
-                if (blk == 0)
-                    continue;
-
-                de = (struct dirent *)(addr + blk * BLOCK_SIZE);
-                for (k = 0; k < BLOCK_SIZE / sizeof(struct dirent); k++, de++)
-                {
-                    if (de->inum == 0)
-                        continue;
-
-                    ref_inum = de->inum;
-                    if (ref_inum >= sb->ninodes)
-                        continue;
-
-                    // Build parent map for directories based on directory entries (excluding "." and "..")
-                    if (strcmp(de->name, ".") != 0 && strcmp(de->name, "..") != 0 && itable[ref_inum].type == T_DIR)
-                    {
-                        if (parent[ref_inum] == -1)
-                            parent[ref_inum] = i;
-                        else if (parent[ref_inum] != (int)i)
-                        {
-                            fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-                            exit(1);
-                        }
-                    }
-
-                    // Mark that this inode is referenced by some directory
-                    inode_referenced[ref_inum] = 1;
-
-                    // Count references for link count checks (exclude "." entry)
-                    if (strcmp(de->name, ".") != 0)
-                        inode_refcount[ref_inum]++;
-
-                    // Count directory parents (exclude "." and "..")
-                    if (strcmp(de->name, ".") != 0 && strcmp(de->name, "..") != 0)
-                        dir_refcount[ref_inum]++;
-                }
-            }
+            p->hi++;
+            return;
         }
+        print_slot_run(p);
+        printf(", ");
+        p->lo = p->hi = c->slot;
+        return;
+    }
+    diff_print_end(p);
+
+    switch (c->kind)
+    {
+    case FCHECK_DIFF_SUPERBLOCK:
+        printf("superblock: ");
+        if (sa->size != sb->size)
+            printf("size %u -> %u", sa->size, sb->size), sep = ", ";
+        if (sa->nblocks != sb->nblocks)
+            printf("%snblocks %u -> %u", sep, sa->nblocks, sb->nblocks), sep = ", ";
+        if (sa->ninodes != sb->ninodes)
+            printf("%sninodes %u -> %u", sep, sa->ninodes, sb->ninodes);
+        printf("\n");
+        break;
+    case FCHECK_DIFF_INODE_ADDED:
+    case FCHECK_DIFF_INODE_REMOVED:
+        printf("inode %u: %s (", c->inum, c->kind == FCHECK_DIFF_INODE_ADDED ? "added" : "removed");
+        print_type(ip->type);
+        printf(", %d link%s, %u bytes)\n", ip->nlink, ip->nlink == 1 ? "" : "s", ip->size);
+        break;
+    case FCHECK_DIFF_INODE:
+        printf("inode %u: ", c->inum);
+        print_inode_changes(c->before, c->after);
+        printf("\n");
+        break;
+    case FCHECK_DIFF_DATA:
+        printf("inode %u: data changed in ", c->inum);
+        p->inum = c->inum;
+        p->lo = p->hi = c->slot;
+        break;
+    case FCHECK_DIFF_ENTRY_ADDED:
+    case FCHECK_DIFF_ENTRY_REMOVED:
+        printf("dir %u: %c \"", c->inum, c->kind == FCHECK_DIFF_ENTRY_ADDED ? '+' : '-');
+        for (name = c->name; *name != '\0'; name++)
+            printf(*name == '"' || *name == '\\' || (uchar)*name < 0x20 || (uchar)*name >= 0x7f ? "\\x%02x" : "%c",
+                   (uchar)*name);
+        printf("\" -> %u\n", c->target);
+        break;
+    case FCHECK_DIFF_ALLOCATED:
+    case FCHECK_DIFF_FREED:
+        printf("bitmap: %c %u", c->kind == FCHECK_DIFF_ALLOCATED ? '+' : '-', c->blk);
+        if (c->count > 1)
+            printf("-%u", c->blk + c->count - 1);
+        printf("\n");
+        break;
     }
+}
+
+#define DIFF_USAGE "Usage: fcheck diff [--io=mmap|stream] [--bsize=auto|512|1024|4096] <image_a> <image_b>\n"
 
-    // Validate .. entries using parent map
-    // Third pass: confirm each directory's ".." matches the discovered parent directory
-    for (i = 0; i < sb->ninodes; i++)
+// fcheck diff: print what changed from image a to image b, one change a
+// line. Exits 0 if nothing did, 1 if something did, 2 on trouble (as diff(1)).
+static int diff_main(int argc, char *argv[])
+{
+    struct fsimage fs[2];
+    struct fcheck_source src[2];
+    struct diff_print p = {FCHECK_NONE, 0, 0};
+    int io = IO_MMAP, opt, k, result, err;
+    uint bsize = 0;
+
+    static const struct option long_options[] = {
+        {"io", required_argument, NULL, 'i'},
+        {"bsize", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
     {
-        dip = &itable[i];
-        if (dip->type != T_DIR)
+        if (opt == 'i' && strcmp(optarg, "mmap") == 0)
+            io = IO_MMAP;
+        else if (opt == 'i' && strcmp(optarg, "stream") == 0)
+            io = IO_STREAM;
+        else if (opt == 'b' && parse_bsize(optarg, &bsize) == 0)
             continue;
+        else
+        {
+            fprintf(stderr, DIFF_USAGE);
+            exit(2);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, DIFF_USAGE);
+        exit(2);
+    }
 
-        // If we never recorded ".." for this directory, formatting is wrong
-        if (dotdot_of[i] == -1)
+    for (k = 0; k < 2; k++)
+    {
+        if (open_image(&fs[k], argv[optind + k], io, bsize, POOL_LIMIT, 1) < 0)
         {
-            fprintf(stderr, "ERROR: directory not properly formatted.\n");
-            exit(1);
+            fprintf(stderr, "%s: %s\n", argv[optind + k], fs[k].error);
+            exit(2);
         }
+        image_source(&fs[k], &src[k]);
+    }
+    if (fs[0].bsize != fs[1].bsize)
+    {
+        fprintf(stderr, "images have different block sizes (%u and %u bytes).\n", fs[0].bsize, fs[1].bsize);
+        exit(2);
+    }
+    result = fcheck_diff(&src[0], &src[1], NULL, print_change, &p);
+    diff_print_end(&p);
+    for (k = 0; k < 2; k++)
+    {
+        if (result == FCHECK_IOERROR && fs[k].read_failed)
+            result = CHECK_READERROR;
+        if (fs[k].io == IO_PIPE && (err = pipe_finish(&fs[k])) < 0 && result >= 0)
+            result = err;
+        close_image(&fs[k]);
+    }
+    if (result < 0)
+    {
+        fflush(stdout);
+        fprintf(stderr, "%s\n", check_failed(result));
+        exit(2);
+    }
+    return result;
+}
+
+#define USAGE                                                                                           \
+    "Usage: fcheck [-j N] [--all] [--io=mmap|stream] [--list=FILE] [--index[=FILE]] [--rules=LIST]\n"   \
+    "              [--stats[=text|json]] [--quick] [--reach] [--prefetch=N]\n"                          \
+    "              [--engine=auto|bitmap|sort] [--mem-limit=SIZE] [--format=text|json]\n"               \
+    "              [--bsize=auto|512|1024|4096] <file_system_image>...\n"                               \
+    "       fcheck diff [--io=mmap|stream] [--bsize=auto|512|1024|4096] <image_a> <image_b>\n"
+
+int main(int argc, char *argv[])
+{
+    struct check_opts opts = {1, 0, IO_MMAP, NULL, 0, STATS_NONE, 0, -1, FCHECK_ENGINE_AUTO, 0, FORMAT_TEXT, 0};
+    struct arena arena = {0};
+    struct stats stats;
+    struct fcheck_report rep;
+    struct batch_result r = {0};
+    struct fsimage fs;
+    char **paths = NULL;
+    uint npaths = 0;
+    int batch = 0;
+    int reach = 0;
+    int opt, i, err, result;
+
+    static const struct option long_options[] = {
+        {"all", no_argument, NULL, 'a'},
+        {"io", required_argument, NULL, 'i'},
+        {"list", required_argument, NULL, 'l'},
+        {"index", optional_argument, NULL, 'x'},
+        {"rules", required_argument, NULL, 'r'},
+        {"stats", optional_argument, NULL, 's'},
+        {"quick", no_argument, NULL, 'q'},
+        {"reach", no_argument, NULL, 'R'},
+        {"prefetch", required_argument, NULL, 'p'},
+        {"engine", required_argument, NULL, 'e'},
+        {"mem-limit", required_argument, NULL, 'm'},
+        {"format", required_argument, NULL, 'f'},
+        {"bsize", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
 
-        // Root's parent must be itself
-        if (i == ROOTINO)
+    // "fcheck diff" compares two images instead of checking
+    if (argc > 1 && strcmp(argv[1], "diff") == 0)
+        return diff_main(argc - 1, argv + 1);
+
+    // Parse options
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1)
+    {
+        if (opt == 'j' && atoi(optarg) > 0)
+            opts.nthreads = atoi(optarg);
+        else if (opt == 'a')
+            opts.all = 1;
+        else if (opt == 'i' && strcmp(optarg, "mmap") == 0)
+            opts.io = IO_MMAP;
+        else if (opt == 'i' && strcmp(optarg, "stream") == 0)
+            opts.io = IO_STREAM;
+        else if (opt == 'l')
         {
-            if (dotdot_of[i] != ROOTINO)
+            if (read_list(optarg, &paths, &npaths) < 0)
             {
-                fprintf(stderr, "ERROR: directory not properly formatted.\n");
+                fprintf(stderr, "cannot read image list %s.\n", optarg);
                 exit(1);
             }
+            batch = 1;
         }
+        else if (opt == 'x')
+            opts.index = optarg != NULL ? optarg : "";
+        else if (opt == 'r' && parse_rules(optarg, &opts.rules) == 0)
+            continue;
+        else if (opt == 's' && (optarg == NULL || strcmp(optarg, "text") == 0))
+            opts.stats = STATS_TEXT;
+        else if (opt == 's' && strcmp(optarg, "json") == 0)
+            opts.stats = STATS_JSON;
+        else if (opt == 'q')
+            opts.quick = 1;
+        else if (opt == 'R')
+            reach = 1;
+        else if (opt == 'p' && (atoi(optarg) > 0 || strcmp(optarg, "0") == 0))
+            opts.prefetch = atoi(optarg);
+        else if (opt == 'e' && strcmp(optarg, "auto") == 0)
+            opts.engine = FCHECK_ENGINE_AUTO;
+        else if (opt == 'e' && strcmp(optarg, "bitmap") == 0)
+            opts.engine = FCHECK_ENGINE_BITMAP;
+        else if (opt == 'e' && strcmp(optarg, "sort") == 0)
+            opts.engine = FCHECK_ENGINE_SORT;
+        else if (opt == 'm' && parse_size(optarg, &opts.mem_limit) == 0)
+            continue;
+        else if (opt == 'f' && strcmp(optarg, "text") == 0)
+            opts.format = FORMAT_TEXT;
+        else if (opt == 'f' && strcmp(optarg, "json") == 0)
+            opts.format = FORMAT_JSON;
+        else if (opt == 'b' && parse_bsize(optarg, &opts.bsize) == 0)
+            continue;
         else
         {
-            // Only validate directories that are referenced in the tree
-            if (inode_referenced[i] && parent[i] != dotdot_of[i])
-            {
-                fprintf(stderr, "ERROR: directory not properly formatted.\n");
-                exit(1);
-            }
+            fprintf(stderr, USAGE);
+            exit(1);
         }
     }
 
-    // RULE 9: For all inodes marked in use, each must be referred to in at least one directory
-    for (i = 0; i < sb->ninodes; i++)
+    // --reach adds Rule 13 to the rules selected (all of 1-12 by default)
+    if (reach)
+        opts.rules = (opts.rules != 0 ? opts.rules : FCHECK_ALL_RULES) | FCHECK_REACH;
+
+    // Remaining arguments are images; more than one means batch mode
+    for (i = optind; i < argc; i++)
     {
-        if (itable[i].type != 0 && inode_referenced[i] == 0)
+        paths = realloc(paths, (npaths + 1) * sizeof(char *));
+        if (paths == NULL)
         {
-            fprintf(stderr, "ERROR: inode marked use but not found in a directory.\n");
+            perror("realloc failed\n");
             exit(1);
         }
+        paths[npaths++] = strdup(argv[i]);
+    }
+    if (argc - optind > 1)
+        batch = 1;
+
+    // Usage check (one named index file cannot serve several images, and
+    // phase times are per process, so --stats takes a single image)
+    if ((npaths == 0 && !batch) || (batch && opts.index != NULL && opts.index[0] != '\0') ||
+        (batch && opts.stats != STATS_NONE))
+    {
+        fprintf(stderr, USAGE);
+        exit(1);
     }
 
-    // RULE 10: For each inode number that is referred to in a valid directory, it is actually marked in use
-    for (i = 0; i < sb->ninodes; i++)
+    // The index's memory is not counted, so the library does without it
+    if (opts.index != NULL && opts.mem_limit != 0)
+        fprintf(stderr, "warning: --index is ignored under --mem-limit.\n");
+
+    if (batch)
+        err = check_batch(paths, npaths, &opts);
+    else
     {
-        if (inode_referenced[i] == 1 && itable[i].type == 0)
+        // --- SETUP AND READ METADATA ---
+        if (opts.stats != STATS_NONE)
+        {
+            stats_init(&stats);
+            stats_switch(&stats, PHASE_OPEN);
+        }
+        if (open_image(&fs, paths[0], opts.io, opts.bsize, pool_limit(opts.mem_limit), 0) < 0)
         {
-            fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
+            r.failed = 1;
+            snprintf(r.error, sizeof(r.error), "%s", fs.error);
+            if (opts.format == FORMAT_JSON)
+                print_summary(paths[0], &r, opts.all);
+            else
+                fprintf(stderr, "%s\n", fs.error);
             exit(1);
         }
-    }
 
-    // RULE 11: Reference counts (number of links) for regular files match the number of times file is referred to in directories
-    for (i = 0; i < sb->ninodes; i++)
-    {
-        if (itable[i].type == T_FILE)
+        result = check_image(&fs, paths[0], &opts, &arena, opts.stats != STATS_NONE ? &stats : NULL, &rep);
+        close_image(&fs);
+        if (opts.stats != STATS_NONE)
         {
-            if (itable[i].nlink != inode_refcount[i])
-            {
-                fprintf(stderr, "ERROR: bad reference count for file.\n");
-                exit(1);
-            }
+            stats_switch(&stats, -1);
+            stats_close(&stats);
+        }
+        if (result < 0)
+        {
+            r.failed = 1;
+            snprintf(r.error, sizeof(r.error), "%s", check_failed(result));
+            if (opts.format == FORMAT_JSON)
+                print_summary(paths[0], &r, opts.all);
+            else
+                fprintf(stderr, "%s\n", r.error);
+            exit(1);
         }
-    }
 
-    // RULE 12: No extra links allowed for directories (each directory only appears in one other directory)
-    for (i = 0; i < sb->ninodes; i++)
-    {
-        if (itable[i].type == T_DIR && i != ROOTINO)
+        // --- REPORT --- (with --format=json the findings are out already)
+        if (opts.format == FORMAT_JSON)
         {
-            if (dir_refcount[i] > 1)
-            {
-                fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-                exit(1);
-            }
+            r.first = rep.first;
+            r.nerrors = rep.nfindings;
+            print_summary(paths[0], &r, opts.all);
+            err = rep.first != FCHECK_OK;
         }
+        else
+            err = print_report(opts.all, &rep) > 0;
+        if (opts.stats != STATS_NONE)
+            print_stats(&stats, paths[0], opts.stats);
+
+        // --- CLEANUP ---
+        free_report(&opts, &rep);
+        arena_free(&arena);
     }
 
-    // --- CLEANUP ---
-    free(inode_referenced);
-    free(inode_refcount);
-    free(dir_refcount);
-    free(dotdot_of);
-    free(parent);
-    munmap(addr, st.st_size);
-    close(fsfd);
-    return 0; // success
+    for (i = 0; i < (int)npaths; i++)
+        free(paths[i]);
+    free(paths);
+    return err; // 0 if every image is clean, 1 otherwise
 }
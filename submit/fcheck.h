@@ -17,7 +17,9 @@ typedef unsigned char  uchar;
 // Inodes start at block 2.
 
 #define ROOTINO 1  // root i-number
+#ifndef BSIZE      // (defined beforehand for xv6 variants with larger blocks)
 #define BSIZE 512  // block size
+#endif
 
 // File system super block
 struct superblock {
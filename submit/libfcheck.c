@@ -0,0 +1,3675 @@
+// libfcheck: the consistency checking engine behind fcheck (see libfcheck.h).
+// Everything here works on blocks handed over by the caller; opening,
+// reading and printing images is left to fcheck.c.
+//
+// The engine is built once per block size, with the geometry (BSIZE and
+// everything fcheck.h derives from it) a constant in each build, so the
+// loops over a block's addresses, entries, inodes and bitmap bits have
+// fixed trip counts. Compiled as is, this file is the build for 512-byte
+// blocks and also holds the public entry points, which hand each image to
+// the build for its block size; libfcheck_1k.c and libfcheck_4k.c include
+// it with BSIZE defined as 1024 and 4096.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h> // for -j worker threads
+#include <sched.h>   // for sched_yield() in the reachability walk
+#ifdef __SSE2__
+#include <emmintrin.h> // for the 128-bit bitmap compare and dirent classification
+#endif
+
+#ifndef BSIZE
+#define FRONT_END // the public entry points are built along with the 512-byte engine
+#endif
+
+#include "fcheck.h"    // includes xv6 definitions
+#include "libfcheck.h" // public interface
+
+#define BLOCK_SIZE (BSIZE)
+
+// Name of an entry point of this build of the engine, e.g.
+// ENGINE(fcheck_diff) is fcheck_diff_4096 in the build for 4 KB blocks
+#define ENGINE(name) ENGINE_NAME(name, BSIZE)
+#define ENGINE_NAME(name, bsize) ENGINE_PASTE(name, bsize)
+#define ENGINE_PASTE(name, bsize) name##_##bsize
+
+// fcheck_metadata_blocks() for this block size (defined at the end, with
+// the other entry points)
+unsigned ENGINE(fcheck_metadata_blocks)(const void *head);
+
+#ifdef FRONT_END
+// Message printed for each violation code (indexed by FCHECK_*)
+static const char *error_messages[] = {
+    [FCHECK_BAD_INODE] = "ERROR: bad inode.",
+    [FCHECK_BAD_DIRECT] = "ERROR: bad direct address in inode.",
+    [FCHECK_BAD_INDIRECT] = "ERROR: bad indirect address in inode.",
+    [FCHECK_NO_ROOT] = "ERROR: root directory does not exist.",
+    [FCHECK_DIR_FORMAT] = "ERROR: directory not properly formatted.",
+    [FCHECK_BITMAP_FREE] = "ERROR: address used by inode but marked free in bitmap.",
+    [FCHECK_BITMAP_USED] = "ERROR: bitmap marks block in use but it is not in use.",
+    [FCHECK_DIRECT_TWICE] = "ERROR: direct address used more than once.",
+    [FCHECK_INDIRECT_TWICE] = "ERROR: indirect address used more than once.",
+    [FCHECK_NOT_IN_DIR] = "ERROR: inode marked use but not found in a directory.",
+    [FCHECK_REF_FREE] = "ERROR: inode referred to in directory but marked free.",
+    [FCHECK_BAD_REFCOUNT] = "ERROR: bad reference count for file.",
+    [FCHECK_DIR_TWICE] = "ERROR: directory appears more than once in file system.",
+    [FCHECK_UNREACHABLE] = "ERROR: inode not reachable from the root directory.",
+    [FCHECK_DIR_CYCLE] = "ERROR: directory cycle in file system.",
+};
+#endif
+
+// Rule number for each violation code (indexed by FCHECK_*)
+static const int error_rules[] = {
+    [FCHECK_BAD_INODE] = 1,
+    [FCHECK_BAD_DIRECT] = 2,
+    [FCHECK_BAD_INDIRECT] = 2,
+    [FCHECK_NO_ROOT] = 3,
+    [FCHECK_DIR_FORMAT] = 4,
+    [FCHECK_BITMAP_FREE] = 5,
+    [FCHECK_BITMAP_USED] = 6,
+    [FCHECK_DIRECT_TWICE] = 7,
+    [FCHECK_INDIRECT_TWICE] = 8,
+    [FCHECK_NOT_IN_DIR] = 9,
+    [FCHECK_REF_FREE] = 10,
+    [FCHECK_BAD_REFCOUNT] = 11,
+    [FCHECK_DIR_TWICE] = 12,
+    [FCHECK_UNREACHABLE] = 13,
+    [FCHECK_DIR_CYCLE] = 13,
+};
+
+#define NONE FCHECK_NONE
+
+// Where rule violations go. By default checking stops at the first
+// violation. With opts->all every violation is recorded in the order found.
+struct report
+{
+    const struct fcheck_opts *opts; // allocator for the findings
+    int all;                        // keep going after the first violation
+    int first;                      // first violation reported (FCHECK_OK if none)
+    int nomem;                      // the findings array could not grow
+    int stream;                     // hand findings to opts->finding instead of keeping them
+    struct fcheck_finding *findings;
+    uint nfindings, cap;
+};
+
+// Has checking stopped (at the first violation, or for lack of memory)?
+#define STOPPED(rep) (((rep)->first != FCHECK_OK && !(rep)->all) || (rep)->nomem)
+
+// The image being checked and the values derived from its superblock
+struct fsimage
+{
+    const struct fcheck_source *src;
+    const char *meta;              // blocks 0 .. nmeta-1
+    uint nmeta;
+    const struct superblock *sb;   // superblock (block 1)
+    const struct dinode *itable;   // start of the inode table (block 2)
+    const uchar *bitmap;           // on-disk bitmap (bit for block 0 onwards)
+    uint min_db, max_db;           // valid data block range
+    uint rules;                    // FCHECK_RULE() bits of the rules being checked
+    uint plan;                     // PLAN_* passes those rules need
+    uint ahead;                    // prefetch distance (0: no prefetching)
+    int read_failed;               // the source failed to read a block (set atomically)
+};
+
+// Default prefetch distance: enough inodes or directories ahead to cover a
+// miss to memory, or to give the source a head start on a read
+#define PREFETCH_AHEAD 16
+
+// Passes of the check beyond the inode scan (which always runs: Rule 1, and
+// the inode lists every later pass iterates), and the rules that need them
+#define PLAN_ADDRS 0x01    // walk each inode's block addresses: Rules 2, 5-8
+#define PLAN_OWNERS 0x02   // block ownership bitset: Rules 5-8
+#define PLAN_DIRS 0x04     // directory sweep: Rules 4, 9-12 (Rule 3 reads the root alone)
+#define PLAN_REFS 0x08     // which inodes are referenced: Rules 4, 9, 10
+#define PLAN_PARENTS 0x10  // parent map and each directory's "..": Rules 4, 12
+#define PLAN_REFCOUNT 0x20 // link counts: Rule 11
+#define PLAN_REACH 0x40    // walk from the root: Rule 13
+
+static const uint rule_needs[] = {
+    [2] = PLAN_ADDRS,
+    [4] = PLAN_DIRS | PLAN_REFS | PLAN_PARENTS,
+    [5] = PLAN_ADDRS | PLAN_OWNERS,
+    [6] = PLAN_ADDRS | PLAN_OWNERS,
+    [7] = PLAN_ADDRS | PLAN_OWNERS,
+    [8] = PLAN_ADDRS | PLAN_OWNERS,
+    [9] = PLAN_DIRS | PLAN_REFS,
+    [10] = PLAN_DIRS | PLAN_REFS,
+    [11] = PLAN_DIRS | PLAN_REFCOUNT,
+    [12] = PLAN_DIRS | PLAN_PARENTS,
+    [13] = PLAN_REACH,
+};
+
+// Every rule fcheck_opts.rules can select
+#define KNOWN_RULES (FCHECK_ALL_RULES | FCHECK_REACH)
+
+// Do the options select Rules 1-12 and nothing else, as the quick check and
+// the index assume?
+static int classic_rules(const struct fcheck_opts *opts)
+{
+    return opts->rules == 0 || (opts->rules & KNOWN_RULES) == FCHECK_ALL_RULES;
+}
+
+// Is the rule behind violation `err` being checked?
+#define RULE_ON(fs, err) (((fs)->rules >> error_rules[(err)]) & 1)
+
+// Space a block can be copied into (aligned for any block contents)
+union block
+{
+    uchar bytes[BLOCK_SIZE];
+    uint addrs[NINDIRECT];
+    struct dirent entries[BLOCK_SIZE / sizeof(struct dirent)];
+};
+
+// Block ownership bitset: one bit per block, in 64-bit words. Bit (b % 64)
+// of word b / 64 is byte b / 8, bit b % 8 on a little-endian host, which is
+// exactly the layout of the xv6 on-disk bitmap, so the two compare directly.
+#define BITSET_WORDS(nbits) (((nbits) + 63) / 64)
+
+static inline int bitset_test(const uint64_t *bits, uint blk)
+{
+    return (bits[blk / 64] >> (blk % 64)) & 0x1;
+}
+
+static inline void bitset_set(uint64_t *bits, uint blk)
+{
+    bits[blk / 64] |= (uint64_t)1 << (blk % 64);
+}
+
+// Allocate scratch memory with the caller's allocator (or malloc)
+static void *lib_alloc(const struct fcheck_opts *opts, size_t size)
+{
+    if (opts->alloc != NULL)
+        return opts->alloc(opts->ctx, size);
+    return malloc(size);
+}
+
+// Allocate zeroed scratch memory
+static void *lib_calloc(const struct fcheck_opts *opts, size_t size)
+{
+    void *p = lib_alloc(opts, size);
+    if (p != NULL)
+        memset(p, 0, size);
+    return p;
+}
+
+// Free scratch memory with the caller's allocator (or free)
+static void lib_free(const struct fcheck_opts *opts, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    if (opts->release != NULL)
+        opts->release(opts->ctx, ptr);
+    else if (opts->alloc == NULL)
+        free(ptr);
+}
+
+// Scratch memory under fcheck_opts.mem_limit: allocations go to the caller's
+// allocator with a header recording their size, and fail once the bytes
+// held would pass the limit. (With an allocator that frees nothing, nothing
+// is given back.) A check allocates from one thread only.
+struct budget
+{
+    const struct fcheck_opts *opts; // the caller's options
+    size_t limit, held;
+};
+
+#define BUDGET_HEADER 16 // keeps malloc() alignment
+
+static void *budget_alloc(void *ctx, size_t size)
+{
+    struct budget *b = ctx;
+    size_t *p;
+
+    if (size > b->limit - b->held || BUDGET_HEADER > b->limit - b->held - size)
+        return NULL;
+    p = lib_alloc(b->opts, size + BUDGET_HEADER);
+    if (p == NULL)
+        return NULL;
+    *p = size + BUDGET_HEADER;
+    b->held += *p;
+    return (char *)p + BUDGET_HEADER;
+}
+
+static void budget_release(void *ctx, void *ptr)
+{
+    struct budget *b = ctx;
+    size_t *p = (size_t *)((char *)ptr - BUDGET_HEADER);
+
+    if (b->opts->alloc != NULL && b->opts->release == NULL)
+        return;
+    b->held -= *p;
+    lib_free(b->opts, p);
+}
+
+// Options for a check's scratch memory: `opts` itself, or with a memory
+// limit, a copy in `lim` that allocates through `b`
+static const struct fcheck_opts *limit_memory(const struct fcheck_opts *opts, struct fcheck_opts *lim, struct budget *b)
+{
+    if (opts->mem_limit == 0)
+        return opts;
+    b->opts = opts;
+    b->limit = opts->mem_limit;
+    b->held = 0;
+    *lim = *opts;
+    lim->alloc = budget_alloc;
+    lim->release = budget_release;
+    lim->ctx = b;
+    return lim;
+}
+
+// Bytes of scratch memory still available (SIZE_MAX without a limit)
+static size_t lib_available(const struct fcheck_opts *opts)
+{
+    const struct budget *b = opts->ctx;
+
+    if (opts->alloc != budget_alloc)
+        return SIZE_MAX;
+    return b->limit - b->held;
+}
+
+// Record a rule violation, with where inode `inum` holds block `blk` and,
+// for a block used twice, which inode (and where) claimed it first. In the
+// default mode only the first violation is kept and callers stop checking
+// once STOPPED() is true.
+static void report_owned(struct report *rep, int err, uint inum, uint blk, uint slot, uint owner, uint owner_slot)
+{
+    struct fcheck_finding f = {err, inum, blk, slot, owner, owner_slot};
+    struct fcheck_finding *grown;
+    int first = rep->first == FCHECK_OK;
+
+    // Rules that were not selected are not reported
+    if (!((rep->opts->rules ? rep->opts->rules : FCHECK_ALL_RULES) >> error_rules[err] & 1))
+        return;
+    if (first)
+        rep->first = err;
+
+    // Streamed findings go straight to the caller and are only counted
+    if (rep->stream)
+    {
+        if (first || rep->all)
+            rep->opts->finding(rep->opts->finding_ctx, &f);
+        rep->nfindings += rep->all;
+        return;
+    }
+    if (!rep->all || rep->nomem)
+        return;
+
+    if (rep->nfindings == rep->cap)
+    {
+        grown = lib_alloc(rep->opts, (rep->cap ? rep->cap * 2 : 64) * sizeof(struct fcheck_finding));
+        if (grown == NULL)
+        {
+            rep->nomem = 1;
+            return;
+        }
+        if (rep->nfindings > 0)
+            memcpy(grown, rep->findings, rep->nfindings * sizeof(struct fcheck_finding));
+        lib_free(rep->opts, rep->findings);
+        rep->findings = grown;
+        rep->cap = rep->cap ? rep->cap * 2 : 64;
+    }
+    rep->findings[rep->nfindings++] = f;
+}
+
+// Record a rule violation that involves no particular slot
+static void report_error(struct report *rep, int err, uint inum, uint blk)
+{
+    report_owned(rep, err, inum, blk, NONE, NONE, NONE);
+}
+
+// Tell the caller's phase hook (if any) that phase `p` starts
+#define PHASE(opts, p)                                   \
+    do                                                   \
+    {                                                    \
+        if ((opts)->phase != NULL)                       \
+            (opts)->phase((opts)->phase_ctx, (p));       \
+    } while (0)
+
+// Add the counters of `src` to `dst` (every field is a counter)
+static void add_stats(struct fcheck_stats *dst, const struct fcheck_stats *src)
+{
+    unsigned long long *d = (unsigned long long *)dst;
+    const unsigned long long *s = (const unsigned long long *)src;
+    size_t k;
+
+    for (k = 0; k < sizeof(*dst) / sizeof(*d); k++)
+        d[k] += s[k];
+}
+
+// Is `blk` inside the data block range?
+static inline int valid_data_block(struct fsimage *fs, uint blk)
+{
+    return blk >= fs->min_db && blk <= fs->max_db;
+}
+
+// Helper function to get the bit value for a given block from the bitmap
+static int get_bitmap_bit(const char *addr, const struct superblock *sb, uint blk)
+{
+    // Find which bitmap block contains the bit
+    uint bblk = BBLOCK(blk, sb->ninodes);
+    const uchar *bptr = (const uchar *)addr + bblk * BLOCK_SIZE;
+    // Extract the specific bit
+    uint bit_index = blk % (BLOCK_SIZE * 8);
+    uint byte_index = bit_index / 8;
+    uint bit_position = bit_index % 8;
+    return (bptr[byte_index] >> bit_position) & 0x1;
+}
+
+// Is block `blk` in a hole of a sparse image (and so all zeroes)?
+static inline int in_hole(struct fsimage *fs, uint blk)
+{
+    return fs->src->hole != NULL && fs->src->hole(fs->src->ctx, blk);
+}
+
+// Inodes from `i` on that are free because their block of the inode table
+// is a hole: a block's worth if i starts one (and it ends by `hi`), else 0
+static inline uint inodes_in_hole(struct fsimage *fs, uint i, uint hi)
+{
+    return i % IPB == 0 && hi - i >= IPB && in_hole(fs, IBLOCK(i)) ? IPB : 0;
+}
+
+// Return the contents of block `blk`: in place for blocks held in memory,
+// otherwise from the source's read_block (possibly copied into `buf`). A
+// block in a hole is not touched at all. A block the source cannot read is
+// noted in fs->read_failed and reads as zeroes; the check goes on, but its
+// verdict is replaced by FCHECK_IOERROR.
+static const void *read_block(struct fsimage *fs, uint blk, union block *buf)
+{
+    static const union block zeroes;
+    const void *data;
+
+    if (in_hole(fs, blk))
+        return &zeroes;
+    if (blk < fs->nmeta)
+        return fs->meta + (size_t)blk * BLOCK_SIZE;
+    if (fs->src->read_block != NULL)
+    {
+        data = fs->src->read_block(fs->src->ctx, blk, buf);
+        if (data != NULL)
+            return data;
+        __atomic_store_n(&fs->read_failed, 1, __ATOMIC_RELAXED);
+        return &zeroes;
+    }
+    memset(buf, 0, sizeof(*buf)); // past the end of the image
+    return buf;
+}
+
+// Start bringing in block `blk`, which will be read soon: into the CPU cache
+// if it is in memory, and through the source's prefetch hook
+static inline void prefetch_block(struct fsimage *fs, uint blk)
+{
+    const char *p;
+    uint k;
+
+    if (blk == 0 || !valid_data_block(fs, blk) || in_hole(fs, blk))
+        return;
+    if (blk < fs->nmeta)
+    {
+        p = fs->meta + (size_t)blk * BLOCK_SIZE;
+        for (k = 0; k < BLOCK_SIZE; k += 64)
+            __builtin_prefetch(p + k);
+    }
+    if (fs->src->prefetch != NULL)
+        fs->src->prefetch(fs->src->ctx, blk);
+}
+
+// Load 8 bitmap bytes as a word (the buffers need not be 8-byte aligned)
+static inline uint64_t load_word(const uchar *p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+// Return the first bit in [lo, hi] that is set in bitmap `a` but clear in
+// bitmap `b`, or -1 if there is none. Both bitmaps use the on-disk layout.
+// The bulk of the range is compared 16 bytes (SSE2) or 8 bytes at a time.
+static long bitmap_andnot_first(const uchar *a, const uchar *b, uint lo, uint hi)
+{
+    uint blk = lo;
+    uint byte;
+
+    // Leading bits up to a byte boundary
+    for (; blk <= hi && blk % 8 != 0; blk++)
+        if (((a[blk / 8] & ~b[blk / 8]) >> (blk % 8)) & 0x1)
+            return blk;
+    if (blk > hi)
+        return -1;
+
+    // Whole bytes: skip ahead while both bitmaps agree
+    byte = blk / 8;
+#ifdef __SSE2__
+    for (; (uint64_t)byte * 8 + 127 <= hi; byte += 16)
+    {
+        __m128i x = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(b + byte)),
+                                     _mm_loadu_si128((const __m128i *)(a + byte)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+            break;
+    }
+#endif
+    for (; (uint64_t)byte * 8 + 63 <= hi; byte += 8)
+        if ((load_word(a + byte) & ~load_word(b + byte)) != 0)
+            break;
+
+    // Remaining bits (including the word that differed, if any)
+    for (blk = byte * 8; blk <= hi && blk >= byte * 8; blk++)
+        if (((a[blk / 8] & ~b[blk / 8]) >> (blk % 8)) & 0x1)
+            return blk;
+    return -1;
+}
+
+// Number of bits set in bitmap `a` for blocks lo..hi. The bulk is counted
+// 16 bytes at a time (SSE2: bit-slice sums, then a byte sum per half) or 8.
+static uint64_t bitmap_popcount(const uchar *a, uint lo, uint hi)
+{
+    uint64_t n = 0;
+    uint blk = lo;
+    uint byte;
+
+    // Leading bits up to a byte boundary
+    for (; blk <= hi && blk % 8 != 0; blk++)
+        n += (a[blk / 8] >> (blk % 8)) & 0x1;
+    if (blk > hi)
+        return n;
+    byte = blk / 8;
+#ifdef __SSE2__
+    {
+        const __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0F);
+        __m128i x, sum = _mm_setzero_si128();
+
+        for (; (uint64_t)byte * 8 + 127 <= hi; byte += 16)
+        {
+            x = _mm_loadu_si128((const __m128i *)(a + byte));
+            x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+            x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+            x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(x, _mm_setzero_si128()));
+        }
+        n += (uint64_t)_mm_cvtsi128_si64(sum) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+    }
+#endif
+    for (; (uint64_t)byte * 8 + 63 <= hi; byte += 8)
+        n += __builtin_popcountll(load_word(a + byte));
+
+    // Remaining bits
+    for (blk = byte * 8; blk <= hi && blk >= byte * 8; blk++)
+        n += (a[blk / 8] >> (blk % 8)) & 0x1;
+    return n;
+}
+
+// Slot numbers run up to FCHECK_SLOT_ENTRY(NINDIRECT - 1): 140 with 512-byte
+// blocks, 268 with 1 KB and 1036 with 4 KB ones. SLOT_BITS bits hold them.
+#if BSIZE <= 512
+#define SLOT_BITS 8
+typedef uchar slot_t;
+#elif BSIZE <= 1024
+#define SLOT_BITS 9
+typedef ushort slot_t;
+#elif BSIZE <= 4096
+#define SLOT_BITS 11
+typedef ushort slot_t;
+#else
+#error "slot numbers of blocks over 4 KB do not fit in SLOT_BITS"
+#endif
+
+// Reverse ownership map kept by the precise scan: for every block, the
+// inode that claimed it first and where (its slot). Inode numbers are 16 bits
+// like dirent inums, so the map costs 3 bytes per block (4 past 512-byte
+// blocks); an owner whose number does not fit is recorded as OWNER_UNKNOWN.
+struct owner_map
+{
+    ushort *inum;
+    slot_t *slot;  // FCHECK_SLOT_* numbering
+};
+
+#define OWNER_UNKNOWN 0xFFFF
+
+// Allocated inodes sorted during the inode scan, so the later passes visit
+// only the inodes they check instead of the whole table. Both lists share one
+// array of an entry per inode: directories fill it from the front, and the
+// rest (files, devices, inodes of an invalid type) from the back, each in
+// inode order once the scan is done.
+struct inode_lists
+{
+    uint *v;    // `size` entries (for a -j worker, its stretch of the array)
+    uint size;
+    uint ndirs; // directories: v[0 .. ndirs-1]
+    uint nrest; // the rest: v[size-nrest .. size-1]
+};
+
+#define LIST_REST(l) ((l)->v + (l)->size - (l)->nrest)
+
+// Reverse v[0 .. n-1]
+static void reverse_uints(uint *v, uint n)
+{
+    uint k, t;
+
+    for (k = 0; k < n / 2; k++)
+    {
+        t = v[k];
+        v[k] = v[n - 1 - k];
+        v[n - 1 - k] = t;
+    }
+}
+
+// Next allocated inode of any type after the ones already taken from the
+// lists (pos[0] directories, pos[1] the rest), or NONE when all are taken
+static uint next_allocated(const struct inode_lists *l, uint pos[2])
+{
+    const uint *rest = LIST_REST(l);
+
+    if (pos[0] < l->ndirs && (pos[1] >= l->nrest || l->v[pos[0]] < rest[pos[1]]))
+        return l->v[pos[0]++];
+    return pos[1] < l->nrest ? rest[pos[1]++] : NONE;
+}
+
+// --- External sort ---
+
+// 64-bit records sorted by their high 32 bits (the key) and otherwise kept
+// in the order they were added. They gather in a buffer of `cap` records;
+// each time it fills up it is radix-sorted and, given a spill store
+// (fcheck_opts.spill), appended to the spill file as a sorted run. Reading
+// back in order walks the sorted buffer if nothing was spilled, and
+// otherwise merges the runs, reading each through a slice of the buffers.
+struct run
+{
+    unsigned long long next, end; // records of the run not yet read (file positions)
+    uint64_t *buf;                // its slice of the buffers
+    size_t len, pos, room;
+};
+
+struct sorter
+{
+    const struct fcheck_opts *opts;
+    uint64_t *mem;               // one allocation: both buffers, counters, runs and heap
+    uint64_t *v, *tmp;           // the record buffer and the sort's second buffer
+    size_t *count;               // radix counters
+    size_t cap, n;
+    uint bits;                   // widest radix digit
+    void *file;                  // spill file (NULL: nothing spilled)
+    unsigned long long nspilled; // records in it
+    struct run *runs;
+    uint nruns, maxruns;
+    uint *heap;                  // runs being merged, by their next record
+    uint nheap;
+    const uint64_t *sorted;      // unspilled: the buffer, sorted (NULL: not yet)
+    size_t pos;
+    int failed;                  // the spill store failed, ran past maxruns or (without one) could not grow
+    struct fcheck_stats *st;     // spill_runs and spill_bytes
+};
+
+#define SORT_KEY(rec) ((rec) >> 32)
+
+// Widest digit of the radix sort, in bits: the fewer passes over the records
+// the better, as each one streams them all through memory twice
+#define RADIX_BITS 16
+
+// Sort `n` records by key, stably, with a least-significant-digit radix sort
+// over the key bits in use, in as few passes of at most `maxbits` as cover
+// them. `tmp` has room for n records and `count` for 1 << maxbits counters;
+// returns whichever of v and tmp holds the result.
+static uint64_t *sort_records(uint64_t *v, uint64_t *tmp, size_t n, size_t *count, uint maxbits)
+{
+    size_t sum, c, k;
+    uint64_t *t, top = 0;
+    uint bits, passes, digit, shift, mask, d;
+
+    // Split the key bits in use evenly over the passes
+    for (k = 0; k < n; k++)
+        top |= v[k];
+    top = SORT_KEY(top);
+    bits = top != 0 ? 64 - __builtin_clzll(top) : 0;
+    passes = (bits + maxbits - 1) / maxbits;
+    digit = passes != 0 ? (bits + passes - 1) / passes : 1;
+    mask = (1u << digit) - 1;
+    for (shift = 32; shift < 32 + bits; shift += digit)
+    {
+        memset(count, 0, (mask + 1) * sizeof(size_t));
+        for (k = 0; k < n; k++)
+            count[(v[k] >> shift) & mask]++;
+        for (sum = 0, d = 0; d <= mask; d++)
+        {
+            c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (k = 0; k < n; k++)
+            tmp[count[(v[k] >> shift) & mask]++] = v[k];
+        t = v;
+        v = tmp;
+        tmp = t;
+    }
+    return v;
+}
+
+// Give a sorter room for `cap` records at a time, keeping those it holds.
+// Returns -1 (leaving it as it was) if the memory cannot be allocated.
+static int sorter_resize(struct sorter *s, size_t cap)
+{
+    uint64_t *mem;
+    uint bits;
+
+    for (bits = 8; bits < RADIX_BITS && ((size_t)1 << bits) < cap; bits++)
+        ;
+    mem = lib_alloc(s->opts, cap * 2 * sizeof(uint64_t) + ((size_t)1 << bits) * sizeof(size_t) +
+                                 s->maxruns * (sizeof(struct run) + sizeof(uint)));
+    if (mem == NULL)
+        return -1;
+    if (s->n > 0)
+        memcpy(mem, s->v, s->n * sizeof(uint64_t));
+    lib_free(s->opts, s->mem);
+    s->mem = s->v = mem;
+    s->tmp = s->v + cap;
+    s->count = (size_t *)(s->tmp + cap);
+    s->runs = (struct run *)(s->count + ((size_t)1 << bits));
+    s->heap = (uint *)(s->runs + s->maxruns);
+    s->cap = cap;
+    s->bits = bits;
+    return 0;
+}
+
+// Set up a sorter for `total` records at most, `cap` at a time (spilling if
+// cap < total; without a spill store it grows instead). Returns -1 if its
+// memory cannot be allocated, or if cap is too small for the runs to be
+// merged in one pass.
+static int sorter_init(struct sorter *s, const struct fcheck_opts *opts, size_t cap, size_t total,
+                       struct fcheck_stats *st)
+{
+    memset(s, 0, sizeof(*s));
+    s->opts = opts;
+    s->st = st;
+    cap = cap > 0 ? cap : 1;
+    s->maxruns = total / cap + 1;
+    if (s->maxruns > cap * 2)
+        return -1;
+    return sorter_resize(s, cap);
+}
+
+static void sorter_free(struct sorter *s)
+{
+    if (s->file != NULL)
+        s->opts->spill->close(s->opts->spill->ctx, s->file);
+    lib_free(s->opts, s->mem);
+    s->mem = NULL;
+    s->file = NULL;
+}
+
+// Sort the buffer and write it out as a run (records are lost if that fails)
+static void sorter_spill(struct sorter *s)
+{
+    const struct fcheck_spill *sp = s->opts->spill;
+    const uint64_t *run = sort_records(s->v, s->tmp, s->n, s->count, s->bits);
+
+    if (s->file == NULL && !s->failed && (sp == NULL || (s->file = sp->open(sp->ctx)) == NULL))
+        s->failed = 1;
+    if (s->failed || s->nruns == s->maxruns || sp->write(sp->ctx, s->file, run, s->n * sizeof(uint64_t)) < 0)
+        s->failed = 1;
+    else
+    {
+        s->runs[s->nruns].next = s->nspilled;
+        s->runs[s->nruns].end = s->nspilled + s->n;
+        s->nruns++;
+        s->nspilled += s->n;
+        s->st->spill_runs++;
+        s->st->spill_bytes += s->n * sizeof(uint64_t);
+    }
+    s->n = 0;
+}
+
+// Add a record (if there is room for it: one that cannot be spilled or
+// grown into is lost, and the sorter marked failed)
+static inline void sorter_add(struct sorter *s, uint64_t rec)
+{
+    if (s->n == s->cap && s->opts->spill == NULL && sorter_resize(s, s->cap * 2) < 0)
+        s->failed = 1;
+    if (s->n == s->cap)
+        sorter_spill(s);
+    s->v[s->n++] = rec;
+}
+
+// Read the next slice of run `r` into its buffer. Returns -1 if that fails.
+static int run_fill(struct sorter *s, struct run *r)
+{
+    const struct fcheck_spill *sp = s->opts->spill;
+
+    r->len = r->end - r->next < r->room ? r->end - r->next : r->room;
+    r->pos = 0;
+    if (sp->read(sp->ctx, s->file, r->next * sizeof(uint64_t), r->buf, r->len * sizeof(uint64_t)) < 0)
+        return -1;
+    r->next += r->len;
+    return 0;
+}
+
+// Does run a's next record come before run b's? (Ties go to the earlier run.)
+static inline int run_before(const struct sorter *s, uint a, uint b)
+{
+    uint64_t ka = SORT_KEY(s->runs[a].buf[s->runs[a].pos]), kb = SORT_KEY(s->runs[b].buf[s->runs[b].pos]);
+    return ka < kb || (ka == kb && a < b);
+}
+
+// Restore the heap order below heap[k]
+static void heap_down(struct sorter *s, uint k)
+{
+    uint c, t;
+
+    for (; (c = 2 * k + 1) < s->nheap; k = c)
+    {
+        if (c + 1 < s->nheap && run_before(s, s->heap[c + 1], s->heap[c]))
+            c++;
+        if (!run_before(s, s->heap[c], s->heap[k]))
+            break;
+        t = s->heap[k];
+        s->heap[k] = s->heap[c];
+        s->heap[c] = t;
+    }
+}
+
+// Start reading the records in order (again). No records may be added after.
+// Returns -1 if the spill store failed.
+static int sorter_rewind(struct sorter *s)
+{
+    size_t slice;
+    uint r;
+
+    if (s->file == NULL && !s->failed)
+    {
+        if (s->sorted == NULL)
+            s->sorted = sort_records(s->v, s->tmp, s->n, s->count, s->bits);
+        s->pos = 0;
+        return 0;
+    }
+
+    // Spilled: the rest becomes the last run, then each run gets an even
+    // share of both buffers to be read through
+    if (s->n > 0)
+        sorter_spill(s);
+    if (s->failed)
+        return -1;
+    slice = s->cap * 2 / s->nruns;
+    s->nheap = 0;
+    for (r = 0; r < s->nruns; r++)
+    {
+        s->runs[r].next = r > 0 ? s->runs[r - 1].end : 0;
+        s->runs[r].buf = s->v + r * slice;
+        s->runs[r].room = slice;
+        if (run_fill(s, &s->runs[r]) < 0)
+        {
+            s->failed = 1;
+            return -1;
+        }
+        s->heap[s->nheap++] = r;
+    }
+    for (r = s->nheap / 2; r-- > 0;)
+        heap_down(s, r);
+    return 0;
+}
+
+// Take the next record in order into *rec. Returns 0 at the end (or if the
+// spill store failed), 1 otherwise.
+static int sorter_next(struct sorter *s, uint64_t *rec)
+{
+    struct run *r;
+
+    if (s->file == NULL && !s->failed)
+    {
+        if (s->pos == s->n)
+            return 0;
+        *rec = s->sorted[s->pos++];
+        return 1;
+    }
+    if (s->nheap == 0 || s->failed)
+        return 0;
+    r = &s->runs[s->heap[0]];
+    *rec = r->buf[r->pos++];
+    if (r->pos == r->len)
+    {
+        if (r->next < r->end && run_fill(s, r) < 0)
+        {
+            s->failed = 1;
+            return 0;
+        }
+        if (r->pos == r->len)
+            s->heap[0] = s->heap[--s->nheap];
+    }
+    heap_down(s, 0);
+    return 1;
+}
+
+// Block addresses collected by the inode scan for the sort engine, one
+// (block, inode, slot) record each: the block is the key, then the inode
+// (INUM_BITS: 24 with 512-byte blocks) and the FCHECK_SLOT_* it holds the
+// block in (SLOT_BITS)
+#define INUM_BITS (32 - SLOT_BITS)
+#define INUM_MASK ((1u << INUM_BITS) - 1)
+#define SLOT_MASK ((1u << SLOT_BITS) - 1)
+#define TUPLE(blk, inum, slot) (((uint64_t)(blk) << 32) | (((uint64_t)(inum) & INUM_MASK) << SLOT_BITS) | (slot))
+#define TUPLE_BLOCK(t) ((uint)SORT_KEY(t))
+#define TUPLE_SLOT(t) ((uint)((t) & SLOT_MASK))
+
+// A block's second and later tuples, as (inode, slot) keys in scan order
+// with the (inode, slot) of its first tuple, the owner, alongside
+#define DUP(t, owner) (((t) << 32) | ((owner) & 0xFFFFFFFF))
+#define DUP_KEY(inum, slot) ((((uint64_t)(inum) & INUM_MASK) << SLOT_BITS) | (slot))
+#define DUP_OWNER(d) ((uint)((d) >> SLOT_BITS) & INUM_MASK)
+#define DUP_OWNER_SLOT(d) ((uint)((d) & SLOT_MASK))
+
+// The sort engine's state: the scan's tuples and the blocks found held
+// twice, which the serial replay reads back in scan order; and the tuples
+// the replay finds were never claimed (see skip_entries())
+struct sort_engine
+{
+    struct sorter tuples;
+    struct sorter dups;
+    struct sorter skipped;
+    uint64_t dup;  // replay: the next block held twice (if have_dup)
+    int have_dup;
+    uint window;   // blocks the merge lays out at a time
+};
+
+// Replay: is the block at `slot` of inode `inum` held already? The replay
+// asks in scan order, so the blocks held twice are read through once.
+static int dup_at(struct sort_engine *se, uint inum, uint slot)
+{
+    while (se->have_dup && SORT_KEY(se->dup) < DUP_KEY(inum, slot))
+        se->have_dup = sorter_next(&se->dups, &se->dup);
+    return se->have_dup && SORT_KEY(se->dup) == DUP_KEY(inum, slot);
+}
+
+// Replay: inode `inum` holds indirect block `blk` second, so (as with the
+// bitmap engine) it does not claim the block's entries; but the fast path
+// collected them as tuples. Note them in se->skipped, so that they do not
+// count as held for Rule 6.
+static void skip_entries(struct fsimage *fs, struct sort_engine *se, uint inum, uint blk, struct fcheck_stats *st)
+{
+    const uint *indir;
+    union block buf;
+    uint j;
+
+    indir = read_block(fs, blk, &buf);
+    st->blocks_read++;
+    for (j = 0; j < NINDIRECT; j++)
+        if (indir[j] != 0 && valid_data_block(fs, indir[j]))
+            sorter_add(&se->skipped, TUPLE(indir[j], inum, FCHECK_SLOT_ENTRY(j)));
+}
+
+// Check Rules 1, 2, 7 and 8 for inodes [lo, hi), recording every block owned
+// by those inodes in `used` and appending every allocated inode to `lists`.
+// Blocks already set in `used` count as owned by an earlier inode. The work
+// done is added to `st`.
+//
+// For the sort engine, `used` is NULL. On the fast path every block in range
+// is added to se->tuples instead, and nothing is seen twice here: the merge
+// of the sorted tuples finds blocks used twice (and Rules 5, 6) afterwards,
+// so the scan goes on past violations and returns the first. A replay then
+// takes the blocks held twice, and their owners, from se->dups.
+//
+// With `rep` NULL (the fast path) the scan stops at the first violation and
+// returns its error code; Rule 5 is left to the caller, which compares `used`
+// with the on-disk bitmap afterwards. With a report, Rule 5 is also checked per
+// block and every violation is handed to report_owned() in inode order; if
+// `owners` is given, a block used twice is reported with its first owner.
+static int scan_inodes(struct fsimage *fs, uint lo, uint hi, uint64_t *used, struct sort_engine *se,
+                       struct inode_lists *lists, struct fcheck_stats *st, struct report *rep,
+                       struct owner_map *owners)
+{
+    const struct dinode *dip;
+    uint i, j, blk;
+    const uint *indir;
+    union block buf;
+    int first = FCHECK_OK;
+
+// Handle a violation at `slot`: return it on the fast path (or for the sort
+// engine, which needs every tuple, note it and go on), report it otherwise
+// (either way, only for a rule being checked)
+#define SCAN_ERROR(code, blkno, slotno)                                 \
+    do                                                                  \
+    {                                                                   \
+        if (!RULE_ON(fs, (code)))                                       \
+            break;                                                      \
+        if (rep == NULL && se == NULL)                                  \
+            return (code);                                              \
+        if (rep == NULL)                                                \
+        {                                                               \
+            first = first != FCHECK_OK ? first : (code);                \
+            break;                                                      \
+        }                                                               \
+        report_owned(rep, (code), i, (blkno), (slotno), NONE, NONE);    \
+        if (STOPPED(rep))                                               \
+            return (code);                                              \
+    } while (0)
+
+// Handle a block used twice, naming the inode that claimed it first
+#define SCAN_TWICE(code, blkno, slotno)                                                     \
+    do                                                                                      \
+    {                                                                                       \
+        if (!RULE_ON(fs, (code)))                                                           \
+            break;                                                                          \
+        if (rep == NULL)                                                                    \
+            return (code);                                                                  \
+        if (owners != NULL && owners->inum[(blkno)] != OWNER_UNKNOWN)                       \
+            report_owned(rep, (code), i, (blkno), (slotno), owners->inum[(blkno)], owners->slot[(blkno)]); \
+        else if (se != NULL && DUP_OWNER(se->dup) < OWNER_UNKNOWN)                          \
+            report_owned(rep, (code), i, (blkno), (slotno), DUP_OWNER(se->dup), DUP_OWNER_SLOT(se->dup)); \
+        else                                                                                \
+            report_owned(rep, (code), i, (blkno), (slotno), NONE, NONE);                    \
+        if (STOPPED(rep))                                                                   \
+            return (code);                                                                  \
+    } while (0)
+
+// Mark a block used, remembering its owner when keeping the map. Without
+// PLAN_OWNERS nothing is claimed, so no block is ever seen twice.
+#define SCAN_CLAIM(blkno, slotno)                                              \
+    do                                                                         \
+    {                                                                          \
+        if (!(fs->plan & PLAN_OWNERS))                                         \
+            break;                                                             \
+        if (se != NULL)                                                        \
+        {                                                                      \
+            if (rep == NULL)                                                   \
+                sorter_add(&se->tuples, TUPLE((blkno), i, (slotno)));          \
+            break;                                                             \
+        }                                                                      \
+        bitset_set(used, (blkno));                                             \
+        if (owners != NULL)                                                    \
+        {                                                                      \
+            owners->inum[(blkno)] = i < OWNER_UNKNOWN ? i : OWNER_UNKNOWN;     \
+            owners->slot[(blkno)] = (slotno);                                  \
+        }                                                                      \
+    } while (0)
+
+// Is the block owned already? (The sort engine only knows in a replay.)
+#define SCAN_TAKEN(blkno, slotno) \
+    (used != NULL ? bitset_test(used, (blkno)) : se != NULL && rep != NULL && dup_at(se, i, (slotno)))
+
+    for (i = lo; i < hi; i++)
+    {
+        // A hole in the inode table holds only free inodes
+        if (inodes_in_hole(fs, i, hi))
+        {
+            st->inodes_free += IPB;
+            i += IPB - 1;
+            continue;
+        }
+
+        // Prefetch the indirect block of the inode `ahead` places on, so it
+        // has arrived by the time the scan gets there
+        if (fs->ahead != 0 && i + fs->ahead < hi && (fs->plan & PLAN_ADDRS) && fs->itable[i + fs->ahead].type != 0)
+            prefetch_block(fs, fs->itable[i + fs->ahead].addrs[NDIRECT]);
+
+        dip = &fs->itable[i]; // current inode
+        if (dip->type == T_DIR)
+            lists->v[lists->ndirs++] = i;
+        else if (dip->type != 0)
+            lists->v[lists->size - ++lists->nrest] = i;
+        if (dip->type == 0)
+            st->inodes_free++;
+        else if (dip->type == T_DIR)
+            st->inodes_dir++;
+        else if (dip->type == T_FILE)
+            st->inodes_file++;
+        else if (dip->type == T_DEV)
+            st->inodes_dev++;
+        else
+            st->inodes_bad++;
+
+        // RULE 1: Each inode is either unallocated or valid type
+        if (dip->type != 0 && dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEV)
+        {
+            SCAN_ERROR(FCHECK_BAD_INODE, NONE, NONE);
+            continue; // its addresses mean nothing
+        }
+
+        // skip unallocated inodes, and every inode's addresses if no selected rule needs them
+        if (dip->type == 0 || !(fs->plan & PLAN_ADDRS))
+            continue;
+
+        // read direct addresses
+        for (j = 0; j < NDIRECT; j++)
+        {
+            blk = dip->addrs[j];
+            if (blk != 0)
+            {
+                st->direct_addrs++;
+
+                // RULE 2a: If in use, direct block address is within valid range
+                if (!valid_data_block(fs, blk))
+                {
+                    SCAN_ERROR(FCHECK_BAD_DIRECT, blk, j);
+                    continue;
+                }
+
+                // RULE 5a: Direct address is marked in use in bitmap
+                if (rep != NULL && get_bitmap_bit(fs->meta, fs->sb, blk) == 0)
+                    SCAN_ERROR(FCHECK_BITMAP_FREE, blk, j);
+
+                // RULE 7: Direct address doesn't point to a block already in use
+                if (SCAN_TAKEN(blk, j))
+                    SCAN_TWICE(FCHECK_DIRECT_TWICE, blk, j);
+                else
+                    SCAN_CLAIM(blk, j); // mark block as used for future checks
+            }
+        }
+
+        // read indirect addresses
+        blk = dip->addrs[NDIRECT];
+        if (blk != 0)
+        { // skip if not used
+            // RULE 2b: If in use, indirect block address is within valid range
+            if (!valid_data_block(fs, blk))
+            {
+                SCAN_ERROR(FCHECK_BAD_INDIRECT, blk, FCHECK_SLOT_INDIRECT);
+                continue;
+            }
+
+            // RULE 5b: Indirect address is marked in use in bitmap
+            if (rep != NULL && get_bitmap_bit(fs->meta, fs->sb, blk) == 0)
+                SCAN_ERROR(FCHECK_BITMAP_FREE, blk, FCHECK_SLOT_INDIRECT);
+
+            // RULE 8a: Indirect block doesn't point to a block already in use
+            if (SCAN_TAKEN(blk, FCHECK_SLOT_INDIRECT))
+            {
+                SCAN_TWICE(FCHECK_INDIRECT_TWICE, blk, FCHECK_SLOT_INDIRECT);
+                if (se != NULL)
+                    skip_entries(fs, se, i, blk, st);
+                continue; // its entries were already claimed by the first owner
+            }
+            SCAN_CLAIM(blk, FCHECK_SLOT_INDIRECT); // mark indirect block as used
+
+            // read indirect block (array of direct addresses)
+            indir = read_block(fs, blk, &buf);
+            st->indirect_blocks++;
+            st->blocks_read++;
+            for (j = 0; j < NINDIRECT; j++)
+            {
+                blk = indir[j];
+
+                if (blk != 0)
+                {
+                    st->indirect_addrs++;
+
+                    // RULE 2c: If in use, direct address in indirect block is within valid range
+                    if (!valid_data_block(fs, blk))
+                    {
+                        SCAN_ERROR(FCHECK_BAD_INDIRECT, blk, FCHECK_SLOT_ENTRY(j));
+                        continue;
+                    }
+
+                    // RULE 5c: Direct address in indirect block is marked in use in bitmap
+                    if (rep != NULL && get_bitmap_bit(fs->meta, fs->sb, blk) == 0)
+                        SCAN_ERROR(FCHECK_BITMAP_FREE, blk, FCHECK_SLOT_ENTRY(j));
+
+                    // RULE 8b: Direct address in indirect block doesn't point to a block already in use
+                    if (SCAN_TAKEN(blk, FCHECK_SLOT_ENTRY(j)))
+                        SCAN_TWICE(FCHECK_INDIRECT_TWICE, blk, FCHECK_SLOT_ENTRY(j));
+                    else
+                        SCAN_CLAIM(blk, FCHECK_SLOT_ENTRY(j));
+                }
+            }
+        }
+    }
+#undef SCAN_ERROR
+#undef SCAN_TWICE
+#undef SCAN_CLAIM
+#undef SCAN_TAKEN
+
+    // The rest went in from the back, last inode first
+    reverse_uints(LIST_REST(lists), lists->nrest);
+    return first;
+}
+
+// Work assigned to one -j worker thread
+struct scan_job
+{
+    struct fsimage *fs;
+    uint lo, hi;              // inode range [lo, hi)
+    uint64_t *used;           // private ownership bitset for this range
+    struct inode_lists lists; // this range's inodes, in its stretch [lo, hi) of the shared array
+    struct fcheck_stats st;   // work done on this range
+    int err;                  // first error found in this range
+};
+
+static void *scan_worker(void *arg)
+{
+    struct scan_job *job = arg;
+    job->err = scan_inodes(job->fs, job->lo, job->hi, job->used, NULL, &job->lists, &job->st, NULL, NULL);
+    return NULL;
+}
+
+// Run the inode scan (without the per-block Rule 5 check) over `nthreads`
+// chunks of the inode table. Each worker fills a private bitset and its own
+// stretch of the inode lists' array; the chunks are then merged in inode
+// order into `used` and `lists`. Returns FCHECK_OK if every chunk was
+// clean and no block is shared between chunks; otherwise returns an error code
+// and the caller replays the scan serially to find the exact first error.
+// Returns -1 if the scratch memory for the workers cannot be allocated.
+static int scan_inodes_parallel(struct fsimage *fs, const struct fcheck_opts *opts, uint64_t *used,
+                                struct inode_lists *lists, struct fcheck_stats *st, int nthreads)
+{
+    uint nwords = used != NULL ? BITSET_WORDS(fs->sb->size) : 0; // no bitsets if no rule tracks owners
+    uint chunk = (fs->sb->ninodes + nthreads - 1) / nthreads;
+    struct scan_job *jobs;
+    pthread_t *tids;
+    uint64_t *bits;
+    char *started;
+    int t, err = FCHECK_OK;
+    uint w, d, *rest;
+
+    // One allocation: the jobs, thread ids, started flags and bitsets
+    jobs = lib_calloc(opts, nthreads * (sizeof(struct scan_job) + sizeof(pthread_t) + 1 + nwords * sizeof(uint64_t)) + sizeof(uint64_t));
+    if (jobs == NULL)
+        return -1;
+    bits = (uint64_t *)(jobs + nthreads);
+    tids = (pthread_t *)(bits + (size_t)nthreads * nwords);
+    started = (char *)(tids + nthreads);
+
+    for (t = 0; t < nthreads; t++)
+    {
+        jobs[t].fs = fs;
+        jobs[t].lo = t * chunk;
+        jobs[t].hi = (t + 1) * chunk < fs->sb->ninodes ? (t + 1) * chunk : fs->sb->ninodes;
+        jobs[t].used = used != NULL ? bits + (size_t)t * nwords : NULL;
+        jobs[t].lists.v = lists->v + jobs[t].lo;
+        jobs[t].lists.size = jobs[t].hi > jobs[t].lo ? jobs[t].hi - jobs[t].lo : 0;
+        // A chunk whose thread cannot be started is scanned here instead
+        started[t] = pthread_create(&tids[t], NULL, scan_worker, &jobs[t]) == 0;
+        if (!started[t])
+            scan_worker(&jobs[t]);
+    }
+    for (t = 0; t < nthreads; t++)
+        if (started[t])
+            pthread_join(tids[t], NULL);
+
+    for (t = 0; t < nthreads; t++)
+        add_stats(st, &jobs[t].st);
+
+    // Gather the chunks' lists, a stretch at a time: before stretch t comes
+    // [directories | gap | rest] of the chunks so far. Its directories go
+    // into the gap (or, if the rest so far is in the way, first swap places
+    // with it), and the rest so far moves up against its rest.
+    lists->ndirs = lists->nrest = 0;
+    for (t = 0; t < nthreads && jobs[t].lists.size > 0; t++)
+    {
+        d = jobs[t].lists.ndirs;
+        rest = lists->v + jobs[t].lo - lists->nrest;
+        if (jobs[t].lo - lists->nrest - lists->ndirs < d && lists->nrest > 0)
+        {
+            // [rest so far | its directories] becomes [its directories | rest so far]
+            reverse_uints(rest, lists->nrest);
+            reverse_uints(rest + lists->nrest, d);
+            reverse_uints(rest, lists->nrest + d);
+            memmove(lists->v + lists->ndirs, rest, d * sizeof(uint));
+            rest += d;
+        }
+        else
+            memmove(lists->v + lists->ndirs, jobs[t].lists.v, d * sizeof(uint));
+        memmove(LIST_REST(&jobs[t].lists) - lists->nrest, rest, lists->nrest * sizeof(uint));
+        lists->ndirs += d;
+        lists->nrest += jobs[t].lists.nrest;
+    }
+
+    // Merge chunks in order; `used` holds the blocks of all earlier chunks
+    for (t = 0; t < nthreads && err == FCHECK_OK; t++)
+    {
+        int overlap = 0;
+        for (w = 0; w < nwords && !overlap; w++)
+            overlap = (used[w] & jobs[t].used[w]) != 0;
+
+        if (jobs[t].err != FCHECK_OK)
+            err = jobs[t].err;
+        else if (overlap)
+            err = FCHECK_DIRECT_TWICE; // the serial replay decides direct vs indirect
+        else
+            for (w = 0; w < nwords; w++)
+                used[w] |= jobs[t].used[w];
+    }
+    lib_free(opts, jobs);
+    return err;
+}
+
+// --- Sort engine ---
+
+// On a large image the bitset's random writes miss the cache and TLB on
+// nearly every block. The sort engine instead collects the scan's block
+// addresses as tuples, radix-sorts them by block and walks them in step with
+// the on-disk bitmap, so all of its memory traffic is sequential. The auto
+// choice takes it once the bitset is past SORT_MIN_BITSET bytes (far beyond
+// the last-level cache, where the sort came out ahead on a sparsely used
+// image) and the tuples, with the sort's second buffer, would take less
+// memory than the bitset; or when the bitset does not fit under the memory
+// limit at all, as the tuples can be spilled.
+#define SORT_MIN_BITSET (128u << 20)
+
+// Most blocks the merge lays out as a bitset at a time (64 KB of it; less
+// for an image with fewer blocks)
+#define MERGE_WINDOW (1u << 19)
+
+// Blocks held twice gathered at a time before they are spilled (there are
+// rarely more)
+#define DUPS_CAP 4096
+
+// Fewest tuples worth sorting at a time under a memory limit
+#define MIN_SORT_CAP 64
+
+// Most tuples the inode scan can collect: every nonzero address of an
+// allocated inode and, behind an indirect address, a full indirect block
+static size_t tuple_bound(struct fsimage *fs)
+{
+    const struct dinode *dip;
+    size_t n = 0;
+    uint i, j;
+
+    for (i = 0; i < fs->sb->ninodes; i++)
+    {
+        if (inodes_in_hole(fs, i, fs->sb->ninodes))
+        {
+            i += IPB - 1;
+            continue;
+        }
+        dip = &fs->itable[i];
+        if (dip->type == 0)
+            continue;
+        for (j = 0; j < NDIRECT; j++)
+            n += dip->addrs[j] != 0;
+        if (dip->addrs[NDIRECT] != 0)
+            n += 1 + NINDIRECT;
+    }
+    return n;
+}
+
+// Should the scan use the sort engine, given `need` bytes of scratch memory
+// for the bitset engine? Sets *bound to tuple_bound() if so.
+static int use_sort_engine(struct fsimage *fs, const struct fcheck_opts *opts, size_t need, size_t *bound)
+{
+    size_t bitset_bytes = BITSET_WORDS(fs->sb->size) * sizeof(uint64_t);
+
+    // (A tuple has room for INUM_BITS-bit inode numbers)
+    if (!(fs->plan & PLAN_OWNERS) || opts->engine == FCHECK_ENGINE_BITMAP || fs->sb->ninodes > INUM_MASK)
+        return 0;
+    if (opts->engine != FCHECK_ENGINE_SORT && bitset_bytes < SORT_MIN_BITSET && need <= lib_available(opts))
+        return 0;
+    *bound = tuple_bound(fs);
+    return opts->engine == FCHECK_ENGINE_SORT || need > lib_available(opts) ||
+           *bound * 2 * sizeof(uint64_t) < bitset_bytes;
+}
+
+// Walk the sorted tuples and the on-disk bitmap together, in block order,
+// se->window blocks at a time: the tuples of a window are laid out as a
+// bitset in `win` (cache-sized, so the writes stay cheap), which is then
+// compared with the bitmap like the bitmap engine's bitset. Finds a block
+// held twice (Rules 7, 8), a block held but marked free (Rule 5) and a data
+// block marked in use that nothing holds (Rule 6). Every block held twice
+// goes to se->dups. Returns the code of the first violation of a rule being
+// checked, or FCHECK_OK.
+static int merge_tuples(struct fsimage *fs, struct sort_engine *se, uint64_t *win)
+{
+    uint64_t base, end, t, prev = 0, owner = 0;
+    uint blk, lo, hi;
+    int err = FCHECK_OK, code, have, held;
+
+    have = sorter_next(&se->tuples, &t);
+    for (base = 0; base <= fs->max_db; base += se->window)
+    {
+        end = base + se->window - 1 < fs->max_db ? base + se->window - 1 : fs->max_db;
+        held = have && TUPLE_BLOCK(t) <= end;
+        if (held && err == FCHECK_OK)
+            memset(win, 0, se->window / 8);
+        for (; have && (blk = TUPLE_BLOCK(t)) <= end; prev = t, have = sorter_next(&se->tuples, &t))
+        {
+            // RULES 7, 8: a block's second tuple (the scan kept blocks in range)
+            if (prev != 0 && blk == TUPLE_BLOCK(prev))
+            {
+                sorter_add(&se->dups, DUP(t, owner));
+                code = TUPLE_SLOT(t) < NDIRECT ? FCHECK_DIRECT_TWICE : FCHECK_INDIRECT_TWICE;
+                if (err == FCHECK_OK && RULE_ON(fs, code))
+                    err = code;
+                continue;
+            }
+            owner = t;
+            if (err == FCHECK_OK)
+                bitset_set(win, blk - base);
+        }
+        if (err != FCHECK_OK)
+            continue; // only gathering the blocks held twice now
+
+        // RULE 5: every block held in the window is marked in use
+        if (held && RULE_ON(fs, FCHECK_BITMAP_FREE) &&
+            bitmap_andnot_first((uchar *)win, fs->bitmap + base / 8, 0, end - base) >= 0)
+            err = FCHECK_BITMAP_FREE;
+
+        // RULE 6: every data block marked in use in the window is held
+        if (err != FCHECK_OK || end < fs->min_db || !RULE_ON(fs, FCHECK_BITMAP_USED))
+            continue;
+        lo = base > fs->min_db ? 0 : fs->min_db - base;
+        hi = end - base;
+        if (held ? bitmap_andnot_first(fs->bitmap + base / 8, (uchar *)win, lo, hi) >= 0
+                 : bitmap_popcount(fs->bitmap + base / 8, lo, hi) != 0)
+            err = FCHECK_BITMAP_USED;
+    }
+    return err;
+}
+
+// The inode scan and the Rule 5, 6 compares by the sort engine, for at most
+// `bound` tuples, sorted in memory if they fit under the memory limit and
+// spilled in runs otherwise. Returns FCHECK_OK if Rules 1, 2 and 5-8 all
+// hold, or an error code for the caller's serial replay to pin down (as for
+// scan_inodes_parallel()); -1 if there is not enough memory. The caller
+// frees `se` either way.
+static int scan_sorted(struct fsimage *fs, const struct fcheck_opts *opts, struct inode_lists *lists,
+                       struct fcheck_stats *st, size_t bound, struct sort_engine *se)
+{
+    size_t dups_cap = bound < DUPS_CAP ? bound : DUPS_CAP;
+    size_t avail, fixed, per, cap = bound;
+    uint64_t *win;
+    int err, code;
+
+    memset(se, 0, sizeof(*se));
+    se->window = fs->max_db < MERGE_WINDOW ? (fs->max_db + 64) & ~63u : MERGE_WINDOW;
+    if (sorter_init(&se->dups, opts, dups_cap, bound, st) < 0)
+        return -1;
+    win = lib_alloc(opts, se->window / 8);
+    if (win == NULL)
+        return -1;
+
+    // As many tuples at a time as fit (with the sort's second buffer, its
+    // counters and the runs); fewer than all only if they can be spilled.
+    // The counters take one entry per tuple below the largest radix digit.
+    avail = lib_available(opts);
+    per = 2 * sizeof(uint64_t) + sizeof(struct run) + sizeof(uint);
+    fixed = ((size_t)1 << RADIX_BITS) * sizeof(size_t) + BUDGET_HEADER;
+    if (avail != SIZE_MAX)
+        cap = avail < fixed ? 0 : (avail - fixed) / per;
+    if (avail != SIZE_MAX && cap < ((size_t)1 << RADIX_BITS))
+    {
+        fixed = ((size_t)1 << 8) * sizeof(size_t) + BUDGET_HEADER;
+        cap = avail < fixed ? 0 : (avail - fixed) / (per + 2 * sizeof(size_t));
+    }
+    if (cap > bound)
+        cap = bound;
+    if (cap < bound && (opts->spill == NULL || cap < MIN_SORT_CAP))
+        err = -1;
+    else if (sorter_init(&se->tuples, opts, cap, bound, st) < 0)
+        err = -1;
+    else
+    {
+        // (The merge runs even after a violation, for the blocks held twice)
+        err = scan_inodes(fs, 0, fs->sb->ninodes, NULL, se, lists, st, NULL, NULL);
+        if (sorter_rewind(&se->tuples) == 0)
+        {
+            PHASE(opts, FCHECK_PHASE_BITMAP);
+            code = merge_tuples(fs, se, win);
+            err = err != FCHECK_OK ? err : code;
+        }
+    }
+    lib_free(opts, win);
+    return err;
+}
+
+// RULE 6 for the sort engine's replay: report every data block marked in
+// use that no tuple holds, in block order. A block's skipped tuples are
+// among its tuples, so it is held if it has more of those.
+static void report_unheld(struct fsimage *fs, const struct fcheck_opts *opts, struct sort_engine *se,
+                          struct report *rep)
+{
+    uint64_t base, end, t, skip = 0;
+    uint64_t *win;
+    long bad;
+    int have, have_skip;
+
+    win = lib_alloc(opts, se->window / 8);
+    if (win == NULL || sorter_rewind(&se->tuples) < 0 || sorter_rewind(&se->skipped) < 0)
+    {
+        rep->nomem = win == NULL;
+        lib_free(opts, win);
+        return;
+    }
+    have = sorter_next(&se->tuples, &t);
+    have_skip = sorter_next(&se->skipped, &skip);
+    for (base = 0; base <= fs->max_db && !STOPPED(rep); base += se->window)
+    {
+        end = base + se->window - 1 < fs->max_db ? base + se->window - 1 : fs->max_db;
+        memset(win, 0, se->window / 8);
+        for (; have && TUPLE_BLOCK(t) <= end; have = sorter_next(&se->tuples, &t))
+        {
+            if (have_skip && TUPLE_BLOCK(skip) == TUPLE_BLOCK(t))
+                have_skip = sorter_next(&se->skipped, &skip);
+            else
+                bitset_set(win, TUPLE_BLOCK(t) - base);
+        }
+        if (end < fs->min_db)
+            continue;
+        bad = base > fs->min_db ? 0 : fs->min_db - base;
+        while (!STOPPED(rep) && (uint64_t)bad <= end - base &&
+               (bad = bitmap_andnot_first(fs->bitmap + base / 8, (uchar *)win, bad, end - base)) >= 0)
+            report_error(rep, FCHECK_BITMAP_USED, NONE, base + bad++);
+    }
+    lib_free(opts, win);
+}
+
+// Bookkeeping filled by the directory sweep. Every rule that depends on
+// directory contents (Rules 3, 4, 9-12) is then checked from these arrays.
+// Inode numbers in directory entries are 16 bits, so the per-inode state is
+// two 16-bit arrays plus six bit flags, under 5 bytes per inode, laid out
+// in one block by dirinfo_layout().
+struct dirinfo
+{
+    // referenced: inode appears in some directory entry
+    uint64_t *referenced;
+    // dir_once, dir_twice: inode is listed by a parent directory (excluding
+    // "." and "..") at least once, and more than once
+    uint64_t *dir_once;
+    uint64_t *dir_twice;
+    // refcount: number of directory entries pointing to each inode that is
+    // not a directory (excluding "."), saturating at 0xFFFF (more than any
+    // short nlink). Only files' counts are checked (Rule 11).
+    ushort *refcount;
+    // parent: parent directory of each directory inode, if has_parent. A
+    // parent numbered above 0xFFFF is kept as its low 16 bits and parent_far.
+    // It is the same array as refcount, whose slots of directories are unused.
+    ushort *parent;
+    uint64_t *has_parent;
+    uint64_t *parent_far;
+    // dotdot: ".." of each directory inode, if has_dotdot; missing if the first
+    // block has no "." or ".." or its "." does not point to the directory
+    ushort *dotdot;
+    uint64_t *has_dotdot;
+    // root_dotdot: ".." of the root directory as Rule 3 sees it (-1 if missing)
+    int root_dotdot;
+    // conflicts: directories found under two different parents (Rule 12)
+    struct report conflicts;
+};
+
+#define DIRINFO_FLAGS 6  // bitsets in struct dirinfo
+#define DIRINFO_SHORTS 2 // 16-bit arrays in struct dirinfo
+
+// Bytes of zeroed memory dirinfo_layout() needs for `ninodes` inodes
+static size_t dirinfo_bytes(uint ninodes)
+{
+    return (size_t)BITSET_WORDS(ninodes) * sizeof(uint64_t) * DIRINFO_FLAGS + (size_t)ninodes * sizeof(ushort) * DIRINFO_SHORTS;
+}
+
+// Point the per-inode arrays of `di` into `mem` (8-byte aligned, zeroed)
+static void dirinfo_layout(struct dirinfo *di, char *mem, uint ninodes)
+{
+    size_t words = BITSET_WORDS(ninodes);
+
+    di->referenced = (uint64_t *)mem;
+    di->dir_once = di->referenced + words;
+    di->dir_twice = di->dir_once + words;
+    di->has_parent = di->dir_twice + words;
+    di->parent_far = di->has_parent + words;
+    di->has_dotdot = di->parent_far + words;
+    di->refcount = (ushort *)(di->has_dotdot + words);
+    di->parent = di->refcount;
+    di->dotdot = di->parent + ninodes;
+}
+
+// Is `d` the recorded parent of directory `inum`?
+static inline int is_parent(const struct dirinfo *di, uint inum, uint d)
+{
+    return di->parent[inum] == (ushort)d && bitset_test(di->parent_far, inum) == (d > 0xFFFF);
+}
+
+// Directory entries per block, and 64-bit mask words to cover them
+#define DPB (BLOCK_SIZE / sizeof(struct dirent))
+#define DIRMASK_WORDS ((DPB + 63) / 64)
+
+// One directory block's entries sorted into kinds, bit k for entry k. A name
+// is "." or ".." as strcmp() sees it: the bytes up to the first NUL.
+struct dirmask
+{
+    uint64_t used[DIRMASK_WORDS];   // inum != 0
+    uint64_t dot[DIRMASK_WORDS];    // name is "."
+    uint64_t dotdot[DIRMASK_WORDS]; // name is ".."
+};
+
+// Classify every entry of a directory block in one pass. Each 16-byte dirent
+// is compared whole against the patterns {0, 0, '.', 0} and {0, 0, '.', '.', 0},
+// so its inum, "." and ".." tests are three bit tests on two compare masks.
+static void classify_dirents(const struct dirent *de, struct dirmask *m)
+{
+    uint k, eq1, eq2;
+    uint64_t bit;
+
+    memset(m, 0, sizeof(*m));
+    for (k = 0; k < DPB; k++)
+    {
+#if defined(__SSE2__) && DIRSIZ == 14
+        __m128i x = _mm_loadu_si128((const __m128i *)&de[k]);
+        eq1 = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setr_epi8(0, 0, '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)));
+        eq2 = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setr_epi8(0, 0, '.', '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)));
+#else
+        eq1 = (de[k].inum == 0) * 0x3 | (de[k].name[0] == '.') << 2 | (de[k].name[1] == 0) << 3;
+        eq2 = (de[k].name[0] == '.') << 2 | (de[k].name[1] == '.') << 3 | (de[k].name[2] == 0) << 4;
+#endif
+        bit = (uint64_t)1 << (k % 64);
+        if ((eq1 & 0x3) != 0x3)
+            m->used[k / 64] |= bit;
+        if ((eq1 & 0xC) == 0xC)
+            m->dot[k / 64] |= bit;
+        if ((eq2 & 0x1C) == 0x1C)
+            m->dotdot[k / 64] |= bit;
+    }
+}
+
+// Walk the directory entries of one directory data block, updating the
+// reference bookkeeping for Rules 9-12 (dir_inum is the directory's inode).
+// Only the entries in use are visited.
+static void count_dir_refs(struct fsimage *fs, struct dirinfo *di, uint dir_inum, uint blk,
+                           const struct dirent *de, const struct dirmask *m)
+{
+    uint w, k, ref_inum;
+    uint64_t bits, bit;
+
+    for (w = 0; w < DIRMASK_WORDS; w++)
+    {
+        for (bits = m->used[w]; bits != 0; bits &= bits - 1)
+        {
+            k = __builtin_ctzll(bits);
+            bit = (uint64_t)1 << k;
+            ref_inum = de[w * 64 + k].inum;
+            if (ref_inum >= fs->sb->ninodes)
+                continue;
+
+            // Mark that this inode is referenced by some directory
+            if (fs->plan & PLAN_REFS)
+                bitset_set(di->referenced, ref_inum);
+
+            // Count references for link count checks (exclude "." entry)
+            if (m->dot[w] & bit)
+                continue;
+            if ((fs->plan & PLAN_REFCOUNT) && fs->itable[ref_inum].type != T_DIR && di->refcount[ref_inum] != 0xFFFF)
+                di->refcount[ref_inum]++;
+            if ((m->dotdot[w] & bit) || !(fs->plan & PLAN_PARENTS))
+                continue;
+
+            // Count directory parents and build the parent map (exclude "." and "..")
+            if (bitset_test(di->dir_once, ref_inum))
+                bitset_set(di->dir_twice, ref_inum);
+            bitset_set(di->dir_once, ref_inum);
+            if (fs->itable[ref_inum].type == T_DIR)
+            {
+                if (!bitset_test(di->has_parent, ref_inum))
+                {
+                    bitset_set(di->has_parent, ref_inum);
+                    di->parent[ref_inum] = dir_inum;
+                    if (dir_inum > 0xFFFF)
+                        bitset_set(di->parent_far, ref_inum);
+                }
+                else if (!is_parent(di, ref_inum, dir_inum))
+                    report_error(&di->conflicts, FCHECK_DIR_TWICE, ref_inum, blk);
+            }
+        }
+    }
+}
+
+// Check the first block of directory `dir_inum` for "." and ".." (Rule 4).
+// Returns its ".." target, or -1 if the block is malformed.
+static int check_dir_format(uint dir_inum, const struct dirent *de, const struct dirmask *m)
+{
+    // Track whether "." and ".." were found in the first directory block
+    int dot = 0;
+    int dotdot = 0;
+    int dotdot_inum = -1;
+    uint w, k;
+    uint64_t bits;
+
+    for (w = 0; w < DIRMASK_WORDS; w++)
+    {
+        // "." must point to itself
+        for (bits = m->used[w] & m->dot[w]; bits != 0; bits &= bits - 1)
+        {
+            if (de[w * 64 + __builtin_ctzll(bits)].inum != dir_inum)
+                return -1;
+            dot = 1;
+        }
+        // Record the last ".." target so we can validate it after building parent relationships
+        bits = m->used[w] & m->dotdot[w];
+        if (bits != 0)
+        {
+            k = 63 - __builtin_clzll(bits);
+            dotdot = 1;
+            dotdot_inum = de[w * 64 + k].inum;
+        }
+    }
+
+    // Missing "." or ".." is a formatting error
+    return dot && dotdot ? dotdot_inum : -1;
+}
+
+// Find the root directory's ".." the way Rule 3 looks for it: entries are
+// read in order up to the first empty one, bounded by the directory size.
+// Returns -1 if there is none.
+static int find_root_dotdot(struct fsimage *fs, const struct dirent *de, const struct dirmask *m)
+{
+    uint w, k, n = fs->itable[ROOTINO].size / sizeof(struct dirent);
+    uint64_t live, bits;
+
+    if (n > DPB)
+        n = DPB;
+    for (w = 0; w * 64 < n; w++)
+    {
+        // Entries of this word before the first empty one and before n
+        live = ~m->used[w] == 0 ? ~(uint64_t)0 : ((uint64_t)1 << __builtin_ctzll(~m->used[w])) - 1;
+        if (n - w * 64 < 64)
+            live &= ((uint64_t)1 << (n - w * 64)) - 1;
+        bits = live & m->dotdot[w];
+        if (bits != 0)
+        {
+            k = __builtin_ctzll(bits);
+            return de[w * 64 + k].inum;
+        }
+        if (live != ~(uint64_t)0)
+            break;
+    }
+    return -1;
+}
+
+// Count a directory block read by the sweep and its entries in use
+static void count_dirents(struct fcheck_stats *st, const struct dirmask *m)
+{
+    uint w;
+
+    st->dir_blocks++;
+    st->blocks_read++;
+    for (w = 0; w < DIRMASK_WORDS; w++)
+        st->dirents += __builtin_popcountll(m->used[w]);
+}
+
+// Single sweep over the directories in `dirs`. Each directory data block is read once:
+// the first block feeds Rules 3 and 4, and every block feeds the reference
+// bookkeeping for Rules 9-12. Nothing is reported here; the rules are checked
+// from the filled-in arrays afterwards, in the classic order.
+static void sweep_directories(struct fsimage *fs, struct dirinfo *di, const uint *dirs, uint ndirs,
+                              struct fcheck_stats *st)
+{
+    const struct dinode *dip;
+    const struct dirent *de;
+    struct dirmask m;
+    uint d, i, j, blk;
+    int dotdot;
+    const uint *indir;
+    union block dirbuf, indirbuf;
+
+    for (d = 0; d < ndirs; d++)
+    {
+        // Prefetch the first and indirect blocks of the directory `ahead` places on
+        if (fs->ahead != 0 && d + fs->ahead < ndirs)
+        {
+            dip = &fs->itable[dirs[d + fs->ahead]];
+            prefetch_block(fs, dip->addrs[0]);
+            prefetch_block(fs, dip->addrs[NDIRECT]);
+        }
+
+        i = dirs[d];
+        dip = &fs->itable[i];
+
+        // Traverse direct directory blocks (out-of-range blocks were reported by Rule 2)
+        for (j = 0; j < NDIRECT; j++)
+        {
+            blk = dip->addrs[j];
+            if (blk == 0 || !valid_data_block(fs, blk))
+                continue;
+
+            de = read_block(fs, blk, &dirbuf);
+            classify_dirents(de, &m);
+            count_dirents(st, &m);
+            if (j == 0)
+            {
+                dotdot = (fs->plan & PLAN_PARENTS) ? check_dir_format(i, de, &m) : -1;
+                if (dotdot >= 0)
+                {
+                    bitset_set(di->has_dotdot, i);
+                    di->dotdot[i] = dotdot;
+                }
+                if (i == ROOTINO)
+                    di->root_dotdot = find_root_dotdot(fs, de, &m);
+            }
+            count_dir_refs(fs, di, i, blk, de, &m);
+        }
+
+        // Traverse indirect directory blocks (if present)
+        blk = dip->addrs[NDIRECT];
+        if (blk != 0 && valid_data_block(fs, blk))
+        {
+            indir = read_block(fs, blk, &indirbuf);
+            st->blocks_read++;
+            for (j = 0; j < NINDIRECT; j++)
+            {
+                blk = indir[j];
+                if (blk == 0 || !valid_data_block(fs, blk))
+                    continue;
+                de = read_block(fs, blk, &dirbuf);
+                classify_dirents(de, &m);
+                count_dirents(st, &m);
+                count_dir_refs(fs, di, i, blk, de, &m);
+            }
+        }
+    }
+}
+
+// --- Reachability (Rule 13) ---
+
+// Collect the valid data block numbers of directory `d` (direct blocks, then
+// those listed by its indirect block) into `blks`. Returns how many.
+static uint dir_blocks(struct fsimage *fs, uint d, uint blks[MAXFILE], struct fcheck_stats *st)
+{
+    const struct dinode *dip = &fs->itable[d];
+    const uint *indir;
+    union block indirbuf;
+    uint j, blk, n = 0;
+
+    for (j = 0; j < NDIRECT; j++)
+    {
+        blk = dip->addrs[j];
+        if (blk != 0 && valid_data_block(fs, blk))
+            blks[n++] = blk;
+    }
+    blk = dip->addrs[NDIRECT];
+    if (blk != 0 && valid_data_block(fs, blk))
+    {
+        indir = read_block(fs, blk, &indirbuf);
+        st->blocks_read++;
+        for (j = 0; j < NINDIRECT; j++)
+        {
+            blk = indir[j];
+            if (blk != 0 && valid_data_block(fs, blk))
+                blks[n++] = blk;
+        }
+    }
+    return n;
+}
+
+// Directories waiting to be read by one walker. The walker pushes and pops
+// at the tail; idle walkers steal from the head. A directory is queued at
+// most once, so `v` needs no more room than there are directories.
+struct reach_queue
+{
+    pthread_mutex_t lock;
+    uint *v;
+    uint head, tail;
+};
+
+// The walk from the root, shared by all walkers
+struct reach_walk
+{
+    struct fsimage *fs;
+    uint64_t *reached;    // inodes in use reached from the root (set atomically)
+    uint64_t *links_root; // directories with an entry (not "." or "..") naming the root
+    struct reach_queue *queues;
+    int nqueues;
+    uint pending;         // directories queued or being read; the walk ends at 0
+};
+
+struct reach_job
+{
+    struct reach_walk *walk;
+    int id;                 // this walker's queue
+    struct fcheck_stats st; // work done by this walker
+};
+
+static void reach_push(struct reach_queue *q, uint d)
+{
+    pthread_mutex_lock(&q->lock);
+    q->v[q->tail++] = d;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Next directory for walker `id`: the newest one on its own queue (depth
+// first, so the queue stays short), else the oldest one on another walker's
+// queue (nearest the root, so a thief takes away the most work). NONE if
+// every queue is empty.
+static uint reach_take(struct reach_walk *w, int id)
+{
+    struct reach_queue *q;
+    uint d = NONE;
+    int t;
+
+    for (t = 0; t < w->nqueues && d == NONE; t++)
+    {
+        q = &w->queues[(id + t) % w->nqueues];
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head)
+            d = t == 0 ? q->v[--q->tail] : q->v[q->head++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return d;
+}
+
+// Mark what the entries of one block of directory `d` reach, queueing each
+// directory reached for the first time
+static void reach_entries(struct reach_job *job, uint d, const struct dirent *de, const struct dirmask *m)
+{
+    struct reach_walk *w = job->walk;
+    struct fsimage *fs = w->fs;
+    uint wd, k, inum;
+    uint64_t bits, bit;
+
+    for (wd = 0; wd < DIRMASK_WORDS; wd++)
+    {
+        for (bits = m->used[wd] & ~m->dot[wd] & ~m->dotdot[wd]; bits != 0; bits &= bits - 1)
+        {
+            k = __builtin_ctzll(bits);
+            inum = de[wd * 64 + k].inum;
+            if (inum >= fs->sb->ninodes || fs->itable[inum].type == 0)
+                continue;
+            if (inum == ROOTINO)
+            {
+                __atomic_fetch_or(&w->links_root[d / 64], (uint64_t)1 << (d % 64), __ATOMIC_RELAXED);
+                continue;
+            }
+            bit = (uint64_t)1 << (inum % 64);
+            if (__atomic_fetch_or(&w->reached[inum / 64], bit, __ATOMIC_RELAXED) & bit)
+                continue;
+            if (fs->itable[inum].type == T_DIR)
+            {
+                __atomic_add_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+                reach_push(&w->queues[job->id], inum);
+            }
+        }
+    }
+}
+
+static void *reach_worker(void *arg)
+{
+    struct reach_job *job = arg;
+    struct reach_walk *w = job->walk;
+    const struct dirent *de;
+    struct dirmask m;
+    union block dirbuf;
+    uint blks[MAXFILE];
+    uint d, j, n;
+
+    for (;;)
+    {
+        d = reach_take(w, job->id);
+        if (d == NONE)
+        {
+            // Nothing to steal: done once no walker can queue more
+            if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+        n = dir_blocks(w->fs, d, blks, &job->st);
+        for (j = 0; j < n; j++)
+        {
+            de = read_block(w->fs, blks[j], &dirbuf);
+            classify_dirents(de, &m);
+            count_dirents(&job->st, &m);
+            reach_entries(job, d, de, &m);
+        }
+        __atomic_sub_fetch(&w->pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Walk the tree from the root with `nthreads` walkers, filling in
+// w->reached and w->links_root. Returns -1 if the walkers' memory cannot be
+// allocated.
+static int reach_walk(struct reach_walk *w, const struct fcheck_opts *opts, uint ndirs, int nthreads,
+                      struct fcheck_stats *st)
+{
+    struct reach_job *jobs;
+    pthread_t *tids;
+    uint *slots;
+    char *started;
+    int t;
+
+    // One allocation: the jobs, queues, queue slots, thread ids and started flags
+    jobs = lib_calloc(opts, nthreads * (sizeof(struct reach_job) + sizeof(struct reach_queue) + sizeof(pthread_t) + 1 +
+                                        (size_t)ndirs * sizeof(uint)));
+    if (jobs == NULL)
+        return -1;
+    w->queues = (struct reach_queue *)(jobs + nthreads);
+    tids = (pthread_t *)(w->queues + nthreads);
+    slots = (uint *)(tids + nthreads);
+    started = (char *)(slots + (size_t)nthreads * ndirs);
+    w->nqueues = nthreads;
+    for (t = 0; t < nthreads; t++)
+    {
+        pthread_mutex_init(&w->queues[t].lock, NULL);
+        w->queues[t].v = slots + (size_t)t * ndirs;
+        jobs[t].walk = w;
+        jobs[t].id = t;
+    }
+
+    bitset_set(w->reached, ROOTINO);
+    w->pending = 1;
+    reach_push(&w->queues[0], ROOTINO);
+    if (nthreads == 1)
+        reach_worker(&jobs[0]);
+    else
+    {
+        // A walker whose thread cannot be started walks here instead
+        for (t = 0; t < nthreads; t++)
+        {
+            started[t] = pthread_create(&tids[t], NULL, reach_worker, &jobs[t]) == 0;
+            if (!started[t])
+                reach_worker(&jobs[t]);
+        }
+        for (t = 0; t < nthreads; t++)
+            if (started[t])
+                pthread_join(tids[t], NULL);
+    }
+
+    for (t = 0; t < nthreads; t++)
+    {
+        add_stats(st, &jobs[t].st);
+        pthread_mutex_destroy(&w->queues[t].lock);
+    }
+    lib_free(opts, jobs);
+    return 0;
+}
+
+// RULE 13: every inode in use is reachable from the root, and no directory
+// is its own ancestor. After the walk, the inodes left over are linked to
+// the directory that lists them (one of them, itself unreached); following
+// those links from any of them ends either at an inode no directory lists,
+// the top of an orphaned subtree, or in a cycle. A cycle through the root
+// itself shows up in the walk as an entry naming the root.
+static void check_reachable(struct fsimage *fs, const struct fcheck_opts *opts, const struct inode_lists *lists,
+                            struct report *rep, struct fcheck_stats *st)
+{
+    const struct dirent *de;
+    struct dirmask m;
+    union block dirbuf;
+    struct reach_walk w;
+    uint blks[MAXFILE];
+    uint pos[2];
+    uint ninodes = fs->sb->ninodes, words = BITSET_WORDS(ninodes);
+    uint i, j, k, n, wd, x, low, inum;
+    uint64_t *has_ref, bits;
+    uint *ref_by;
+    uchar *state;
+    char *scratch;
+
+    // Without a root directory there is nothing to walk (Rule 3 says so)
+    if (ninodes < 2 || fs->itable[ROOTINO].type != T_DIR)
+        return;
+
+    // One zeroed allocation: reached, links_root, has_ref, ref_by and the walk state
+    scratch = lib_calloc(opts, words * sizeof(uint64_t) * 3 + (size_t)ninodes * (sizeof(uint) + 1));
+    if (scratch == NULL)
+    {
+        rep->nomem = 1;
+        return;
+    }
+    memset(&w, 0, sizeof(w));
+    w.fs = fs;
+    w.reached = (uint64_t *)scratch;
+    w.links_root = w.reached + words;
+    has_ref = w.links_root + words;
+    ref_by = (uint *)(has_ref + words);
+    state = (uchar *)(ref_by + ninodes);
+
+    if (reach_walk(&w, opts, lists->ndirs, opts->nthreads > 1 ? opts->nthreads : 1, st) < 0)
+    {
+        rep->nomem = 1;
+        goto done;
+    }
+
+    // Cycles through the root
+    for (k = 0; k < lists->ndirs && !STOPPED(rep); k++)
+    {
+        i = lists->v[k];
+        if (bitset_test(w.links_root, i) && bitset_test(w.reached, i))
+            report_error(rep, FCHECK_DIR_CYCLE, i, NONE);
+    }
+
+    // Link each unreached inode to an unreached directory listing it
+    for (k = 0; k < lists->ndirs && !STOPPED(rep); k++)
+    {
+        i = lists->v[k];
+        if (bitset_test(w.reached, i))
+            continue;
+        n = dir_blocks(fs, i, blks, st);
+        for (j = 0; j < n; j++)
+        {
+            de = read_block(fs, blks[j], &dirbuf);
+            classify_dirents(de, &m);
+            count_dirents(st, &m);
+            for (wd = 0; wd < DIRMASK_WORDS; wd++)
+            {
+                for (bits = m.used[wd] & ~m.dot[wd] & ~m.dotdot[wd]; bits != 0; bits &= bits - 1)
+                {
+                    inum = de[wd * 64 + __builtin_ctzll(bits)].inum;
+                    if (inum < ninodes && fs->itable[inum].type != 0 && !bitset_test(w.reached, inum) &&
+                        !bitset_test(has_ref, inum))
+                    {
+                        bitset_set(has_ref, inum);
+                        ref_by[inum] = i;
+                    }
+                }
+            }
+        }
+    }
+
+    // Follow the links from each unreached inode, in inode order. state: 0 =
+    // not yet seen, 1 = on the current path, 2 = done.
+    memset(pos, 0, sizeof(pos));
+    while (!STOPPED(rep) && (i = next_allocated(lists, pos)) != NONE)
+    {
+        if (bitset_test(w.reached, i))
+            continue;
+        if (!bitset_test(has_ref, i))
+            report_error(rep, FCHECK_UNREACHABLE, i, NONE);
+        if (state[i] != 0)
+            continue;
+        for (x = i; state[x] == 0 && bitset_test(has_ref, x); x = ref_by[x])
+            state[x] = 1;
+
+        // Back on the current path: a cycle, reported at its lowest inode
+        if (state[x] == 1)
+        {
+            for (low = x, j = ref_by[x]; j != x; j = ref_by[j])
+                low = j < low ? j : low;
+            report_error(rep, FCHECK_DIR_CYCLE, low, NONE);
+        }
+        for (x = i; state[x] == 1; x = ref_by[x])
+            state[x] = 2;
+        state[x] = 2;
+    }
+
+done:
+    lib_free(opts, scratch);
+}
+
+// Check every consistency rule on an image. Violations go to `rep`;
+// in the default mode checking stops at the first one. Returns FCHECK_NOMEM
+// if scratch memory runs out (everything allocated is released), 0 otherwise.
+static int check_image(struct fsimage *fs, const struct fcheck_opts *opts, struct report *rep)
+{
+    const struct superblock *sb = fs->sb;
+    const struct dinode *itable = fs->itable;
+    const uchar *bitmap = fs->bitmap;
+    uint min_db = fs->min_db, max_db = fs->max_db;
+    uint i, j, k, blk;
+    uint pos[2];
+    uint64_t *used, *own_used = NULL, bits;
+    const struct dirent *de;
+    struct dirmask m;
+    union block dirbuf;
+    struct inode_lists lists;
+    struct dirinfo di;
+    struct owner_map owners;
+    struct sort_engine se;
+    struct fcheck_stats st;
+    size_t used_bytes, bitset_bytes, dirinfo_size, bound = 0, cap;
+    char *scratch;
+    int err = FCHECK_OK, sort;
+    long bad;
+
+    // --- VERIFY CONSISTENCY RULES ---
+
+    // Plan the passes the selected rules need
+    fs->rules = opts->rules ? opts->rules & KNOWN_RULES : FCHECK_ALL_RULES;
+    fs->plan = 0;
+    for (k = 1; k <= 13; k++)
+        if (fs->rules & FCHECK_RULE(k))
+            fs->plan |= rule_needs[k];
+
+    // One allocation holds the ownership bitset (if any rule needs it and the
+    // sort engine does not run), the directory bookkeeping and the inode
+    // lists (zeroed; with --list, the CLI's arena hands the same memory to
+    // every image a worker checks)
+    used_bytes = BITSET_WORDS(sb->size) * sizeof(uint64_t);
+    dirinfo_size = (dirinfo_bytes(sb->ninodes) + 7) & ~(size_t)7;
+    sort = use_sort_engine(fs, opts, used_bytes + dirinfo_size + (size_t)sb->ninodes * sizeof(uint), &bound);
+    bitset_bytes = !sort && (fs->plan & PLAN_OWNERS) ? used_bytes : 0;
+    scratch = lib_calloc(opts, bitset_bytes + dirinfo_size + (size_t)sb->ninodes * sizeof(uint));
+    if (scratch == NULL)
+        return FCHECK_NOMEM;
+    memset(&di, 0, sizeof(di));
+    memset(&se, 0, sizeof(se));
+    memset(&st, 0, sizeof(st));
+
+    // Track blocks used by inodes in a bitset (0 = free, 1 = used)
+    used = bitset_bytes != 0 ? (uint64_t *)scratch : NULL;
+    memset(&lists, 0, sizeof(lists));
+    lists.v = (uint *)(scratch + bitset_bytes + dirinfo_size);
+    lists.size = sb->ninodes;
+
+    // Read inodes (Rules 1, 2, 7, 8). The sort engine also settles Rules 5
+    // and 6; without memory for its tuples the bitset is used after all.
+    PHASE(opts, FCHECK_PHASE_SCAN);
+    if (sort && (err = scan_sorted(fs, opts, &lists, &st, bound, &se)) < 0)
+    {
+        sorter_free(&se.tuples);
+        sorter_free(&se.dups);
+        sort = 0;
+        used = own_used = lib_calloc(opts, used_bytes);
+        if (used == NULL)
+        {
+            rep->nomem = 1;
+            goto done;
+        }
+        lists.ndirs = lists.nrest = 0;
+        err = FCHECK_OK;
+    }
+    if (se.tuples.failed || se.dups.failed)
+        goto done;
+
+    // Read inodes with the bitset; fall back to one thread if the workers' memory is short
+    if (!sort)
+    {
+        if (opts->nthreads > 1 && sb->ninodes >= (uint)opts->nthreads)
+            err = scan_inodes_parallel(fs, opts, used, &lists, &st, opts->nthreads);
+        if (err < 0 || opts->nthreads <= 1 || sb->ninodes < (uint)opts->nthreads)
+        {
+            lists.ndirs = lists.nrest = 0;
+            err = scan_inodes(fs, 0, sb->ninodes, used, NULL, &lists, &st, NULL, NULL);
+        }
+
+        // RULE 5: Every block used by an inode is marked in use in the bitmap
+        PHASE(opts, FCHECK_PHASE_BITMAP);
+        if (err == FCHECK_OK && RULE_ON(fs, FCHECK_BITMAP_FREE) && bitmap_andnot_first((uchar *)used, bitmap, 0, max_db) >= 0)
+            err = FCHECK_BITMAP_FREE;
+    }
+
+    // Something is wrong: replay the scan serially, checking Rule 5 per block,
+    // so violations are reported in inode order. The replay also keeps the
+    // owner of each block, so a block used twice names both of its inodes;
+    // without memory for that map the first owner is simply left out. After
+    // the sort engine, the replay takes a bitset too if one fits; if not, it
+    // reads the blocks held twice, with their owners, back from the merge.
+    // (Those count the entries of an indirect block held twice as held by
+    // both holders, where the bitset counts them for the first one only, so
+    // a block such an entry shares can be reported used twice in addition.)
+    if (err != FCHECK_OK)
+    {
+        PHASE(opts, FCHECK_PHASE_SCAN);
+        lists.ndirs = lists.nrest = 0;
+        if (sort && (used = own_used = lib_alloc(opts, used_bytes)) != NULL)
+            sort = 0;
+        if (sort)
+        {
+            for (cap = MIN_SORT_CAP; bound / cap + 1 > cap * 2; cap *= 2)
+                ;
+            if (sorter_init(&se.skipped, opts, cap, bound, &st) < 0)
+            {
+                rep->nomem = 1;
+                goto done;
+            }
+            se.have_dup = sorter_rewind(&se.dups) == 0 && sorter_next(&se.dups, &se.dup);
+            scan_inodes(fs, 0, sb->ninodes, NULL, &se, &lists, &st, rep, NULL);
+            if (se.dups.failed || se.skipped.failed)
+                goto done;
+        }
+        else
+        {
+            if (used != NULL)
+                memset(used, 0, used_bytes);
+            owners.inum = used != NULL ? lib_alloc(opts, (size_t)sb->size * (sizeof(ushort) + sizeof(slot_t))) : NULL;
+            owners.slot = owners.inum != NULL ? (slot_t *)(owners.inum + sb->size) : NULL;
+            scan_inodes(fs, 0, sb->ninodes, used, NULL, &lists, &st, rep, owners.inum != NULL ? &owners : NULL);
+            lib_free(opts, owners.inum);
+        }
+        if (STOPPED(rep))
+            goto done;
+    }
+
+    // RULE 6: Block marked in use in bitmap is actually used (the sort
+    // engine's merge has found it so unless something was wrong)
+    PHASE(opts, FCHECK_PHASE_BITMAP);
+    if (sort && err != FCHECK_OK && RULE_ON(fs, FCHECK_BITMAP_USED))
+        report_unheld(fs, opts, &se, rep);
+    bad = RULE_ON(fs, FCHECK_BITMAP_USED) && used != NULL ? bitmap_andnot_first(bitmap, (uchar *)used, min_db, max_db) : -1;
+    if (bad >= 0)
+    {
+        report_error(rep, FCHECK_BITMAP_USED, NONE, bad);
+        if (STOPPED(rep))
+            goto done;
+        while ((uint)bad < max_db && (bad = bitmap_andnot_first(bitmap, (uchar *)used, bad + 1, max_db)) >= 0)
+            report_error(rep, FCHECK_BITMAP_USED, NONE, bad);
+    }
+
+    // Track inode references for rules 3, 4, 9, 10, 11, 12 (all flags start clear)
+    dirinfo_layout(&di, scratch + bitset_bytes, sb->ninodes);
+    di.root_dotdot = -1;
+    di.conflicts.opts = opts;
+    di.conflicts.all = 1;
+
+    // Read every directory block once and fill in the bookkeeping arrays;
+    // without the sweep, Rule 3 reads the root's first block by itself
+    PHASE(opts, FCHECK_PHASE_DIRS);
+    if (fs->plan & PLAN_DIRS)
+        sweep_directories(fs, &di, lists.v, lists.ndirs, &st);
+    else if (RULE_ON(fs, FCHECK_NO_ROOT) && sb->ninodes >= 2 && itable[ROOTINO].type == T_DIR &&
+             valid_data_block(fs, itable[ROOTINO].addrs[0]))
+    {
+        de = read_block(fs, itable[ROOTINO].addrs[0], &dirbuf);
+        st.blocks_read++;
+        classify_dirents(de, &m);
+        di.root_dotdot = find_root_dotdot(fs, de, &m);
+    }
+    if (di.conflicts.nomem)
+    {
+        rep->nomem = 1;
+        goto done;
+    }
+
+    // RULE 3: Root directory exists, its inode number is 1, and the parent of the root directory is itself
+    PHASE(opts, FCHECK_PHASE_ROOT);
+    // Root inode must be an allocated directory with at least one data block whose ".." points to itself
+    if (sb->ninodes < 2 || itable[ROOTINO].type != T_DIR || !valid_data_block(fs, itable[ROOTINO].addrs[0]))
+        report_error(rep, FCHECK_NO_ROOT, ROOTINO, NONE);
+    else if (di.root_dotdot != ROOTINO)
+        report_error(rep, FCHECK_NO_ROOT, ROOTINO, itable[ROOTINO].addrs[0]);
+    if (STOPPED(rep))
+        goto done;
+
+    // RULE 4: Each directory contains . and .. entries, and the . entry points to itself
+    PHASE(opts, FCHECK_PHASE_RULES);
+    for (k = 0; k < lists.ndirs && !STOPPED(rep); k++)
+    {
+        i = lists.v[k];
+        if (!bitset_test(di.has_dotdot, i))
+        {
+            blk = itable[i].addrs[0];
+            report_error(rep, FCHECK_DIR_FORMAT, i, valid_data_block(fs, blk) ? blk : NONE);
+        }
+    }
+
+    // RULE 12: Directories listed under two different parents, in the order the sweep found them
+    for (j = 0; j < di.conflicts.nfindings && !STOPPED(rep); j++)
+        report_error(rep, FCHECK_DIR_TWICE, di.conflicts.findings[j].inum, di.conflicts.findings[j].blk);
+
+    // RULE 4: Each referenced directory's ".." matches the parent found by the sweep
+    for (k = 0; k < lists.ndirs && !STOPPED(rep); k++)
+    {
+        // Directories without a recorded ".." were reported above
+        i = lists.v[k];
+        if (!bitset_test(di.has_dotdot, i))
+            continue;
+
+        // Root's parent must be itself
+        if (i == ROOTINO)
+        {
+            if (di.dotdot[i] != ROOTINO)
+                report_error(rep, FCHECK_DIR_FORMAT, i, NONE);
+        }
+        else
+        {
+            // Only validate directories that are referenced in the tree
+            if (bitset_test(di.referenced, i) && (!bitset_test(di.has_parent, i) || !is_parent(&di, i, di.dotdot[i])))
+                report_error(rep, FCHECK_DIR_FORMAT, i, NONE);
+        }
+    }
+
+    // RULE 9: For all inodes marked in use, each must be referred to in at least one directory
+    memset(pos, 0, sizeof(pos));
+    while (!STOPPED(rep) && (i = next_allocated(&lists, pos)) != NONE)
+    {
+        if (!bitset_test(di.referenced, i))
+            report_error(rep, FCHECK_NOT_IN_DIR, i, NONE);
+    }
+
+    // RULE 10: For each inode number that is referred to in a valid directory, it is actually marked in use
+    // (free inodes are on no list; only referenced ones are looked up in the table)
+    for (j = 0; j < BITSET_WORDS(sb->ninodes) && !STOPPED(rep); j++)
+    {
+        for (bits = di.referenced[j]; bits != 0 && !STOPPED(rep); bits &= bits - 1)
+        {
+            i = j * 64 + __builtin_ctzll(bits);
+            if (itable[i].type == 0)
+                report_error(rep, FCHECK_REF_FREE, i, NONE);
+        }
+    }
+
+    // RULE 11: Reference counts (number of links) for regular files match the number of times file is referred to in directories
+    for (k = 0; k < lists.nrest && !STOPPED(rep); k++)
+    {
+        i = LIST_REST(&lists)[k];
+        if (itable[i].type == T_FILE && itable[i].nlink != di.refcount[i])
+            report_error(rep, FCHECK_BAD_REFCOUNT, i, NONE);
+    }
+
+    // RULE 12: No extra links allowed for directories (each directory only appears in one other directory)
+    for (k = 0; k < lists.ndirs && !STOPPED(rep); k++)
+    {
+        i = lists.v[k];
+        if (i != ROOTINO && bitset_test(di.dir_twice, i))
+            report_error(rep, FCHECK_DIR_TWICE, i, NONE);
+    }
+
+    // RULE 13: Every inode in use is reachable from the root directory (only when selected)
+    PHASE(opts, FCHECK_PHASE_REACH);
+    if ((fs->plan & PLAN_REACH) && !STOPPED(rep))
+        check_reachable(fs, opts, &lists, rep, &st);
+
+done:
+    PHASE(opts, FCHECK_NPHASES);
+    if (opts->stats != NULL)
+    {
+        // Metadata touched: the superblock, the inode table, and the bitmap if it was compared
+        st.bytes_touched = (st.blocks_read + 1 + (sb->ninodes + IPB - 1) / IPB) * BLOCK_SIZE;
+        if (fs->plan & PLAN_OWNERS)
+            st.bytes_touched += ((size_t)sb->size + BPB - 1) / BPB * BLOCK_SIZE;
+        add_stats(opts->stats, &st);
+    }
+    lib_free(opts, di.conflicts.findings);
+    lib_free(opts, own_used);
+    lib_free(opts, scratch);
+    if (se.tuples.failed || se.dups.failed || se.skipped.failed)
+        err = opts->spill != NULL ? FCHECK_IOERROR : FCHECK_NOMEM;
+    else
+        err = rep->nomem ? FCHECK_NOMEM : 0;
+    sorter_free(&se.tuples);
+    sorter_free(&se.dups);
+    sorter_free(&se.skipped);
+    return err;
+}
+
+// --- Quick check ---
+
+// Take block `b` for the quick check, giving up (goto done) on an address
+// out of range (Rule 2) or a block already taken (Rules 7, 8)
+#define QUICK_CLAIM(b)                                              \
+    do                                                              \
+    {                                                               \
+        if (!valid_data_block(fs, (b)) || bitset_test(seen, (b)))   \
+            goto done;                                              \
+        bitset_set(seen, (b));                                      \
+    } while (0)
+
+// The cheap pass behind fcheck_opts.quick: Rules 1-3, then the number of
+// distinct blocks held by inodes against the bitmap's count of data blocks
+// in use. Returns 0 if the image looks clean, -1 if the full check must
+// decide (including when memory runs out).
+static int quick_check(struct fsimage *fs, const struct fcheck_opts *opts)
+{
+    const struct dinode *dip;
+    const uint *indir;
+    const struct dirent *de;
+    struct dirmask m;
+    struct fcheck_stats st;
+    union block buf;
+    uint64_t *seen;
+    uint i, j, blk;
+    int ok = 0, bitmap_read = 0;
+
+    seen = lib_calloc(opts, BITSET_WORDS(fs->sb->size) * sizeof(uint64_t));
+    if (seen == NULL)
+        return -1;
+    memset(&st, 0, sizeof(st));
+    PHASE(opts, FCHECK_PHASE_QUICK);
+    for (i = 0; i < fs->sb->ninodes; i++)
+    {
+        if (inodes_in_hole(fs, i, fs->sb->ninodes))
+        {
+            st.inodes_free += IPB;
+            i += IPB - 1;
+            continue;
+        }
+        if (fs->ahead != 0 && i + fs->ahead < fs->sb->ninodes && fs->itable[i + fs->ahead].type != 0)
+            prefetch_block(fs, fs->itable[i + fs->ahead].addrs[NDIRECT]);
+
+        dip = &fs->itable[i];
+        if (dip->type == 0)
+        {
+            st.inodes_free++;
+            continue;
+        }
+
+        // RULE 1
+        if (dip->type == T_DIR)
+            st.inodes_dir++;
+        else if (dip->type == T_FILE)
+            st.inodes_file++;
+        else if (dip->type == T_DEV)
+            st.inodes_dev++;
+        else
+        {
+            st.inodes_bad++;
+            goto done;
+        }
+
+        // RULES 2, 7, 8
+        for (j = 0; j < NDIRECT; j++)
+        {
+            blk = dip->addrs[j];
+            if (blk == 0)
+                continue;
+            QUICK_CLAIM(blk);
+            st.direct_addrs++;
+        }
+        blk = dip->addrs[NDIRECT];
+        if (blk == 0)
+            continue;
+        QUICK_CLAIM(blk);
+        indir = read_block(fs, blk, &buf);
+        st.indirect_blocks++;
+        st.blocks_read++;
+        for (j = 0; j < NINDIRECT; j++)
+        {
+            blk = indir[j];
+            if (blk == 0)
+                continue;
+            QUICK_CLAIM(blk);
+            st.indirect_addrs++;
+        }
+    }
+
+    // RULE 3
+    if (fs->sb->ninodes < 2 || fs->itable[ROOTINO].type != T_DIR || !valid_data_block(fs, fs->itable[ROOTINO].addrs[0]))
+        goto done;
+    de = read_block(fs, fs->itable[ROOTINO].addrs[0], &buf);
+    st.blocks_read++;
+    classify_dirents(de, &m);
+    if (find_root_dotdot(fs, de, &m) != ROOTINO)
+        goto done;
+
+    // RULES 5, 6 in total: every block held is distinct by now, so there
+    // must be as many data blocks marked in use as addresses held
+    ok = bitmap_popcount(fs->bitmap, fs->min_db, fs->max_db) == st.direct_addrs + st.indirect_blocks + st.indirect_addrs;
+    bitmap_read = 1;
+
+done:
+    PHASE(opts, FCHECK_NPHASES);
+    if (opts->stats != NULL)
+    {
+        st.bytes_touched = (st.blocks_read + 1 + (fs->sb->ninodes + IPB - 1) / IPB) * BLOCK_SIZE;
+        if (bitmap_read)
+            st.bytes_touched += ((size_t)fs->sb->size + BPB - 1) / BPB * BLOCK_SIZE;
+        add_stats(opts->stats, &st);
+    }
+    lib_free(opts, seen);
+    return ok ? 0 : -1;
+}
+
+#undef QUICK_CLAIM
+
+// --- Fingerprint index ---
+//
+// After a clean check, fcheck_check_indexed() can hand back an index of the
+// image. It holds a fingerprint of every metadata block, together with
+// everything the rules are checked from: the reference counts, the parent
+// map, each directory's ".." and entries, and the owner of every block.
+//
+// On the next check only the metadata is fingerprinted again. An inode's
+// blocks are read again only if its inode-table block changed, if the
+// bitmap freed one of them, or if it is a directory listing such an inode
+// (unlinking clears the entry in place and changes only the inode it
+// named); every other inode keeps its entries and blocks from the index.
+// Only the bitmap blocks that changed are compared in full. The rules
+// that span the whole image are then checked from the updated aggregates.
+// The incremental check proves an image still clean; if anything looks
+// wrong it falls back to the full check, so violations are reported exactly
+// as before. (A directory or indirect block rewritten with neither its
+// inode nor the bitmap changing is not seen: file system code that edits
+// the image always updates one of them, or the inode an entry names.)
+
+#define INDEX_MAGIC "FCKIDX02"
+
+// Kinds of directory entries (stored in the top bits of an index entry)
+#define ENT_OTHER 0
+#define ENT_DOT 1
+#define ENT_DOTDOT 2
+#define ENT_INUM(e) ((e) & 0xFFFF)
+#define ENT_KIND(e) ((e) >> 16)
+
+// Largest inode number an entry (and so the owner map) can hold
+#define INDEX_MAXINUM 0xFFFF
+
+// Index file header; the arrays follow in the order of struct fpindex
+struct index_header
+{
+    char magic[8];
+    uint bsize;
+    struct superblock sb; // geometry the index was built for
+    uint nmeta;           // metadata blocks fingerprinted
+    uint nentries;        // directory entries stored
+    int root_dotdot;      // ".." of the root directory as Rule 3 sees it
+    uint64_t len;         // bytes in the whole index
+};
+
+// An index, in place in its buffer
+struct fpindex
+{
+    struct index_header *hdr;
+    uint64_t *fp_meta;  // per metadata block
+    uint *refs;         // entries naming the inode (Rules 9, 10)
+    uint *refcount;     // ... excluding "." (Rule 11)
+    uint *dirrefs;      // ... excluding "." and ".." (Rule 12)
+    int *parent;        // directory listing each directory (-1: none)
+    int *dotdot;        // ".." of each directory (-1: badly formatted)
+    uint *ent_off;      // entries of directory i: entries[ent_off[i] .. ent_off[i + 1])
+    ushort *owner;      // inode owning each block (0: none)
+    uint *entries;      // inum | kind << 16
+};
+
+#define INDEX_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+// Point `idx` at the arrays of an index at `base` (whose header is filled
+// in) and return the index length
+static uint64_t index_layout(struct fpindex *idx, void *base)
+{
+    struct index_header *hdr = base;
+    uint64_t ninodes = hdr->sb.ninodes, off = INDEX_ALIGN(sizeof(*hdr));
+    char *p = base;
+
+#define INDEX_ARRAY(field, count)                                   \
+    do                                                              \
+    {                                                               \
+        idx->field = (void *)(p + off);                             \
+        off += INDEX_ALIGN((uint64_t)(count) * sizeof(*idx->field)); \
+    } while (0)
+
+    idx->hdr = hdr;
+    INDEX_ARRAY(fp_meta, hdr->nmeta);
+    INDEX_ARRAY(refs, ninodes);
+    INDEX_ARRAY(refcount, ninodes);
+    INDEX_ARRAY(dirrefs, ninodes);
+    INDEX_ARRAY(parent, ninodes);
+    INDEX_ARRAY(dotdot, ninodes);
+    INDEX_ARRAY(ent_off, ninodes + 1);
+    INDEX_ARRAY(owner, hdr->sb.size);
+    INDEX_ARRAY(entries, hdr->nentries);
+#undef INDEX_ARRAY
+    return off;
+}
+
+// Fingerprint `len` bytes (a multiple of 8), continuing from `h`
+static uint64_t fingerprint(const void *data, size_t len, uint64_t h)
+{
+    const uchar *p = data;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        h = (h ^ load_word(p)) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Growable list of directory entries in index form
+struct entlist
+{
+    const struct fcheck_opts *opts;
+    uint *v;
+    uint n, cap;
+};
+
+// Append an entry. Returns -1 if the list cannot grow.
+static int entlist_add(struct entlist *l, uint e)
+{
+    uint *grown;
+
+    if (l->n == l->cap)
+    {
+        grown = lib_alloc(l->opts, (l->cap ? l->cap * 2 : 256) * sizeof(uint));
+        if (grown == NULL)
+            return -1;
+        if (l->n > 0)
+            memcpy(grown, l->v, l->n * sizeof(uint));
+        lib_free(l->opts, l->v);
+        l->v = grown;
+        l->cap = l->cap ? l->cap * 2 : 256;
+    }
+    l->v[l->n++] = e;
+    return 0;
+}
+
+// Append the entries of one directory block the way count_dir_refs() sees them
+static int collect_block(struct fsimage *fs, struct entlist *l, const struct dirent *de, const struct dirmask *m)
+{
+    uint w, k, kind;
+    uint64_t bits, bit;
+
+    for (w = 0; w < DIRMASK_WORDS; w++)
+    {
+        for (bits = m->used[w]; bits != 0; bits &= bits - 1)
+        {
+            k = __builtin_ctzll(bits);
+            bit = (uint64_t)1 << k;
+            if (de[w * 64 + k].inum >= fs->sb->ninodes)
+                continue;
+            kind = (m->dot[w] & bit) ? ENT_DOT : (m->dotdot[w] & bit) ? ENT_DOTDOT : ENT_OTHER;
+            if (entlist_add(l, de[w * 64 + k].inum | kind << 16) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Append the entries of directory `d`, recording its ".." in dotdot[d] (and
+// the root's ".." as Rule 3 sees it). Returns -1 if memory runs out.
+static int collect_dir(struct fsimage *fs, struct entlist *l, int *dotdot, int *root_dotdot, uint d)
+{
+    const struct dinode *dip = &fs->itable[d];
+    const struct dirent *de;
+    struct dirmask m;
+    const uint *indir;
+    union block dirbuf, indirbuf;
+    uint j, blk;
+
+    dotdot[d] = -1;
+    for (j = 0; j < NDIRECT; j++)
+    {
+        blk = dip->addrs[j];
+        if (blk == 0 || !valid_data_block(fs, blk))
+            continue;
+        de = read_block(fs, blk, &dirbuf);
+        classify_dirents(de, &m);
+        if (j == 0)
+        {
+            dotdot[d] = check_dir_format(d, de, &m);
+            if (d == ROOTINO)
+                *root_dotdot = find_root_dotdot(fs, de, &m);
+        }
+        if (collect_block(fs, l, de, &m) < 0)
+            return -1;
+    }
+    blk = dip->addrs[NDIRECT];
+    if (blk != 0 && valid_data_block(fs, blk))
+    {
+        indir = read_block(fs, blk, &indirbuf);
+        for (j = 0; j < NINDIRECT; j++)
+        {
+            if (indir[j] == 0 || !valid_data_block(fs, indir[j]))
+                continue;
+            de = read_block(fs, indir[j], &dirbuf);
+            classify_dirents(de, &m);
+            if (collect_block(fs, l, de, &m) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Add (sign 1) or remove (sign -1) the references made by directory `d`'s
+// entries. Removing also drops `d` as the recorded parent of its children.
+static void tally_entries(struct fpindex *idx, uint d, const uint *ents, uint n, int sign)
+{
+    uint k, c;
+
+    for (k = 0; k < n; k++)
+    {
+        c = ENT_INUM(ents[k]);
+        idx->refs[c] += sign;
+        if (ENT_KIND(ents[k]) != ENT_DOT)
+            idx->refcount[c] += sign;
+        if (ENT_KIND(ents[k]) == ENT_OTHER)
+        {
+            idx->dirrefs[c] += sign;
+            if (sign < 0 && idx->parent[c] == (int)d)
+                idx->parent[c] = -1;
+        }
+    }
+}
+
+// Record `d` as the parent of the directories its entries name. Returns -1
+// if one of them already has a different parent (Rule 12).
+static int claim_children(struct fsimage *fs, struct fpindex *idx, uint d, const uint *ents, uint n)
+{
+    uint k, c;
+
+    for (k = 0; k < n; k++)
+    {
+        c = ENT_INUM(ents[k]);
+        if (ENT_KIND(ents[k]) != ENT_OTHER || fs->itable[c].type != T_DIR)
+            continue;
+        if (idx->parent[c] == -1)
+            idx->parent[c] = d;
+        else if (idx->parent[c] != (int)d)
+            return -1;
+    }
+    return 0;
+}
+
+// Record inode `inum` as the owner of its blocks. Returns -1 if a block is
+// out of range, already owned or marked free (Rules 2, 5, 7, 8), and records
+// each block it changes in `touched` (when not NULL).
+static int claim_blocks(struct fsimage *fs, struct fpindex *idx, uint inum, uint64_t *touched)
+{
+    const struct dinode *dip = &fs->itable[inum];
+    const uint *indir;
+    union block buf;
+    uint j, blk;
+
+#define CLAIM(b)                                                                \
+    do                                                                          \
+    {                                                                           \
+        if (!valid_data_block(fs, (b)) || idx->owner[(b)] != 0 ||               \
+            get_bitmap_bit(fs->meta, fs->sb, (b)) == 0)                         \
+            return -1;                                                          \
+        idx->owner[(b)] = inum;                                                 \
+        if (touched != NULL)                                                    \
+            bitset_set(touched, (b));                                           \
+    } while (0)
+
+    for (j = 0; j < NDIRECT; j++)
+        if (dip->addrs[j] != 0)
+            CLAIM(dip->addrs[j]);
+    blk = dip->addrs[NDIRECT];
+    if (blk != 0)
+    {
+        CLAIM(blk);
+        indir = read_block(fs, blk, &buf);
+        for (j = 0; j < NINDIRECT; j++)
+            if (indir[j] != 0)
+                CLAIM(indir[j]);
+    }
+#undef CLAIM
+    return 0;
+}
+
+// Check Rules 3, 4 and 9-12 over every inode from the aggregates in `idx`.
+// Returns -1 on any violation.
+static int check_aggregates(struct fsimage *fs, struct fpindex *idx)
+{
+    const struct dinode *itable = fs->itable;
+    uint i;
+
+    if (fs->sb->ninodes < 2 || itable[ROOTINO].type != T_DIR ||
+        !valid_data_block(fs, itable[ROOTINO].addrs[0]) || idx->hdr->root_dotdot != ROOTINO)
+        return -1;
+    for (i = 0; i < fs->sb->ninodes; i++)
+    {
+        if (itable[i].type == T_DIR)
+        {
+            if (idx->dotdot[i] == -1)
+                return -1;
+            if (i == ROOTINO ? idx->dotdot[i] != ROOTINO
+                             : idx->refs[i] > 0 && idx->parent[i] != idx->dotdot[i])
+                return -1;
+            if (i != ROOTINO && idx->dirrefs[i] > 1)
+                return -1;
+        }
+        if ((itable[i].type != 0) != (idx->refs[i] > 0))
+            return -1;
+        if (itable[i].type == T_FILE && itable[i].nlink != (int)idx->refcount[i])
+            return -1;
+    }
+    return 0;
+}
+
+// Does the bitmap agree with the owner map for block `blk` (Rules 5, 6)?
+static int bitmap_agrees(struct fsimage *fs, struct fpindex *idx, uint blk)
+{
+    int bit = get_bitmap_bit(fs->meta, fs->sb, blk);
+
+    if (idx->owner[blk] != 0)
+        return bit;
+    return !bit || !valid_data_block(fs, blk);
+}
+
+// Build an index of a clean image from scratch into `out`. Returns 0, or
+// FCHECK_NOMEM if memory runs out.
+static int build_index(struct fsimage *fs, const struct fcheck_opts *opts, struct fcheck_index *out)
+{
+    struct index_header hdr;
+    struct fpindex idx;
+    struct entlist l = {0};
+    int root_dotdot;
+    uint ninodes = fs->sb->ninodes, i;
+    uint *ent_off;
+    int *dotdot, err = 0;
+    uint64_t len;
+
+    // Inode numbers past what an entry can hold cannot be indexed
+    if (ninodes > INDEX_MAXINUM + 1)
+        return 0;
+
+    // Collect every directory's entries first; the index is sized from them
+    l.opts = opts;
+    dotdot = lib_alloc(opts, (size_t)ninodes * sizeof(int) + (size_t)(ninodes + 1) * sizeof(uint));
+    if (dotdot == NULL)
+        return FCHECK_NOMEM;
+    ent_off = (uint *)(dotdot + ninodes);
+    root_dotdot = -1;
+    for (i = 0; i < ninodes; i++)
+    {
+        dotdot[i] = -1;
+        ent_off[i] = l.n;
+        if (fs->itable[i].type == T_DIR && collect_dir(fs, &l, dotdot, &root_dotdot, i) < 0)
+        {
+            err = FCHECK_NOMEM;
+            goto done;
+        }
+    }
+    ent_off[ninodes] = l.n;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.bsize = BLOCK_SIZE;
+    hdr.sb = *fs->sb;
+    hdr.nmeta = ENGINE(fcheck_metadata_blocks)(fs->meta);
+    hdr.nentries = l.n;
+    hdr.root_dotdot = root_dotdot;
+    len = index_layout(&idx, &hdr);
+    hdr.len = len;
+    out->data = lib_calloc(opts, len);
+    if (out->data == NULL)
+    {
+        err = FCHECK_NOMEM;
+        goto done;
+    }
+    out->len = len;
+    memcpy(out->data, &hdr, sizeof(hdr));
+    index_layout(&idx, out->data);
+
+    for (i = 1; i < hdr.nmeta; i++)
+        idx.fp_meta[i] = fingerprint(fs->meta + (size_t)i * BLOCK_SIZE, BLOCK_SIZE, i);
+    memcpy(idx.dotdot, dotdot, ninodes * sizeof(int));
+    memcpy(idx.ent_off, ent_off, (ninodes + 1) * sizeof(uint));
+    if (l.n > 0)
+        memcpy(idx.entries, l.v, l.n * sizeof(uint));
+    for (i = 0; i < ninodes; i++)
+    {
+        idx.parent[i] = -1;
+        if (fs->itable[i].type != 0 && claim_blocks(fs, &idx, i, NULL) < 0)
+            goto inconsistent;
+    }
+    for (i = 0; i < ninodes; i++)
+    {
+        tally_entries(&idx, i, idx.entries + ent_off[i], ent_off[i + 1] - ent_off[i], 1);
+        if (claim_children(fs, &idx, i, idx.entries + ent_off[i], ent_off[i + 1] - ent_off[i]) < 0)
+            goto inconsistent;
+    }
+    goto done;
+
+inconsistent:
+    // Only reached if the image was not clean after all; leave no index
+    lib_free(opts, out->data);
+    out->data = NULL;
+    out->len = 0;
+
+done:
+    lib_free(opts, l.v);
+    lib_free(opts, dotdot);
+    return err;
+}
+
+// Is `data` an index of this image's geometry?
+static int index_matches(struct fsimage *fs, const void *data, size_t len)
+{
+    struct index_header hdr;
+    struct fpindex idx;
+
+    if (data == NULL || len < sizeof(hdr))
+        return 0;
+    uint i;
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0 || hdr.bsize != BLOCK_SIZE ||
+        memcmp(&hdr.sb, fs->sb, sizeof(hdr.sb)) != 0 || hdr.nmeta != ENGINE(fcheck_metadata_blocks)(fs->meta) ||
+        hdr.len != len || index_layout(&idx, &hdr) != len || fs->sb->ninodes > INDEX_MAXINUM + 1)
+        return 0;
+
+    // Entry lists must stay inside the index and name real inodes
+    index_layout(&idx, (void *)data);
+    for (i = 0; i < hdr.sb.ninodes; i++)
+        if (idx.ent_off[i] > idx.ent_off[i + 1])
+            return 0;
+    if (idx.ent_off[0] != 0 || idx.ent_off[hdr.sb.ninodes] != hdr.nentries)
+        return 0;
+    for (i = 0; i < hdr.nentries; i++)
+        if (ENT_INUM(idx.entries[i]) >= hdr.sb.ninodes)
+            return 0;
+    return 1;
+}
+
+// Check an image against the index `old` of an earlier clean check. Returns
+// 0 if the image is still clean (with an updated index in `out`, or none if
+// no metadata block has changed), 1 if it must be checked in full, or
+// FCHECK_NOMEM.
+static int check_incremental(struct fsimage *fs, const struct fcheck_opts *opts, const void *old, struct fcheck_index *out)
+{
+    struct fpindex prev, idx;
+    struct index_header hdr;
+    struct entlist l = {0};
+    int root_dotdot;
+    uint ninodes = fs->sb->ninodes, nbits = fs->sb->size;
+    uint bmap0 = BBLOCK(0, ninodes), i, b, k, nchanged = 0, nbitmap = 0;
+    uint64_t *changed, *listing, *touched, len;
+    uint *new_off;
+    int *dotdot_new, err = 1, became_dir = 0;
+    char *scratch;
+    size_t words = BITSET_WORDS(ninodes), bwords = BITSET_WORDS(nbits);
+
+    memcpy(&hdr, old, sizeof(hdr));
+    index_layout(&prev, (void *)old); // (read only)
+
+    // Scratch: changed-inode, listing-directory and touched-block bitsets,
+    // new ".." values and the offsets of re-read directories' entries
+    scratch = lib_calloc(opts, (2 * words + bwords) * sizeof(uint64_t) + (size_t)ninodes * sizeof(int) +
+                                   (size_t)(ninodes + 1) * sizeof(uint));
+    if (scratch == NULL)
+        return FCHECK_NOMEM;
+    changed = (uint64_t *)scratch;
+    listing = changed + words;
+    touched = listing + words;
+    dotdot_new = (int *)(touched + bwords);
+    new_off = (uint *)(dotdot_new + ninodes);
+    l.opts = opts;
+
+    // Inodes whose inode-table block changed
+    for (b = IBLOCK((uint)0); b < hdr.nmeta && b < bmap0; b++)
+    {
+        if (fingerprint(fs->meta + (size_t)b * BLOCK_SIZE, BLOCK_SIZE, b) == prev.fp_meta[b])
+            continue;
+        for (i = (b - IBLOCK((uint)0)) * IPB; i < (b - IBLOCK((uint)0) + 1) * IPB && i < ninodes; i++)
+            bitset_set(changed, i);
+    }
+
+    // ... or that held a block the bitmap now marks free (a block newly
+    // marked in use must turn up below among the changed inodes' blocks)
+    for (b = bmap0; b < hdr.nmeta; b++)
+    {
+        if (fingerprint(fs->meta + (size_t)b * BLOCK_SIZE, BLOCK_SIZE, b) == prev.fp_meta[b])
+            continue;
+        nbitmap++;
+        for (k = (b - bmap0) * BPB; k < (b - bmap0 + 1) * BPB && k < nbits; k++)
+            if (prev.owner[k] != 0 && prev.owner[k] < ninodes && get_bitmap_bit(fs->meta, fs->sb, k) == 0)
+                bitset_set(changed, prev.owner[k]);
+    }
+
+    // ... or directories that listed one of those
+    for (i = 0; i < ninodes; i++)
+        for (k = prev.ent_off[i]; k < prev.ent_off[i + 1] && !bitset_test(changed, i); k++)
+            if (ENT_KIND(prev.entries[k]) == ENT_OTHER && bitset_test(changed, ENT_INUM(prev.entries[k])))
+            {
+                bitset_set(listing, i);
+                break;
+            }
+    for (k = 0; k < words; k++)
+    {
+        changed[k] |= listing[k];
+        nchanged += __builtin_popcountll(changed[k]);
+    }
+    if (nchanged == 0 && nbitmap == 0)
+    {
+        err = 0; // no metadata block has changed
+        goto done;
+    }
+
+    // Re-read the changed directories (Rule 1 for the changed inodes too)
+    root_dotdot = hdr.root_dotdot;
+    for (i = 0; i < ninodes; i++)
+    {
+        new_off[i] = l.n;
+        if (!bitset_test(changed, i))
+            continue;
+        if (fs->itable[i].type < 0 || fs->itable[i].type > T_DEV || (fs->itable[i].type != 0 && i > INDEX_MAXINUM))
+            goto done;
+        if (i == ROOTINO)
+            root_dotdot = -1;
+        if (fs->itable[i].type == T_DIR && collect_dir(fs, &l, dotdot_new, &root_dotdot, i) < 0)
+        {
+            err = FCHECK_NOMEM;
+            goto done;
+        }
+        if (fs->itable[i].type == T_DIR && prev.ent_off[i + 1] == prev.ent_off[i])
+            became_dir = 1;
+    }
+    new_off[ninodes] = l.n;
+
+    // New index: the old one with the changed directories' entries replaced
+    hdr.nentries = prev.hdr->nentries + l.n;
+    for (i = 0; i < ninodes; i++)
+        if (bitset_test(changed, i))
+            hdr.nentries -= prev.ent_off[i + 1] - prev.ent_off[i];
+    hdr.root_dotdot = root_dotdot;
+    len = index_layout(&idx, &hdr);
+    hdr.len = len;
+    out->data = lib_calloc(opts, len); // (zeroed padding keeps the file reproducible)
+    if (out->data == NULL)
+    {
+        err = FCHECK_NOMEM;
+        goto done;
+    }
+    out->len = len;
+    memcpy(out->data, &hdr, sizeof(hdr));
+    index_layout(&idx, out->data);
+    memcpy(idx.refs, prev.refs, (char *)prev.ent_off - (char *)prev.refs); // through dotdot
+    memcpy(idx.owner, prev.owner, (size_t)nbits * sizeof(ushort));
+    for (b = 1; b < hdr.nmeta; b++)
+        idx.fp_meta[b] = fingerprint(fs->meta + (size_t)b * BLOCK_SIZE, BLOCK_SIZE, b);
+    for (i = 0, k = 0; i < ninodes; i++)
+    {
+        idx.ent_off[i] = k;
+        if (bitset_test(changed, i))
+        {
+            if (new_off[i + 1] > new_off[i])
+                memcpy(idx.entries + k, l.v + new_off[i], (new_off[i + 1] - new_off[i]) * sizeof(uint));
+            k += new_off[i + 1] - new_off[i];
+            idx.dotdot[i] = fs->itable[i].type == T_DIR ? dotdot_new[i] : -1;
+        }
+        else
+        {
+            memcpy(idx.entries + k, prev.entries + prev.ent_off[i], (prev.ent_off[i + 1] - prev.ent_off[i]) * sizeof(uint));
+            k += prev.ent_off[i + 1] - prev.ent_off[i];
+        }
+    }
+    idx.ent_off[ninodes] = k;
+
+    // Reference counts and parent map: take out what the changed directories
+    // used to say, then put in what they say now
+    for (i = 0; i < ninodes; i++)
+        if (bitset_test(changed, i))
+            tally_entries(&idx, i, prev.entries + prev.ent_off[i], prev.ent_off[i + 1] - prev.ent_off[i], -1);
+    if (became_dir)
+        for (i = 0; i < ninodes; i++)
+            idx.parent[i] = -1;
+    for (i = 0; i < ninodes; i++)
+    {
+        if (bitset_test(changed, i))
+            tally_entries(&idx, i, idx.entries + idx.ent_off[i], idx.ent_off[i + 1] - idx.ent_off[i], 1);
+        if ((became_dir || bitset_test(changed, i)) &&
+            claim_children(fs, &idx, i, idx.entries + idx.ent_off[i], idx.ent_off[i + 1] - idx.ent_off[i]) < 0)
+            goto inconsistent;
+    }
+
+    // Owner map: release the changed inodes' old blocks, then claim their new ones
+    for (b = 0; b < nbits && nchanged > 0; b++)
+    {
+        if (idx.owner[b] >= ninodes)
+            goto inconsistent;
+        if (idx.owner[b] != 0 && bitset_test(changed, idx.owner[b]))
+        {
+            idx.owner[b] = 0;
+            bitset_set(touched, b);
+        }
+    }
+    for (i = 0; i < ninodes; i++)
+        if (bitset_test(changed, i) && fs->itable[i].type != 0 && claim_blocks(fs, &idx, i, touched) < 0)
+            goto inconsistent;
+
+    // Bitmap: blocks that changed hands, and every block of a changed bitmap block
+    for (b = 0; b < nbits; b += 64)
+        if (touched[b / 64] != 0)
+            for (k = b; k < b + 64 && k < nbits; k++)
+                if (bitset_test(touched, k) && !bitmap_agrees(fs, &idx, k))
+                    goto inconsistent;
+    for (b = bmap0; b < hdr.nmeta && nbitmap > 0; b++)
+    {
+        if (idx.fp_meta[b] == prev.fp_meta[b])
+            continue;
+        for (k = (b - bmap0) * BPB; k < (b - bmap0 + 1) * BPB && k < nbits; k++)
+            if (!bitmap_agrees(fs, &idx, k))
+                goto inconsistent;
+    }
+
+    if (check_aggregates(fs, &idx) < 0)
+        goto inconsistent;
+    err = 0;
+    goto done;
+
+inconsistent:
+    lib_free(opts, out->data);
+    out->data = NULL;
+    out->len = 0;
+
+done:
+    lib_free(opts, l.v);
+    lib_free(opts, scratch);
+    return err;
+}
+
+// Locate the superblock, inode table and bitmap of `src` in `fs`, and set
+// the prefetch distance from `opts`. Returns FCHECK_BADIMAGE if they are not
+// all in memory or the superblock does not describe a disk, 0 otherwise.
+// Every entry point starts here, so no engine sees such an image.
+static int setup_image(struct fsimage *fs, const struct fcheck_source *src, const struct fcheck_opts *opts)
+{
+    const struct superblock *sb;
+    uint nmeta;
+
+    // The boot block, superblock, inode table and bitmap must be in memory
+    if (src->nmeta < 2)
+        return FCHECK_BADIMAGE;
+    nmeta = ENGINE(fcheck_metadata_blocks)(src->meta);
+    if (nmeta > src->nmeta)
+        return FCHECK_BADIMAGE;
+
+    // Some blocks, no more of them data blocks than that, and the data area
+    // after the metadata (the valid block range below relies on all three)
+    sb = (const struct superblock *)((const char *)src->meta + BLOCK_SIZE);
+    if (sb->size == 0 || sb->nblocks > sb->size || sb->size - sb->nblocks < nmeta)
+        return FCHECK_BADIMAGE;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->src = src;
+    fs->meta = src->meta;
+    fs->nmeta = src->nmeta;
+
+    // Read the superblock (block 1)
+    fs->sb = (const struct superblock *)(fs->meta + BLOCK_SIZE);
+
+    // Get start of inode table (block 2)
+    fs->itable = (const struct dinode *)(fs->meta + IBLOCK((uint)0) * BLOCK_SIZE);
+
+    // On-disk bitmap (starts at the block holding the bit for block 0)
+    fs->bitmap = (const uchar *)fs->meta + BBLOCK(0, fs->sb->ninodes) * BLOCK_SIZE;
+
+    // Compute valid data block range
+    // nblocks (data blocks) + usedblocks (metadata blocks) = size (total blocks)
+    fs->min_db = fs->sb->size - fs->sb->nblocks;
+    fs->max_db = fs->sb->size - 1;
+    fs->ahead = opts->prefetch == 0 ? PREFETCH_AHEAD : opts->prefetch > 0 ? (uint)opts->prefetch : 0;
+    return 0;
+}
+
+// FCHECK_IOERROR if the source failed to read a block, 0 otherwise
+static int read_result(struct fsimage *fs)
+{
+    return __atomic_load_n(&fs->read_failed, __ATOMIC_RELAXED) ? FCHECK_IOERROR : 0;
+}
+
+// Run the full check and fill in `report`
+static int run_check(struct fsimage *fs, const struct fcheck_opts *opts, const struct fcheck_opts *scratch,
+                     struct fcheck_report *report)
+{
+    struct report rep;
+    int result;
+
+    // The findings come from the caller's allocator, outside any memory limit
+    memset(&rep, 0, sizeof(rep));
+    rep.opts = opts;
+    rep.all = opts->all;
+    rep.stream = opts->finding != NULL;
+    rep.first = FCHECK_OK;
+    if ((result = check_image(fs, scratch, &rep)) < 0 || (result = read_result(fs)) < 0)
+    {
+        lib_free(opts, rep.findings);
+        return result;
+    }
+
+    report->first = rep.first;
+    report->findings = rep.findings;
+    report->nfindings = rep.nfindings;
+    return rep.first != FCHECK_OK ? FCHECK_VIOLATIONS : FCHECK_CLEAN;
+}
+
+int ENGINE(fcheck_check_source)(const struct fcheck_source *src, const struct fcheck_opts *opts, struct fcheck_report *report)
+{
+    struct fcheck_opts defaults = {0}, lim;
+    const struct fcheck_opts *scratch;
+    struct budget budget;
+    struct fsimage fs;
+
+    if (opts == NULL)
+        opts = &defaults;
+    memset(report, 0, sizeof(*report));
+    if (opts->stats != NULL)
+        memset(opts->stats, 0, sizeof(*opts->stats));
+    if (setup_image(&fs, src, opts) < 0)
+        return FCHECK_BADIMAGE;
+    scratch = limit_memory(opts, &lim, &budget);
+
+    // Probably clean by the cheap totals? (Any doubt goes to the full check.)
+    if (opts->quick && !opts->all && classic_rules(opts) && quick_check(&fs, scratch) == 0)
+        return read_result(&fs) < 0 ? FCHECK_IOERROR : FCHECK_CLEAN;
+    return run_check(&fs, opts, scratch, report);
+}
+
+int ENGINE(fcheck_check_indexed)(const struct fcheck_source *src, const struct fcheck_opts *opts, const void *old,
+                                 size_t old_len, struct fcheck_report *report, struct fcheck_index *index)
+{
+    struct fcheck_opts defaults = {0};
+    struct fsimage fs;
+    int result;
+
+    if (opts == NULL)
+        opts = &defaults;
+    memset(report, 0, sizeof(*report));
+    memset(index, 0, sizeof(*index));
+    if (opts->stats != NULL)
+        memset(opts->stats, 0, sizeof(*opts->stats));
+    if (setup_image(&fs, src, opts) < 0)
+        return FCHECK_BADIMAGE;
+
+    // The index covers Rules 1-12 exactly: checking fewer proves nothing
+    // about the rest, and it cannot check Rule 13 incrementally. Under a
+    // memory limit the full check does without the index's memory too.
+    if (!classic_rules(opts) || opts->mem_limit != 0)
+        return ENGINE(fcheck_check_source)(src, opts, report);
+
+    // Still clean according to the old index?
+    if (index_matches(&fs, old, old_len))
+    {
+        result = check_incremental(&fs, opts, old, index);
+        if (result == 0 && read_result(&fs) < 0)
+        {
+            fcheck_index_free(opts, index);
+            return FCHECK_IOERROR;
+        }
+        if (result == FCHECK_NOMEM)
+            return FCHECK_NOMEM;
+        if (result == 0)
+            return FCHECK_CLEAN;
+    }
+
+    // No usable index, or something is wrong: check in full (and index a clean image)
+    result = run_check(&fs, opts, opts, report);
+    if (result == FCHECK_CLEAN && build_index(&fs, opts, index) < 0)
+        return FCHECK_NOMEM;
+    if (result == FCHECK_CLEAN && read_result(&fs) < 0)
+    {
+        fcheck_index_free(opts, index);
+        return FCHECK_IOERROR;
+    }
+    return result;
+}
+
+// --- Image diff ---
+
+// Two images being compared, and where their differences go
+struct diff
+{
+    struct fsimage a, b;
+    const struct fcheck_opts *opts;
+    void (*change)(void *ctx, const struct fcheck_change *c);
+    void *ctx;
+    struct dirent *ents_a, *ents_b; // a directory's entries in each image (MAXFILE blocks' worth)
+    uint nchanges;
+};
+
+// Hand one difference to the caller
+static void diff_emit(struct diff *d, struct fcheck_change *c)
+{
+    d->change(d->ctx, c);
+    d->nchanges++;
+}
+
+// A file's block `ba` in image a and `bb` in image b, held at `slot` of inode
+// `inum`: report it if the contents differ. A block outside the data area is
+// compared by its address alone.
+static void diff_block(struct diff *d, uint inum, uint slot, uint ba, uint bb)
+{
+    struct fcheck_change c = {FCHECK_DIFF_DATA, inum, slot, NONE, 0, NULL, NULL, "", NONE};
+    union block bufa, bufb;
+    const void *pa, *pb;
+
+    if (ba == 0 && bb == 0)
+        return;
+    pa = ba != 0 && valid_data_block(&d->a, ba) ? read_block(&d->a, ba, &bufa) : NULL;
+    pb = bb != 0 && valid_data_block(&d->b, bb) ? read_block(&d->b, bb, &bufb) : NULL;
+    if (pa != NULL && pb != NULL ? memcmp(pa, pb, BLOCK_SIZE) == 0 : pa == NULL && pb == NULL && ba == bb)
+        return;
+    diff_emit(d, &c);
+}
+
+// A file whose inode differs: compare its data blocks slot by slot,
+// direct blocks first, then those its indirect block lists
+static void diff_data(struct diff *d, uint inum, const struct dinode *ia, const struct dinode *ib)
+{
+    static const union block zeroes;
+    union block bufa, bufb;
+    const uint *ea = zeroes.addrs, *eb = zeroes.addrs;
+    uint k;
+
+    for (k = 0; k < NDIRECT; k++)
+        diff_block(d, inum, k, ia->addrs[k], ib->addrs[k]);
+    if (ia->addrs[NDIRECT] != 0 && valid_data_block(&d->a, ia->addrs[NDIRECT]))
+        ea = read_block(&d->a, ia->addrs[NDIRECT], &bufa);
+    if (ib->addrs[NDIRECT] != 0 && valid_data_block(&d->b, ib->addrs[NDIRECT]))
+        eb = read_block(&d->b, ib->addrs[NDIRECT], &bufb);
+    if (ea == eb || memcmp(ea, eb, BLOCK_SIZE) == 0)
+        return;
+    for (k = 0; k < NINDIRECT; k++)
+        diff_block(d, inum, FCHECK_SLOT_ENTRY(k), ea[k], eb[k]);
+}
+
+// Order directory entries by name, then by inode
+static int dirent_order(const void *x, const void *y)
+{
+    const struct dirent *p = x, *q = y;
+    int r = strncmp(p->name, q->name, DIRSIZ);
+
+    return r != 0 ? r : (p->inum > q->inum) - (p->inum < q->inum);
+}
+
+// Copy the entries in use of directory `inum` in `fs` (blocks `blks`) into
+// `ents`, sorted by name. Returns how many.
+static uint sorted_entries(struct fsimage *fs, const uint *blks, uint n, struct dirent *ents)
+{
+    const struct dirent *de;
+    union block buf;
+    uint k, j, m = 0;
+
+    for (k = 0; k < n; k++)
+    {
+        de = read_block(fs, blks[k], &buf);
+        for (j = 0; j < DPB; j++)
+            if (de[j].inum != 0)
+                ents[m++] = de[j];
+    }
+    qsort(ents, m, sizeof(struct dirent), dirent_order);
+    return m;
+}
+
+// Report an entry of directory `inum` found in one image only
+static void diff_entry(struct diff *d, int kind, uint inum, const struct dirent *de)
+{
+    struct fcheck_change c = {kind, inum, NONE, NONE, 0, NULL, NULL, "", de->inum};
+
+    memcpy(c.name, de->name, DIRSIZ);
+    diff_emit(d, &c);
+}
+
+// A directory in use in both images: compare its blocks, and if any differ,
+// match its entries by name. Returns -1 if memory runs out.
+static int diff_dir(struct diff *d, uint inum)
+{
+    uint blks_a[MAXFILE], blks_b[MAXFILE];
+    struct fcheck_stats st = {0};
+    union block bufa, bufb;
+    uint na, nb, k, i, j;
+    int r;
+
+    na = dir_blocks(&d->a, inum, blks_a, &st);
+    nb = dir_blocks(&d->b, inum, blks_b, &st);
+    for (k = 0; na == nb && k < na; k++)
+        if (memcmp(read_block(&d->a, blks_a[k], &bufa), read_block(&d->b, blks_b[k], &bufb), BLOCK_SIZE) != 0)
+            break;
+    if (na == nb && k == na)
+        return 0;
+
+    if (d->ents_a == NULL)
+    {
+        d->ents_a = lib_alloc(d->opts, 2 * (size_t)MAXFILE * DPB * sizeof(struct dirent));
+        if (d->ents_a == NULL)
+            return -1;
+        d->ents_b = d->ents_a + MAXFILE * DPB;
+    }
+    na = sorted_entries(&d->a, blks_a, na, d->ents_a);
+    nb = sorted_entries(&d->b, blks_b, nb, d->ents_b);
+    for (i = j = 0; i < na || j < nb;)
+    {
+        r = i == na ? 1 : j == nb ? -1 : dirent_order(&d->ents_a[i], &d->ents_b[j]);
+        if (r < 0)
+            diff_entry(d, FCHECK_DIFF_ENTRY_REMOVED, inum, &d->ents_a[i++]);
+        else if (r > 0)
+            diff_entry(d, FCHECK_DIFF_ENTRY_ADDED, inum, &d->ents_b[j++]);
+        else
+            i++, j++;
+    }
+    return 0;
+}
+
+// Compare the inode tables a block at a time, looking into the inodes of a
+// block only where it differs; directories are compared whatever their
+// inodes. Returns -1 if memory runs out.
+static int diff_inodes(struct diff *d)
+{
+    struct fcheck_change c = {0, 0, NONE, NONE, 0, NULL, NULL, "", NONE};
+    uint na = d->a.sb->ninodes, nb = d->b.sb->ninodes;
+    uint n = na > nb ? na : nb;
+    const struct dinode *ia, *ib;
+    uint i, end;
+    int same = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        // The same inode-table block in both? (A common whole block only.)
+        if (i % IPB == 0)
+        {
+            end = i + IPB;
+            same = end <= na && end <= nb && memcmp(&d->a.itable[i], &d->b.itable[i], BLOCK_SIZE) == 0;
+        }
+        ia = i < na && d->a.itable[i].type != 0 ? &d->a.itable[i] : NULL;
+        ib = i < nb && d->b.itable[i].type != 0 ? &d->b.itable[i] : NULL;
+        if (!same && (ia != NULL || ib != NULL) && (ia == NULL || ib == NULL || memcmp(ia, ib, sizeof(*ia)) != 0))
+        {
+            c.kind = ia == NULL ? FCHECK_DIFF_INODE_ADDED : ib == NULL ? FCHECK_DIFF_INODE_REMOVED : FCHECK_DIFF_INODE;
+            c.inum = i;
+            c.before = ia;
+            c.after = ib;
+            diff_emit(d, &c);
+            if (ia != NULL && ib != NULL && ia->type == T_FILE && ib->type == T_FILE)
+                diff_data(d, i, ia, ib);
+        }
+        if (ia != NULL && ib != NULL && ia->type == T_DIR && ib->type == T_DIR && diff_dir(d, i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Compare the bitmaps over the blocks both images have, reporting each run
+// of blocks newly marked in use or free
+static void diff_bitmap(struct diff *d)
+{
+    struct fcheck_change c = {0, NONE, NONE, 0, 0, NULL, NULL, "", NONE};
+    uint n = d->a.sb->size < d->b.sb->size ? d->a.sb->size : d->b.sb->size;
+    uint blk, end, bit;
+    int kind;
+    uchar x;
+
+    for (blk = 0; blk < n; blk = end)
+    {
+        // A bitmap block's worth at once; bits only where it differs
+        end = n - blk > BPB ? blk + BPB : n;
+        if (memcmp(d->a.bitmap + blk / 8, d->b.bitmap + blk / 8, (end - blk) / 8) == 0 && (end - blk) % 8 == 0)
+            continue;
+        for (bit = blk; bit < end; bit++)
+        {
+            x = d->a.bitmap[bit / 8] ^ d->b.bitmap[bit / 8];
+            if (x == 0 && bit % 8 == 0)
+            {
+                bit += 7;
+                continue;
+            }
+            if (!(x >> (bit % 8) & 1))
+                continue;
+            kind = d->b.bitmap[bit / 8] >> (bit % 8) & 1 ? FCHECK_DIFF_ALLOCATED : FCHECK_DIFF_FREED;
+            if (c.count > 0 && (c.kind != kind || c.blk + c.count != bit))
+            {
+                diff_emit(d, &c);
+                c.count = 0;
+            }
+            if (c.count == 0)
+            {
+                c.kind = kind;
+                c.blk = bit;
+            }
+            c.count++;
+        }
+    }
+    if (c.count > 0)
+        diff_emit(d, &c);
+}
+
+int ENGINE(fcheck_diff)(const struct fcheck_source *a, const struct fcheck_source *b, const struct fcheck_opts *opts,
+                        void (*change)(void *ctx, const struct fcheck_change *c), void *ctx)
+{
+    struct fcheck_opts defaults = {0};
+    struct fcheck_change c = {FCHECK_DIFF_SUPERBLOCK, NONE, NONE, NONE, 0, NULL, NULL, "", NONE};
+    struct diff d;
+    int err = 0;
+
+    memset(&d, 0, sizeof(d));
+    d.opts = opts != NULL ? opts : &defaults;
+    d.change = change;
+    d.ctx = ctx;
+    if (setup_image(&d.a, a, d.opts) < 0 || setup_image(&d.b, b, d.opts) < 0)
+        return FCHECK_BADIMAGE;
+
+    if (memcmp(d.a.sb, d.b.sb, sizeof(*d.a.sb)) != 0)
+    {
+        c.before = d.a.sb;
+        c.after = d.b.sb;
+        diff_emit(&d, &c);
+    }
+    if (diff_inodes(&d) < 0)
+        err = FCHECK_NOMEM;
+    else
+        diff_bitmap(&d);
+    lib_free(d.opts, d.ents_a);
+    if (err == 0 && (read_result(&d.a) < 0 || read_result(&d.b) < 0))
+        err = FCHECK_IOERROR;
+    return err < 0 ? err : d.nchanges > 0;
+}
+
+unsigned ENGINE(fcheck_metadata_blocks)(const void *head)
+{
+    struct superblock sb;
+    uint last;
+
+    memcpy(&sb, (const char *)head + BLOCK_SIZE, sizeof(sb));
+    last = sb.size > 0 ? sb.size - 1 : 0; // (BBLOCK does not parenthesize b)
+    return BBLOCK(last, sb.ninodes) + 1;
+}
+
+#ifdef FRONT_END
+// --- Entry points ---
+//
+// Every call goes to the build of the engine for the image's block size.
+
+// Block sizes the engine is built for, smallest first; each build's entry
+// points carry its size (fcheck_check_source_1024, ...)
+#define GEOMETRIES(X) X(512) X(1024) X(4096)
+
+#define DECLARE(bsize)                                                                                              \
+    int fcheck_check_source_##bsize(const struct fcheck_source *src, const struct fcheck_opts *opts,               \
+                                    struct fcheck_report *report);                                                 \
+    int fcheck_check_indexed_##bsize(const struct fcheck_source *src, const struct fcheck_opts *opts,              \
+                                     const void *old, size_t old_len, struct fcheck_report *report,                \
+                                     struct fcheck_index *index);                                                  \
+    int fcheck_diff_##bsize(const struct fcheck_source *a, const struct fcheck_source *b,                          \
+                            const struct fcheck_opts *opts, void (*change)(void *ctx, const struct fcheck_change *c), \
+                            void *ctx);                                                                            \
+    unsigned fcheck_metadata_blocks_##bsize(const void *head);
+GEOMETRIES(DECLARE)
+#undef DECLARE
+
+// Block size of a source (0 is the classic 512 bytes)
+#define SOURCE_BSIZE(src) ((src)->bsize != 0 ? (src)->bsize : BSIZE)
+
+int fcheck_check_source(const struct fcheck_source *src, const struct fcheck_opts *opts, struct fcheck_report *report)
+{
+    switch (SOURCE_BSIZE(src))
+    {
+#define CALL(bsize) \
+    case bsize:     \
+        return fcheck_check_source_##bsize(src, opts, report);
+        GEOMETRIES(CALL)
+#undef CALL
+    }
+    memset(report, 0, sizeof(*report));
+    return FCHECK_BADIMAGE;
+}
+
+int fcheck_check_indexed(const struct fcheck_source *src, const struct fcheck_opts *opts, const void *old,
+                         size_t old_len, struct fcheck_report *report, struct fcheck_index *index)
+{
+    switch (SOURCE_BSIZE(src))
+    {
+#define CALL(bsize) \
+    case bsize:     \
+        return fcheck_check_indexed_##bsize(src, opts, old, old_len, report, index);
+        GEOMETRIES(CALL)
+#undef CALL
+    }
+    memset(report, 0, sizeof(*report));
+    memset(index, 0, sizeof(*index));
+    return FCHECK_BADIMAGE;
+}
+
+int fcheck_check(const void *image, size_t len, const struct fcheck_opts *opts, struct fcheck_report *report)
+{
+    struct fcheck_source src = {0};
+
+    // Blocks of the size the superblock fits (or the classic size if none
+    // does). Every whole block of the image is in memory; anything past it
+    // reads as zeroes.
+    src.bsize = fcheck_block_size(image, len, len);
+    if (src.bsize == 0)
+        src.bsize = BSIZE;
+    src.meta = image;
+    src.nmeta = len / src.bsize > (uint)-1 ? (uint)-1 : len / src.bsize;
+    return fcheck_check_source(&src, opts, report);
+}
+
+int fcheck_diff(const struct fcheck_source *a, const struct fcheck_source *b, const struct fcheck_opts *opts,
+                void (*change)(void *ctx, const struct fcheck_change *c), void *ctx)
+{
+    if (SOURCE_BSIZE(a) != SOURCE_BSIZE(b))
+        return FCHECK_BADIMAGE;
+    switch (SOURCE_BSIZE(a))
+    {
+#define CALL(bsize) \
+    case bsize:     \
+        return fcheck_diff_##bsize(a, b, opts, change, ctx);
+        GEOMETRIES(CALL)
+#undef CALL
+    }
+    return FCHECK_BADIMAGE;
+}
+
+unsigned fcheck_metadata_blocks_bsize(const void *head, unsigned bsize)
+{
+    switch (bsize)
+    {
+#define CALL(bsize) \
+    case bsize:     \
+        return fcheck_metadata_blocks_##bsize(head);
+        GEOMETRIES(CALL)
+#undef CALL
+    }
+    return 0;
+}
+
+unsigned fcheck_metadata_blocks(const void *head)
+{
+    return fcheck_metadata_blocks_bsize(head, BSIZE);
+}
+
+unsigned fcheck_block_size(const void *head, size_t len, unsigned long long image_len)
+{
+#define SIZE(bsize) bsize,
+    static const uint sizes[] = {GEOMETRIES(SIZE)};
+#undef SIZE
+    struct superblock sb;
+    uint k, bsize, nmeta;
+
+    // The first size whose superblock describes metadata that ends before
+    // its data blocks start, and inside the image
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        bsize = sizes[k];
+        if (len < 2 * (size_t)bsize)
+            break;
+        memcpy(&sb, (const char *)head + bsize, sizeof(sb));
+        nmeta = fcheck_metadata_blocks_bsize(head, bsize);
+        if (sb.ninodes != 0 && sb.nblocks < sb.size && nmeta <= sb.size - sb.nblocks &&
+            (image_len == 0 || (unsigned long long)nmeta * bsize <= image_len))
+            return bsize;
+    }
+    return 0;
+}
+
+void fcheck_index_free(const struct fcheck_opts *opts, struct fcheck_index *index)
+{
+    struct fcheck_opts defaults = {0};
+
+    lib_free(opts != NULL ? opts : &defaults, index->data);
+    index->data = NULL;
+    index->len = 0;
+}
+
+void fcheck_report_free(const struct fcheck_opts *opts, struct fcheck_report *report)
+{
+    struct fcheck_opts defaults = {0};
+
+    lib_free(opts != NULL ? opts : &defaults, report->findings);
+    report->findings = NULL;
+    report->nfindings = 0;
+}
+
+const char *fcheck_message(int err)
+{
+    if (err <= FCHECK_OK || err > FCHECK_DIR_CYCLE)
+        return "no error.";
+    return error_messages[err];
+}
+
+int fcheck_rule(int err)
+{
+    if (err <= FCHECK_OK || err > FCHECK_DIR_CYCLE)
+        return 0;
+    return error_rules[err];
+}
+#endif // FRONT_END
@@ -0,0 +1,334 @@
+// libfcheck: the fcheck consistency checker as a library.
+//
+// fcheck_check() checks an xv6 file system image that is already in memory.
+// It reads the caller's buffer in place, does no file I/O, never exits, and
+// takes all of its scratch memory from the caller's allocator (if given).
+
+#ifndef LIBFCHECK_H
+#define LIBFCHECK_H
+
+#include <stddef.h>
+
+// Violation codes, one per consistency rule violation
+enum
+{
+    FCHECK_OK = 0,         // no violation
+    FCHECK_BAD_INODE,      // Rule 1
+    FCHECK_BAD_DIRECT,     // Rule 2 (direct address)
+    FCHECK_BAD_INDIRECT,   // Rule 2 (indirect address)
+    FCHECK_NO_ROOT,        // Rule 3
+    FCHECK_DIR_FORMAT,     // Rule 4
+    FCHECK_BITMAP_FREE,    // Rule 5
+    FCHECK_BITMAP_USED,    // Rule 6
+    FCHECK_DIRECT_TWICE,   // Rule 7
+    FCHECK_INDIRECT_TWICE, // Rule 8
+    FCHECK_NOT_IN_DIR,     // Rule 9
+    FCHECK_REF_FREE,       // Rule 10
+    FCHECK_BAD_REFCOUNT,   // Rule 11
+    FCHECK_DIR_TWICE,      // Rule 12
+    FCHECK_UNREACHABLE,    // Rule 13 (inode in use not reachable from the root)
+    FCHECK_DIR_CYCLE,      // Rule 13 (directory that is its own ancestor)
+};
+
+// Return values of fcheck_check() and fcheck_check_source()
+#define FCHECK_CLEAN 0       // the image is consistent
+#define FCHECK_VIOLATIONS 1  // at least one rule is violated (see the report)
+#define FCHECK_BADIMAGE (-1) // too short for the inode table and bitmap its superblock describes,
+                             // a superblock that describes no disk (no blocks, more data blocks
+                             // than blocks, or data blocks over the metadata), or of a block
+                             // size there is no engine for
+#define FCHECK_NOMEM (-2)    // the allocator failed, or mem_limit is too small
+#define FCHECK_IOERROR (-3)  // the spill store failed, or the source could not read a block
+
+// Marks a finding that has no inode or block attached
+#define FCHECK_NONE ((unsigned)-1)
+
+// Where an inode holds a block: addrs[0..11] are slots 0-11, the indirect
+// block itself is FCHECK_SLOT_INDIRECT and its entry k is FCHECK_SLOT_ENTRY(k)
+#define FCHECK_SLOT_INDIRECT 12
+#define FCHECK_SLOT_ENTRY(k) (13 + (k))
+
+// One rule violation found in the image
+struct fcheck_finding
+{
+    int err;             // FCHECK_* violation code
+    unsigned inum;       // inode the violation was found in (or FCHECK_NONE)
+    unsigned blk;        // block involved (or FCHECK_NONE)
+    unsigned slot;       // where inum holds blk, for Rules 2, 5, 7, 8 (or FCHECK_NONE)
+    unsigned owner;      // Rules 7, 8: inode that claimed blk first (or FCHECK_NONE)
+    unsigned owner_slot; // where the owner holds blk (or FCHECK_NONE)
+};
+
+// Phases of a full check, as passed to fcheck_opts.phase
+enum
+{
+    FCHECK_PHASE_SCAN,   // inode scan: Rules 1, 2, 7, 8 (and 5 per block in a replay)
+    FCHECK_PHASE_BITMAP, // bitmap compares: Rules 5, 6
+    FCHECK_PHASE_DIRS,   // directory sweep
+    FCHECK_PHASE_ROOT,   // Rule 3
+    FCHECK_PHASE_RULES,  // Rules 4, 9-12 from the sweep's bookkeeping
+    FCHECK_PHASE_REACH,  // Rule 13: the walk from the root
+    FCHECK_PHASE_QUICK,  // the quick check (fcheck_opts.quick)
+    FCHECK_NPHASES
+};
+
+// Work done by a check. Every field is a counter; the inode scan is counted
+// again if it was replayed to pin down violations, as is a quick check that
+// fell back to the full one.
+struct fcheck_stats
+{
+    unsigned long long inodes_free;      // inodes visited by the scan, by type
+    unsigned long long inodes_dir;
+    unsigned long long inodes_file;
+    unsigned long long inodes_dev;
+    unsigned long long inodes_bad;       // of an invalid type
+    unsigned long long direct_addrs;     // direct block addresses followed
+    unsigned long long indirect_blocks;  // indirect blocks read by the scan
+    unsigned long long indirect_addrs;   // block addresses followed in them
+    unsigned long long dir_blocks;       // directory blocks read by the sweep
+    unsigned long long dirents;          // directory entries in use examined
+    unsigned long long blocks_read;      // blocks read past the metadata
+    unsigned long long bytes_touched;    // superblock, inode table, bitmap and blocks read
+    unsigned long long spill_runs;       // sorted runs written to the spill store
+    unsigned long long spill_bytes;      // bytes written to it
+};
+
+// Bit for Rule n (1-13) in fcheck_opts.rules
+#define FCHECK_RULE(n) (1u << (n))
+#define FCHECK_ALL_RULES (((1u << 13) - 1) & ~1u)
+
+// Rule 13, checked only when selected: every inode in use is reachable from
+// the root directory, and no directory is its own ancestor. Rule 9 accepts an
+// inode listed by any directory, even one cut off from the tree; this walks
+// the tree from the root (with nthreads walkers) and reports the top of each
+// orphaned subtree (FCHECK_UNREACHABLE) and each directory cycle
+// (FCHECK_DIR_CYCLE, at its lowest-numbered directory). A full check with it
+// selects FCHECK_ALL_RULES | FCHECK_REACH.
+#define FCHECK_REACH FCHECK_RULE(13)
+
+// How the inode scan tracks which blocks are held (fcheck_opts.engine).
+// The bitmap engine sets a bit per block in an ownership bitset; the sort
+// engine collects (block, inode, slot) tuples, radix-sorts them by block and
+// finds blocks held twice and the bitmap mismatches in one merge with the
+// on-disk bitmap. The sort engine reads and writes memory only in sequence,
+// so it wins once the bitset no longer fits in the cache; it works on one
+// thread. Auto picks it for such images when the tuples take less memory
+// than the bitset.
+enum
+{
+    FCHECK_ENGINE_AUTO,
+    FCHECK_ENGINE_BITMAP,
+    FCHECK_ENGINE_SORT,
+};
+
+// Temporary files for the sort engine's sorted runs, when they do not fit
+// under fcheck_opts.mem_limit. open creates an empty file (NULL on failure),
+// write appends `len` bytes to it, read fetches `len` bytes at byte offset
+// `off`, and close discards it. write and read return 0, or -1 on failure.
+struct fcheck_spill
+{
+    void *(*open)(void *ctx);
+    int (*write)(void *ctx, void *file, const void *buf, size_t len);
+    int (*read)(void *ctx, void *file, unsigned long long off, void *buf, size_t len);
+    void (*close)(void *ctx, void *file);
+    void *ctx;
+};
+
+// How to check an image. A zeroed struct gives the classic behaviour:
+// every rule, stop at the first violation, one thread, malloc/free.
+struct fcheck_opts
+{
+    int all;        // keep going after the first violation and record them all
+    int nthreads;   // threads for the inode scan (0 or 1: none)
+    unsigned rules; // FCHECK_RULE() bits of the rules to check (0: all). Only
+                    // the passes those rules depend on are run.
+    int prefetch;   // how many inodes ahead the inode scan (and directories
+                    // ahead the sweep) prefetches blocks: 0 for the default,
+                    // negative for none
+    int quick;      // accept the image as clean if its cheap totals agree
+                    // (see fcheck_check_source()); ignored with `all`, or
+                    // with `rules` other than FCHECK_ALL_RULES
+    int engine;     // FCHECK_ENGINE_* (Rules 5-8)
+
+    // Most bytes of scratch memory a check may hold at once (0: no limit).
+    // Everything the check allocates counts, except the report's findings.
+    // Past the limit, block ownership goes to the sort engine, whose tuples
+    // are written out as sorted runs through `spill` (if given) and merged
+    // back in block order; the bitset, a -j scan and the quick check are
+    // only used if they fit. The per-inode bookkeeping (about 20 bytes an
+    // inode) must fit. No index is used or produced under a limit.
+    size_t mem_limit;
+    const struct fcheck_spill *spill;
+
+    // Scratch allocator. alloc returns `size` bytes aligned like malloc()
+    // (or NULL); release frees them. With alloc NULL, malloc/free are used;
+    // with only release NULL, nothing is freed (e.g. an arena).
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr);
+    void *ctx;
+
+    // Instrumentation, all optional. A check fills in *stats, and calls
+    // phase(phase_ctx, p) as each phase p starts (a phase may be entered more
+    // than once) and with FCHECK_NPHASES when it is done.
+    struct fcheck_stats *stats;
+    void (*phase)(void *ctx, int phase);
+    void *phase_ctx;
+
+    // Findings as they are made, optional. finding(finding_ctx, f) is called
+    // for each violation as it is recorded, in report order, from the thread
+    // that called the check: for the first one only, or for every one with
+    // `all`. The report then keeps no findings array (nfindings still counts
+    // them), so nothing is buffered however many there are.
+    void (*finding)(void *ctx, const struct fcheck_finding *f);
+    void *finding_ctx;
+};
+
+// What was found. The findings array is only filled in with opts.all (and
+// no opts.finding) and comes from the options' allocator; free it with
+// fcheck_report_free().
+struct fcheck_report
+{
+    int first;                       // first violation (FCHECK_OK if none)
+    struct fcheck_finding *findings; // every violation, in the order found
+    unsigned nfindings;
+};
+
+// Where fcheck_check_source() reads an image from. Its blocks are bsize
+// bytes: 512 (the classic xv6 size, also meant by 0), 1024 or 4096, each
+// checked by an engine built for that size. Blocks 0 .. nmeta-1 (at least
+// the boot block, superblock, inode table and bitmap) are in memory at
+// `meta`. Any other block is fetched with read_block, which returns its
+// bsize bytes either in place or copied into `buf`, or NULL if it cannot be
+// read (the check then returns FCHECK_IOERROR); if read_block is NULL,
+// blocks past nmeta read as zeroes. read_block may be called from several
+// threads at once when nthreads > 1.
+//
+// prefetch, if not NULL, is told of a block that will be read soon (in
+// memory or not), so it can start bringing it in; it may be called from
+// several threads too. Blocks in memory are also prefetched into the CPU
+// cache.
+//
+// hole, if not NULL, says whether a block lies in a hole of a sparse image
+// (and so reads as zeroes). Such a block is neither read nor prefetched,
+// even in memory, and the inodes of an inode table block in a hole are
+// taken as free without being looked at. It may be called from several
+// threads.
+struct fcheck_source
+{
+    const void *meta;
+    unsigned nmeta;
+    const void *(*read_block)(void *ctx, unsigned blk, void *buf);
+    void (*prefetch)(void *ctx, unsigned blk);
+    int (*hole)(void *ctx, unsigned blk);
+    void *ctx;
+    unsigned bsize;
+};
+
+// Check the `len`-byte image at `image`, of the block size fcheck_block_size()
+// finds (512 bytes if none fits). Returns one of the FCHECK_CLEAN,
+// FCHECK_VIOLATIONS, FCHECK_BADIMAGE, FCHECK_NOMEM or FCHECK_IOERROR values above.
+int fcheck_check(const void *image, size_t len, const struct fcheck_opts *opts, struct fcheck_report *report);
+
+// Same, reading the image through `src`.
+//
+// With opts.quick, a cheap pass runs first. It checks every inode's type and
+// block addresses (Rules 1, 2, 7, 8) and the root directory (Rule 3), and
+// compares the number of blocks held by inodes with the number of data
+// blocks the bitmap marks in use. If those agree the image is taken as clean,
+// which is only probably right: the directory rules (4, 9-12) are not
+// checked, and a block in use but marked free can cancel out one marked in
+// use but not held. Otherwise the full check runs and reports as usual.
+int fcheck_check_source(const struct fcheck_source *src, const struct fcheck_opts *opts, struct fcheck_report *report);
+
+// An index of a clean image for fcheck_check_indexed(). It is a flat
+// block of bytes, meant to be saved next to the image (a "sidecar").
+struct fcheck_index
+{
+    void *data; // from the options' allocator; free with fcheck_index_free()
+    size_t len;
+};
+
+// Same as fcheck_check_source(), using the index `old` (old_len bytes) of an
+// earlier clean check of the image, if it matches. Only the inodes and
+// bitmap blocks that changed since then are examined again. If the image is
+// clean, `index` receives an index to save for next time, or stays empty if
+// `old` is still current. Pass old = NULL to check in full and get a first index.
+// With any rules selected but FCHECK_ALL_RULES the index is neither used nor produced.
+int fcheck_check_indexed(const struct fcheck_source *src, const struct fcheck_opts *opts, const void *old,
+                         size_t old_len, struct fcheck_report *report, struct fcheck_index *index);
+
+// Free an index returned with `opts`
+void fcheck_index_free(const struct fcheck_opts *opts, struct fcheck_index *index);
+
+// Kinds of difference between two images (fcheck_change.kind)
+enum
+{
+    FCHECK_DIFF_SUPERBLOCK,    // the superblocks differ (before, after: struct superblock)
+    FCHECK_DIFF_INODE_ADDED,   // inode `inum` is in use in b only (after: its struct dinode)
+    FCHECK_DIFF_INODE_REMOVED, // inode `inum` is in use in a only (before)
+    FCHECK_DIFF_INODE,         // inode `inum` is in use in both and differs (before, after)
+    FCHECK_DIFF_DATA,          // the data block at `slot` of file `inum` differs
+    FCHECK_DIFF_ENTRY_ADDED,   // directory `inum` has an entry `name` for `target` in b only
+    FCHECK_DIFF_ENTRY_REMOVED, // ... in a only
+    FCHECK_DIFF_ALLOCATED,     // the bitmap marks blocks blk .. blk+count-1 in use in b only
+    FCHECK_DIFF_FREED,         // ... in a only
+};
+
+// One difference found by fcheck_diff(). Pointers are valid during the call.
+struct fcheck_change
+{
+    int kind;            // FCHECK_DIFF_*
+    unsigned inum;       // inode (for an entry, its directory), or FCHECK_NONE
+    unsigned slot;       // FCHECK_DIFF_DATA: where the file holds the block (as in fcheck_finding)
+    unsigned blk, count; // FCHECK_DIFF_ALLOCATED, FCHECK_DIFF_FREED: the run of blocks
+    const void *before;  // the superblock or inode in image a (NULL if none)
+    const void *after;   // the same in image b
+    char name[15];       // entries: the name (DIRSIZ characters at most)
+    unsigned target;     // entries: the inode it names
+};
+
+// Compare image `b` with image `a` and call change(ctx, c) for each
+// difference, in order: the superblock, then inode by inode (the inode, its
+// data blocks, its directory entries), then the bitmap as runs of blocks.
+// Inode-table and bitmap blocks are compared whole and only looked into
+// where they differ. A file's data blocks are compared only if its inode
+// differs; every directory in use in both is compared block by block, as
+// entries change in place, and its entries are matched by name where a
+// block differs. Images of different sizes are compared as far as both go;
+// both must have the same block size.
+// Returns 0 if nothing differs, 1 if something does, or FCHECK_BADIMAGE,
+// FCHECK_NOMEM or FCHECK_IOERROR. Only the allocator of `opts` (which may
+// be NULL) is used.
+int fcheck_diff(const struct fcheck_source *a, const struct fcheck_source *b, const struct fcheck_opts *opts,
+                void (*change)(void *ctx, const struct fcheck_change *c), void *ctx);
+
+// Number of blocks from the start of an image through the end of its
+// bitmap, given the image's first two blocks (boot block and superblock),
+// for 512-byte blocks or for blocks of `bsize` bytes (0 if there is no
+// engine for that size)
+unsigned fcheck_metadata_blocks(const void *head);
+unsigned fcheck_metadata_blocks_bsize(const void *head, unsigned bsize);
+
+// Bytes from the start of an image that fcheck_block_size() needs to try
+// every block size: the boot block and superblock of the largest
+#define FCHECK_HEAD_BYTES (2 * 4096)
+
+// The block size of an image, judged by its superblock, given its first
+// `len` bytes (FCHECK_HEAD_BYTES, or the whole of a shorter image) and its
+// length in bytes (0 if not known). xv6 does not record the block size; the
+// superblock sits at the start of block 1, so each size reads it from a
+// different place. Returns the first of 512, 1024 and 4096 whose superblock
+// describes an inode table and bitmap that end before its data blocks start
+// (and inside the image), or 0 if none does.
+unsigned fcheck_block_size(const void *head, size_t len, unsigned long long image_len);
+
+// Free the findings of a report filled in with `opts`
+void fcheck_report_free(const struct fcheck_opts *opts, struct fcheck_report *report);
+
+// The classic fcheck message for a violation code ("ERROR: bad inode.")
+const char *fcheck_message(int err);
+
+// The rule (1-13) a violation code belongs to
+int fcheck_rule(int err);
+
+#endif // LIBFCHECK_H
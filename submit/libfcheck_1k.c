@@ -0,0 +1,4 @@
+// libfcheck's engine for xv6 file systems with 1 KB blocks (see libfcheck.c)
+
+#define BSIZE 1024
+#include "libfcheck.c"
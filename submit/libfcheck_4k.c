@@ -0,0 +1,4 @@
+// libfcheck's engine for xv6 file systems with 4 KB blocks (see libfcheck.c)
+
+#define BSIZE 4096
+#include "libfcheck.c"
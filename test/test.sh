@@ -5,11 +5,12 @@ SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" &> /dev/null && pwd)"
 
 # Define paths relative to the script
 SRC_FILE="$SCRIPT_DIR/../submit/fcheck.c"
+LIB_FILES=("$SCRIPT_DIR/../submit/libfcheck.c" "$SCRIPT_DIR/../submit/libfcheck_1k.c" "$SCRIPT_DIR/../submit/libfcheck_4k.c")
 EXEC_FILE="$SCRIPT_DIR/fcheck"
 
 # Compile the program
 echo "Compiling..."
-gcc "$SRC_FILE" -o "$EXEC_FILE" -Wall -Werror -O -std=gnu11
+gcc "$SRC_FILE" "${LIB_FILES[@]}" -o "$EXEC_FILE" -Wall -Werror -O -std=gnu11 -pthread
 if [ $? -ne 0 ]; then
     echo "Compilation failed. Checked path: $SRC_FILE"
     exit 1
@@ -33,6 +34,8 @@ rule_messages=(
     ["10"]="ERROR: inode referred to in directory but marked free."
     ["11"]="ERROR: bad reference count for file."
     ["12"]="ERROR: directory appears more than once in file system."
+    ["13a"]="ERROR: inode not reachable from the root directory."
+    ["13b"]="ERROR: directory cycle in file system."
     ["GOOD"]="" # Special ID for good cases
 )
 
@@ -65,49 +68,549 @@ test_rules=(
     ["goodrm"]="GOOD"
 )
 
-# 3. Run Tests
+# 3. Extra option sets; every image must give the same result under each
+modes=(
+    ""
+    "-j 4"
+    "--all"
+    "--io=stream"
+    "--io=stream -j 4"
+    "--engine=sort"
+    "--engine=sort --all"
+    "--engine=sort --mem-limit=40K"
+    "--engine=sort --all --mem-limit=40K"
+)
+
+# 4. Run Tests
+for mode in "${modes[@]}"; do
+    if [ -n "$mode" ]; then
+        echo "Mode: $mode"
+    fi
+    for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+        test_file="$SCRIPT_DIR/$test_name"
+        rule_id="${test_rules[$test_name]}"
+        expected="${rule_messages[$rule_id]}"
+        display_rule=${rule_id//[a-z]/} 
+
+        if [ ! -f "$test_file" ]; then
+            echo "WARNING: Test file $test_file not found. Skipping."
+            continue
+        fi
+
+        # Run fcheck using the absolute path
+        output=$("$EXEC_FILE" $mode "$test_file" 2>&1)
+        exit_code=$?
+        test_passed=false
+
+        # --all prints a report; its first finding must be the default error
+        if [[ "$mode" == *--all* ]]; then
+            output=$(echo "$output" | head -n 1 | sed 's/ \[rule .*//')
+        fi
+
+        # Logic for GOOD cases
+        if [ "$rule_id" == "GOOD" ]; then
+            if [ $exit_code -eq 0 ] && [ -z "$output" ]; then
+                test_passed=true
+            fi
+        # Logic for ERROR cases
+        else
+            if [ $exit_code -eq 1 ] && [ "$output" == "$expected" ]; then
+                test_passed=true
+            fi
+        fi
+
+        # Output Result
+        if [ "$test_passed" = true ]; then
+            echo -e "PASS: $test_name"
+        else
+            echo -e "FAIL: $test_name"
+            
+            # Only print details if it's a BAD image failure (as requested)
+            if [ "$rule_id" != "GOOD" ]; then
+                echo "   Rule:     #$display_rule"
+                echo "   Expected: '$expected'"
+                echo "   Actual:   '$output'"
+            fi
+            # Good images failing print nothing extra, just "FAIL: test_name"
+        fi
+    done
+done
+
+# A block used twice names both inodes and the slot each holds it in
+echo "Mode: owners"
+owners=(
+    "addronce|${rule_messages[7]} [rule 7, inode 6, block 50 (direct 0), first used by inode 3 (direct 8)]"
+    "addronce2|${rule_messages[8]} [rule 8, inode 17, block 387 (indirect 7), first used by inode 16 (indirect 56)]"
+)
+for entry in "${owners[@]}"; do
+    test_name="${entry%%|*}"
+    expected="${entry#*|}"
+    for mode in "--all" "--engine=sort --all" "--engine=sort --all --mem-limit=40K" "--io=stream --all" "-j 4 --all"; do
+        output=$("$EXEC_FILE" $mode "$SCRIPT_DIR/$test_name" 2>&1 | head -n 1)
+        if [ "$output" == "$expected" ]; then
+            echo "PASS: $test_name $mode"
+        else
+            echo "FAIL: $test_name $mode"
+            echo "   Expected: '$expected'"
+            echo "   Actual:   '$output'"
+        fi
+    done
+done
+
+# 5. Batch mode: all images in one process, one result line per image
+echo "Mode: batch"
+test_files=()
+for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+    test_files+=("$SCRIPT_DIR/$test_name")
+done
+while IFS= read -r line; do
+    test_name=$(basename "${line%%: *}")
+    expected="${rule_messages[${test_rules[$test_name]}]}"
+    if [ -z "$expected" ]; then
+        expected="OK"
+    fi
+    if [ "${line#*: }" == "$expected" ]; then
+        echo "PASS: $test_name"
+    else
+        echo "FAIL: $test_name"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '${line#*: }'"
+    fi
+done < <("$EXEC_FILE" -j 4 "${test_files[@]}")
+
+# 6. Fingerprint index: index a clean image of the same size, then check each
+# image against that index (the incremental check must agree with the full one).
+# badroot2, mismatch, dironce and badrefcnt2 rewrite directory entries in
+# place, in directories whose inodes (and inode-table blocks) are as in the
+# base image: the index trusts such blocks, so they are checked without one.
+declare -A rewritten_in_place=(["badroot2"]=1 ["mismatch"]=1 ["dironce"]=1 ["badrefcnt2"]=1)
+echo "Mode: --index"
+index_dir=$(mktemp -d)
+for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+    base="good"
+    if [ "$(stat -c %s "$SCRIPT_DIR/$test_name")" != "$(stat -c %s "$SCRIPT_DIR/good")" ]; then
+        base="goodlarge"
+    fi
+    rm -f "$index_dir/index"
+    [ -n "${rewritten_in_place[$test_name]}" ] || "$EXEC_FILE" --index="$index_dir/index" "$SCRIPT_DIR/$base" 2>&1
+    expected="${rule_messages[${test_rules[$test_name]}]}"
+    output=$("$EXEC_FILE" --index="$index_dir/index" "$SCRIPT_DIR/$test_name" 2>&1)
+    if [ "$output" == "$expected" ] && { [ -s "$index_dir/index" ] || [ -n "${rewritten_in_place[$test_name]}" ]; }; then
+        echo "PASS: $test_name"
+    else
+        echo "FAIL: $test_name"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
+    fi
+done
+# Under a memory limit the index is neither used nor written, and that is said
+rm -f "$index_dir/index"
+output=$("$EXEC_FILE" --index="$index_dir/index" --mem-limit=64K "$SCRIPT_DIR/badinode" 2>&1)
+if [ "$output" == "warning: --index is ignored under --mem-limit."$'\n'"${rule_messages[1]}" ] && [ ! -e "$index_dir/index" ]; then
+    echo "PASS: --index --mem-limit"
+else
+    echo "FAIL: --index --mem-limit"
+    echo "   Actual: '$output'"
+fi
+rm -rf "$index_dir"
+
+# 7. Rule selection: checking only an image's own rule finds the same error,
+# and a clean image stays clean under the structural and bitmap rules alone,
+# with one thread or several
+for mode in "" "-j 4"; do
+    echo "Mode: --rules${mode:+ $mode}"
+    for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+        rule_id="${test_rules[$test_name]}"
+        expected="${rule_messages[$rule_id]}"
+        rules=${rule_id//[a-z]/}
+        if [ "$rule_id" == "GOOD" ]; then
+            rules="1-3,5,6"
+        fi
+        output=$("$EXEC_FILE" $mode --rules="$rules" "$SCRIPT_DIR/$test_name" 2>&1)
+        if [ "$output" == "$expected" ]; then
+            echo "PASS: $test_name"
+        else
+            echo "FAIL: $test_name"
+            echo "   Expected: '$expected'"
+            echo "   Actual:   '$output'"
+        fi
+    done
+done
+
+# 8. Statistics: the check's verdict is unchanged and one JSON object goes to stdout
+echo "Mode: --stats=json"
+for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+    expected="${rule_messages[${test_rules[$test_name]}]}"
+    output=$("$EXEC_FILE" --stats=json "$SCRIPT_DIR/$test_name" 2>&1 >/dev/null)
+    stats=$("$EXEC_FILE" --stats=json "$SCRIPT_DIR/$test_name" 2>/dev/null)
+    if [ "$output" == "$expected" ] && [[ "$stats" == '{"image":'*'"bytes_touched":'*'}' ]] &&
+       [ "$(echo "$stats" | wc -l)" -eq 1 ]; then
+        echo "PASS: $test_name"
+    else
+        echo "FAIL: $test_name"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
+    fi
+done
+
+# 9. Quick check: clean images pass it, and it never hides a block or inode
+# violation (the directory rules are not part of it)
+echo "Mode: --quick"
 for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
-    test_file="$SCRIPT_DIR/$test_name"
     rule_id="${test_rules[$test_name]}"
+    case "${rule_id//[a-z]/}" in
+        4|9|10|11|12) continue ;;
+    esac
     expected="${rule_messages[$rule_id]}"
-    display_rule=${rule_id//[a-z]/} 
+    output=$("$EXEC_FILE" --quick "$SCRIPT_DIR/$test_name" 2>&1)
+    if [ "$output" == "$expected" ]; then
+        echo "PASS: $test_name"
+    else
+        echo "FAIL: $test_name"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
+    fi
+done
 
-    if [ ! -f "$test_file" ]; then
-        echo "WARNING: Test file $test_file not found. Skipping."
-        continue
+# 10. Reachability (Rule 13): nothing changes on the images above, and the
+# cycle in dircycle, which Rules 1-12 accept, is found with any number of walkers
+declare -A reach_rules
+reach_rules=(["dircycle"]="13b")
+for mode in "--reach" "--reach -j 4"; do
+    echo "Mode: $mode"
+    for test_name in $(echo "${!test_rules[@]}" dircycle | tr ' ' '\n' | sort); do
+        rule_id="${test_rules[$test_name]:-${reach_rules[$test_name]}}"
+        expected="${rule_messages[$rule_id]}"
+        output=$("$EXEC_FILE" $mode "$SCRIPT_DIR/$test_name" 2>&1)
+        if [ "$output" == "$expected" ] && [ -z "$("$EXEC_FILE" "$SCRIPT_DIR/dircycle" 2>&1)" ]; then
+            echo "PASS: $test_name"
+        else
+            echo "FAIL: $test_name"
+            echo "   Expected: '$expected'"
+            echo "   Actual:   '$output'"
+        fi
+    done
+done
+
+# An unreached directory numbered above 0xFFFF (inode 70000, in a table of
+# 70008) lists directory 4464, its low 16 bits: one orphaned subtree topped
+# by 70000, not a cycle at 4464. Built by hand, 512-byte blocks: inodes from
+# block 2, data from block 8757.
+le() {
+    local i s=""
+    for ((i = 0; i < $1; i++)); do s+=$(printf '\\x%02x' $((($2 >> (8 * i)) & 255))); done
+    printf "$s"
+}
+put() {
+    le "$3" "$4" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+far_image=$(mktemp)
+truncate -s $((9000 * 512)) "$far_image"
+put "$far_image" 512 4 9000; put "$far_image" 516 4 243; put "$far_image" 520 4 70008
+for spec in "1 8757 1 1" "4464 0" "70000 8758 70000 70000 4464"; do
+    set -- $spec
+    put "$far_image" $((1024 + $1 * 64)) 2 1  # T_DIR
+    put "$far_image" $((1024 + $1 * 64 + 6)) 2 1
+    if [ "$2" -ne 0 ]; then
+        put "$far_image" $((1024 + $1 * 64 + 8)) 4 $((($# - 2) * 16))
+        put "$far_image" $((1024 + $1 * 64 + 12)) 4 "$2"
+        for ((k = 3; k <= $#; k++)); do
+            put "$far_image" $(($2 * 512 + (k - 3) * 16)) 2 "${!k}"
+            name=(. .. d)
+            printf '%s' "${name[k - 3]}" | dd of="$far_image" bs=1 seek=$(($2 * 512 + (k - 3) * 16 + 2)) conv=notrunc 2> /dev/null
+        done
+    fi
+done
+expected="${rule_messages[13a]} [rule 13, inode 70000]"
+for mode in "--rules=13 --all" "--rules=13 --all -j 4"; do
+    output=$("$EXEC_FILE" $mode "$far_image" 2>&1 | grep "rule 13")
+    if [ "$output" == "$expected" ]; then
+        echo "PASS: far parent $mode"
+    else
+        echo "FAIL: far parent $mode"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
     fi
+done
+rm -f "$far_image"
 
-    # Run fcheck using the absolute path
-    output=$("$EXEC_FILE" "$test_file" 2>&1)
-    exit_code=$?
-    test_passed=false
+# 11. Sparse images: copies with their zero blocks punched out as holes give
+# the same results, mapped and streamed, though the holes are never read
+sparse_dir=$(mktemp -d)
+for mode in "" "--io=stream" "--all"; do
+    echo "Mode: sparse${mode:+ $mode}"
+    for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+        [ -f "$sparse_dir/$test_name" ] || cp --sparse=always "$SCRIPT_DIR/$test_name" "$sparse_dir/$test_name"
+        expected=$("$EXEC_FILE" $mode "$SCRIPT_DIR/$test_name" 2>&1)
+        output=$("$EXEC_FILE" $mode "$sparse_dir/$test_name" 2>&1)
+        if [ "$output" == "${expected//$SCRIPT_DIR/$sparse_dir}" ]; then
+            echo "PASS: $test_name"
+        else
+            echo "FAIL: $test_name"
+            echo "   Expected: '$expected'"
+            echo "   Actual:   '$output'"
+        fi
+    done
+done
+rm -rf "$sparse_dir"
 
-    # Logic for GOOD cases
-    if [ "$rule_id" == "GOOD" ]; then
-        if [ $exit_code -eq 0 ] && [ -z "$output" ]; then
-            test_passed=true
+# 12. Compressed images: gzip (and zstd, where installed) copies give the
+# same results, and an archive cut short is refused rather than checked; a
+# consistent image with more than a read's worth (1 MB) of metadata is clean,
+# also when most of the blocks kept for the check go to the spill file
+packed_dir=$(mktemp -d)
+tools="gzip"
+command -v zstd > /dev/null && tools="$tools zstd"
+gcc "$SCRIPT_DIR/../bench/mkimage.c" -o "$packed_dir/mkimage" -Wall -Werror -O -std=gnu11 &&
+"$packed_dir/mkimage" -s 4 -n 20000 -x 0 "$packed_dir/manyinodes" > /dev/null
+for tool in $tools; do
+    for mode in "" "--all"; do
+        echo "Mode: $tool${mode:+ $mode}"
+        for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+            [ -f "$packed_dir/$test_name.$tool" ] || "$tool" -c < "$SCRIPT_DIR/$test_name" > "$packed_dir/$test_name.$tool"
+            expected=$("$EXEC_FILE" $mode "$SCRIPT_DIR/$test_name" 2>&1)
+            output=$("$EXEC_FILE" $mode "$packed_dir/$test_name.$tool" 2>&1)
+            if [ "$output" == "${expected//$SCRIPT_DIR\/$test_name/$packed_dir/$test_name.$tool}" ]; then
+                echo "PASS: $test_name"
+            else
+                echo "FAIL: $test_name"
+                echo "   Expected: '$expected'"
+                echo "   Actual:   '$output'"
+            fi
+        done
+    done
+    head -c 400 "$packed_dir/good.$tool" > "$packed_dir/cut.$tool"
+    output=$("$EXEC_FILE" "$packed_dir/cut.$tool" 2>&1)
+    if [ $? -eq 1 ] && [ "$output" == "cannot decompress image." ]; then
+        echo "PASS: cut.$tool"
+    else
+        echo "FAIL: cut.$tool"
+        echo "   Actual: '$output'"
+    fi
+    "$tool" -c < "$packed_dir/manyinodes" > "$packed_dir/manyinodes.$tool"
+    for mode in "" "--mem-limit=400K"; do
+        output=$("$EXEC_FILE" $mode "$packed_dir/manyinodes.$tool" 2>&1)
+        if [ $? -eq 0 ] && [ -z "$output" ]; then
+            echo "PASS: manyinodes.$tool${mode:+ $mode}"
+        else
+            echo "FAIL: manyinodes.$tool${mode:+ $mode}"
+            echo "   Actual: '$output'"
         fi
-    # Logic for ERROR cases
+    done
+done
+rm -rf "$packed_dir"
+
+# 13. JSON output: one finding record per violation --all prints, with the
+# same rules and inodes in the same order, then one summary record; nothing
+# goes to stderr. Batch mode gives a summary per image, in input order. A
+# path keeps its UTF-8 and shows each byte that is not UTF-8 as U+FFFD.
+echo "Mode: --format=json"
+for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+    text=$("$EXEC_FILE" --all "$SCRIPT_DIR/$test_name" 2>&1)
+    json=$("$EXEC_FILE" --all --format=json "$SCRIPT_DIR/$test_name" 2>&1)
+    expected=$(echo "$text" | sed -n 's/.*\[rule \([0-9]*\), inode \([0-9]*\).*/\1 \2/p; s/.*\[rule \([0-9]*\)[],].*/\1/p')
+    output=$(echo "$json" | sed -n 's/^{"type":"finding",.*"rule":\([0-9]*\),.*"inode":\([0-9]*\),.*/\1 \2/p; s/^{"type":"finding",.*"rule":\([0-9]*\),.*"inode":null,.*/\1/p')
+    if [ -z "${rule_messages[${test_rules[$test_name]}]}" ]; then
+        summary='"status":"ok"}'
+    else
+        summary='"status":"violations",'*
+    fi
+    if [ "$output" == "$expected" ] && [[ "$(echo "$json" | tail -n 1)" == '{"type":"summary","image":'*$summary ]] &&
+       [ "$(echo "$json" | grep -vc '^{"type":"finding",')" -eq 1 ]; then
+        echo "PASS: $test_name"
+    else
+        echo "FAIL: $test_name"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
+    fi
+done
+echo "Mode: batch --format=json"
+expected=$(for test_file in "${test_files[@]}"; do echo "$test_file"; done)
+output=$("$EXEC_FILE" -j 4 --format=json "${test_files[@]}" | sed -n 's/^{"type":"summary","image":"\([^"]*\)".*/\1/p')
+if [ "$output" == "$expected" ]; then
+    echo "PASS: batch"
+else
+    echo "FAIL: batch"
+    echo "   Expected: '$expected'"
+    echo "   Actual:   '$output'"
+fi
+json_dir=$(mktemp -d)
+cp "$SCRIPT_DIR/good" "$json_dir/$(printf 'caf\xc3\xa9\xff\xc3')"
+expected="{\"type\":\"summary\",\"image\":\"$json_dir/café\\ufffd\\ufffd\",\"status\":\"ok\"}"
+output=$("$EXEC_FILE" --format=json "$json_dir"/caf* 2>&1)
+if [ "$output" == "$expected" ]; then
+    echo "PASS: non-UTF-8 path"
+else
+    echo "FAIL: non-UTF-8 path"
+    echo "   Expected: '$expected'"
+    echo "   Actual:   '$output'"
+fi
+rm -rf "$json_dir"
+
+# 14. Diff: every image matches itself, and a changed inode, its data and
+# the bitmap are listed as such (both ways round), from gzip copies too
+echo "Mode: diff"
+packed_dir=$(mktemp -d)
+for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+    output=$("$EXEC_FILE" diff "$SCRIPT_DIR/$test_name" "$SCRIPT_DIR/$test_name" 2>&1)
+    if [ $? -eq 0 ] && [ -z "$output" ]; then
+        echo "PASS: $test_name"
+    else
+        echo "FAIL: $test_name"
+        echo "   Actual: '$output'"
+    fi
+done
+diff_cases=(
+    "good addronce|inode 6: size 0 -> 512, direct 0: 0 -> 50
+inode 6: data changed in direct 0"
+    "addronce good|inode 6: size 512 -> 0, direct 0: 50 -> 0
+inode 6: data changed in direct 0"
+    "good badinode|inode 4: type file -> type 4"
+    "good mrkfree|bitmap: - 345"
+    "good badindir1|inode 4: indirect block: 195 -> 1
+inode 4: data changed in indirect 0
+bitmap: - 195-196"
+)
+for case in "${diff_cases[@]}"; do
+    pair=${case%%|*}
+    expected=${case#*|}
+    output=$("$EXEC_FILE" diff "$SCRIPT_DIR/${pair% *}" "$SCRIPT_DIR/${pair#* }" 2>&1)
+    if [ $? -eq 1 ] && [ "$output" == "$expected" ]; then
+        echo "PASS: diff $pair"
     else
-        if [ $exit_code -eq 1 ] && [ "$output" == "$expected" ]; then
-            test_passed=true
+        echo "FAIL: diff $pair"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
+    fi
+    for name in $pair; do
+        [ -f "$packed_dir/$name.gz" ] || gzip -c < "$SCRIPT_DIR/$name" > "$packed_dir/$name.gz"
+    done
+    output=$("$EXEC_FILE" diff "$packed_dir/${pair% *}.gz" "$packed_dir/${pair#* }.gz" 2>&1)
+    if [ $? -eq 1 ] && [ "$output" == "$expected" ]; then
+        echo "PASS: diff $pair (gzip)"
+    else
+        echo "FAIL: diff $pair (gzip)"
+        echo "   Expected: '$expected'"
+        echo "   Actual:   '$output'"
+    fi
+done
+rm -rf "$packed_dir"
+
+# 15. Block sizes: consistent images with 1 KB and 4 KB blocks, made by
+# bench/mkimage.c built for each size, check clean however they are read,
+# with the size found from the superblock or given; a broken inode is found;
+# and an indirect entry past slot 255 is reported with both owners
+geo_dir=$(mktemp -d)
+u32() {
+    od -An -tu4 -j "$2" -N4 "$1" | tr -d ' '
+}
+for bsize in 1024 4096; do
+    echo "Mode: block size $bsize"
+    image="$geo_dir/img$bsize"
+    if ! gcc "$SCRIPT_DIR/../bench/mkimage.c" -DBSIZE=$bsize -o "$geo_dir/mkimage" -Wall -Werror -O -std=gnu11 ||
+       ! "$geo_dir/mkimage" -s 4 -x 20 -l 10 "$image" > /dev/null; then
+        echo "FAIL: mkimage"
+        continue
+    fi
+    gzip -c < "$image" > "$image.gz"
+    for args in "" "-j 4" "--io=stream" "--engine=sort" "--quick" "--reach" "--bsize=$bsize" "--index=$geo_dir/idx"; do
+        output=$("$EXEC_FILE" $args "$image" 2>&1)
+        if [ $? -eq 0 ] && [ -z "$output" ]; then
+            echo "PASS: clean${args:+ ${args//$geo_dir\//}}"
+        else
+            echo "FAIL: clean${args:+ ${args//$geo_dir\//}}"
+            echo "   Actual: '$output'"
+        fi
+    done
+    for args in "$image.gz" "diff $image $image"; do
+        output=$("$EXEC_FILE" $args 2>&1)
+        if [ $? -eq 0 ] && [ -z "$output" ]; then
+            echo "PASS: ${args//$geo_dir\//}"
+        else
+            echo "FAIL: ${args//$geo_dir\//}"
+            echo "   Actual: '$output'"
         fi
+    done
+    output=$("$EXEC_FILE" --bsize=512 "$image" 2>&1)
+    if [ $? -eq 1 ] && [ -n "$output" ]; then
+        echo "PASS: --bsize=512"
+    else
+        echo "FAIL: --bsize=512"
     fi
 
-    # Output Result
-    if [ "$test_passed" = true ]; then
-        echo -e "PASS: $test_name"
+    # Rule 1: the root inode (inode 1, in block 2) gets type 5
+    cp "$image" "$geo_dir/badinode"
+    printf '\x05\x00' | dd of="$geo_dir/badinode" bs=1 seek=$((2 * bsize + 64)) conv=notrunc 2> /dev/null
+    output=$("$EXEC_FILE" "$geo_dir/badinode" 2>&1)
+    if [ $? -eq 1 ] && [ "$output" == "${rule_messages[1]}" ]; then
+        echo "PASS: badinode"
     else
-        echo -e "FAIL: $test_name"
-        
-        # Only print details if it's a BAD image failure (as requested)
-        if [ "$rule_id" != "GOOD" ]; then
-            echo "   Rule:     #$display_rule"
+        echo "FAIL: badinode"
+        echo "   Actual: '$output'"
+    fi
+
+    # Rule 8: the first file with an indirect block also names the block of
+    # its entry 0 in its last entry (NINDIRECT - 1)
+    ninodes=$(u32 "$image" $((bsize + 8)))
+    for ((inum = 1; inum < ninodes; inum++)); do
+        indirect=$(u32 "$image" $((2 * bsize + inum * 64 + 12 + 12 * 4)))
+        [ "$indirect" -ne 0 ] && break
+    done
+    last=$((bsize / 4 - 1))
+    first=$(u32 "$image" $((indirect * bsize)))
+    cp "$image" "$geo_dir/addronce"
+    dd if="$image" of="$geo_dir/addronce" bs=1 skip=$((indirect * bsize)) seek=$((indirect * bsize + last * 4)) count=4 conv=notrunc 2> /dev/null
+    expected="${rule_messages[8]} [rule 8, inode $inum, block $first (indirect $last), first used by inode $inum (indirect 0)]"
+    for args in "--all" "--all --engine=sort" "--all --io=stream"; do
+        output=$("$EXEC_FILE" $args "$geo_dir/addronce" 2>&1 | head -n 1)
+        if [ "$output" == "$expected" ]; then
+            echo "PASS: addronce $args"
+        else
+            echo "FAIL: addronce $args"
             echo "   Expected: '$expected'"
             echo "   Actual:   '$output'"
         fi
-        # Good images failing print nothing extra, just "FAIL: test_name"
-    fi
+    done
+done
+rm -rf "$geo_dir"
+
+# 16. Bad superblocks: good with no blocks, with more data blocks than
+# blocks, or with its data area over the inode table is refused by every
+# engine rather than checked
+sb_dir=$(mktemp -d)
+for geometry in "size 0:0 995" "nblocks 2000:1024 2000" "nblocks 1020:1024 1020"; do
+    read -r size nblocks <<< "${geometry#*:}"
+    cp "$SCRIPT_DIR/good" "$sb_dir/image"
+    put "$sb_dir/image" 512 4 "$size"; put "$sb_dir/image" 516 4 "$nblocks"
+    for mode in "" "--engine=sort" "--engine=sort --mem-limit=64K" "--io=stream"; do
+        output=$("$EXEC_FILE" $mode "$sb_dir/image" 2>&1)
+        if [ $? -eq 1 ] && [ "$output" == "image is truncated or has a bad superblock." ]; then
+            echo "PASS: ${geometry%%:*}${mode:+ $mode}"
+        else
+            echo "FAIL: ${geometry%%:*}${mode:+ $mode}"
+            echo "   Actual: '$output'"
+        fi
+    done
+done
+rm -rf "$sb_dir"
+
+# 17. Prefetch: no lookahead, a lookahead of one block, or one past the end
+# of every image gives each image the same verdict as the default
+for test_name in $(echo "${!test_rules[@]}" | tr ' ' '\n' | sort); do
+    for io in "--io=mmap" "--io=stream"; do
+        expected=$("$EXEC_FILE" $io "$SCRIPT_DIR/$test_name" 2>&1)
+        expected_code=$?
+        for prefetch in 0 1 100000; do
+            output=$("$EXEC_FILE" $io --prefetch=$prefetch "$SCRIPT_DIR/$test_name" 2>&1)
+            if [ $? -eq $expected_code ] && [ "$output" == "$expected" ]; then
+                echo "PASS: $test_name $io --prefetch=$prefetch"
+            else
+                echo "FAIL: $test_name $io --prefetch=$prefetch"
+                echo "   Expected: '$expected'"
+                echo "   Actual:   '$output'"
+            fi
+        done
+    done
 done
 
 # Cleanup